@@ -9,21 +9,57 @@
 #define	FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * The tools (cs1550_bench.c, cs1550_mkfs.c, cs1550_fsck.c, cs1550_replay.c)
+ * define CS1550_NO_MAIN and include this file. That leaves out the FUSE
+ * entry point and adds what only the tools call. None of them calls all
+ * of what they share with the mount either, so that isn't static when they
+ * are built: it is marked CS1550_API.
+ */
+#ifdef CS1550_NO_MAIN
+#define CS1550_API
+#else
+#define CS1550_API static
+#endif
 
 //size of a disk block
 #define	BLOCK_SIZE 512
 
-//we'll use 8.3 filenames
-#define	MAX_FILENAME 8
-#define	MAX_EXTENSION 3
+//names can be up to 255 bytes, like on most other filesystems
+#define	MAX_NAME 255
+
+/*
+ * Entries don't hold their names, only where to find them: the names of a
+ * directory are packed one after the other into its name area, a chain of
+ * blocks laid out like file blocks that starts at the nNames of the
+ * directory block. So every entry has the same size however long its name,
+ * and lookups can compare lengths and hashes before reading any names.
+ */
+struct cs1550_name
+{
+    unsigned int nHash;         //FNV-1a of the name, see name_hash()
+    unsigned int nOffset;       //where the name starts in the name area
+    unsigned char nLength;      //length of the name, 1 to MAX_NAME
+} __attribute__((packed));
 
 //How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+#define MAX_FILES_IN_DIR ((BLOCK_SIZE - sizeof(int) - sizeof(long)) / (sizeof(struct cs1550_name) + sizeof(size_t) + sizeof(long)))
 
 //The attribute packed means to not align these things
 struct cs1550_directory_entry
@@ -33,20 +69,21 @@ struct cs1550_directory_entry
     
     struct cs1550_file_directory
     {
-        char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
-        char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
+        struct cs1550_name name;        //where to find the filename
         size_t fsize;					//file size
         long nStartBlock;				//where the first block is on disk
     } __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
     
     //This is some space to get this to be exactly the size of the disk block.
     //Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+    char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int) - sizeof(long)];
+
+    long nNames;        //byte position of the first block of the name area, 0 if empty
 } ;
 
 typedef struct cs1550_root_directory cs1550_root_directory;
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+#define MAX_DIRS_IN_ROOT ((BLOCK_SIZE - sizeof(int) - sizeof(long)) / (sizeof(struct cs1550_name) + sizeof(long)))
 
 struct cs1550_root_directory
 {
@@ -54,13 +91,15 @@ struct cs1550_root_directory
     //Needs to be less than MAX_DIRS_IN_ROOT
     struct cs1550_directory
     {
-        char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
+        struct cs1550_name name;        //where to find the directory name
         long nStartBlock;				//where the directory block is on disk
     } __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
     
     //This is some space to get this to be exactly the size of the disk block.
     //Don't use it for anything.
-    char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+    char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int) - sizeof(long)];
+
+    long nNames;        //byte position of the first block of the name area, 0 if empty
 } ;
 
 
@@ -83,1082 +122,8203 @@ struct cs1550_disk_block
 
 typedef struct cs1550_disk_block cs1550_disk_block;
 
-int get_directory_pos(char * directory_name);
-int get_file_pos(char * filename, char * extension, int dir_pos);
-size_t get_file_size(char * filename, char * extension, int dir_pos);
+//The low bits of an nStartBlock are always 0 for a block position, so they
+//hold flags about the file
+#define FILE_FLAGS (BLOCK_SIZE - 1)
+#define FILE_COMPRESSED 1       //stored in compressed chunks, see below
+#define FILE_DEDUP 2            //stored in chunks shared with identical ones
+#define FILE_CHUNKED (FILE_COMPRESSED | FILE_DEDUP)
+#define FILE_INLINE 4           //has no blocks yet, its data is in the name area
 
+/*
+ * Files start out inline: instead of a block of their own, their data (at
+ * most INLINE_MAX bytes) follows their name in the directory's name area,
+ * and the position in nStartBlock is 0. Such a file takes no allocation and
+ * is read along with its name. It is moved into blocks, laid out as its
+ * other flags say, once a write takes it past INLINE_MAX.
+ */
+#define INLINE_MAX 128
 
-// ============================================================================
-// ============================= cs1550_getattr() =============================
-// ============================================================================
 /*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not.
+ * A compressed file is split into CHUNK_SIZE chunks that are compressed one
+ * by one. Its chain holds the chunk index: the data of every block in it is
+ * an array of cs1550_chunk_ref, one per chunk. A chunk is stored in its own
+ * chain, from nStart, with nothing else in its blocks.
  *
- * man -s 2 stat will show the fields of a stat structure
+ * A deduplicated file is laid out the same way (its chunks are compressed
+ * only if it is FILE_COMPRESSED too), but its chunks are shared with every
+ * other chunk with the same contents. Each one has an entry in the chunk
+ * table, a chain of blocks from the superblock's nChunkTable whose data are
+ * arrays of cs1550_chunk_entry, counting the refs to it.
  */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
+#define CHUNK_SIZE 4096
+#define CHUNK_RAW 0x80000000u   //in nLength: the chunk didn't compress and is stored as is
+
+struct cs1550_chunk_ref
 {
-    printf("\n===getattr()===\n");
+    long nStart;                //first block of the chunk, 0 if it isn't there
+    unsigned int nLength;       //bytes stored, | CHUNK_RAW
+} __attribute__((packed));
 
-    int res = -ENOENT;
-    int count = 0;
-    char directory_name[MAX_FILENAME + 1];      // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
-    
-    memset(stbuf, 0, sizeof(struct stat));
-    memset(directory_name, 0, (MAX_FILENAME + 1));
-    memset(filename, 0, (MAX_FILENAME + 1));
-    memset(extension, 0, (MAX_EXTENSION + 1));
-    
-    /******************
-     * If path is root
-     ******************/
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        res=0;
-    }
-    //If path isn't the root
-    else {
-        count = sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
-        
-        printf("directory_name: %s\n", directory_name);
-        printf("filename: %s\n", filename);
-        printf("extension: %s\n", extension);
-        
-        FILE *file = fopen(".disk", "rb+"); // open .disk
-        
-        cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));
-        cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
-        
-        //Seek to the position of the root directory
-        fseek(file, 0, SEEK_SET);
-        //Read into memory
-        fread(root_dir, sizeof(cs1550_root_directory), 1, file);
-        
-        //Loop through the array of directories in root for "directory_name"
-        int i = 0;
-        for(i=0; i < root_dir->nDirectories; i++){
-            res = -ENOENT;
-            //If "directory_name" exists as a subdirectory
-            if(strcmp(root_dir->directories[i].dname, directory_name)==0){
-                int cur = 0;
-                cur = root_dir->directories[i].nStartBlock; //byte position of cur subdirectory
-                /************************
-                 * If path is a directory
-                 ************************/
-                if(count == 1){
-                    //Might want to return a structure with these fields
-                    stbuf->st_mode = S_IFDIR | 0755;
-                    stbuf->st_nlink = 2;
-                    res = 0;
-                }
-                /*******************
-                 * If path is a file
-                 *******************/
-                else if (count > 1){
-                    size_t file_size = -1;
-                    int found_file = 0;
-                    
-                    fseek(file, cur, SEEK_SET);                                 // seek to correct position of the subdirectory
-                    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);  // get block
-                    
-                    //if directory is empty, no file found
-                    if(dir_entry->nFiles == 0){
-                        found_file=0;
-                    } else {
-                        //Loop through all files in cur sub-directory for "filename"
-                        int i = 0;
-                        for(i=0; i<dir_entry->nFiles; i++){
-                            //if find file in current sub-directory that matches filename in path
-                            if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-                                file_size = dir_entry->files[i].fsize;  //get size of the file
-                                found_file = 1;
-                                break;
-                            }
-                        }
-                    }
-                    //if file exist, return permission and size; else return -ENOENT
-                    if(found_file==1){
-                        stbuf->st_mode = S_IFREG | 0666;
-                        stbuf->st_nlink = 1;                //file links
-                        stbuf->st_size = file_size;         //file size
-                        res = 0;
-                    } else {
-                        res = -ENOENT;
-                    }
-                }
-                //break out of loop if found subdirectory (or file)
-                break;
-            }
-        }
-        //free up mem space allocated for structs
-        free(root_dir);
-        free(dir_entry);
-        
-        //close disk file
-        fclose(file);
-    }
-    return res;
-}
+//How many chunks does one index block cover?
+#define CHUNK_REFS (MAX_DATA_IN_BLOCK / sizeof(struct cs1550_chunk_ref))
+
+//most blocks one chunk can take, stored raw
+#define CHUNK_MAX_BLOCKS ((CHUNK_SIZE + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK)
+
+struct cs1550_chunk_entry
+{
+    unsigned long nHash;        //chunk_hash() of the chunk's contents
+    long nStart;                //first block of the chunk, 0 if the entry is free
+    unsigned int nLength;       //as in its refs
+    unsigned int nRefs;         //refs to it in chunk indexes
+} __attribute__((packed));
+
+//How many entries fit in one chunk table block?
+#define CHUNK_ENTRIES (MAX_DATA_IN_BLOCK / sizeof(struct cs1550_chunk_entry))
 
-// ============================================================================
-// ============================= cs1550_readdir() =============================
-// ============================================================================
 /*
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
+ * A snapshot is a frozen copy of the image as it was when it was taken (see
+ * the snapshots section below). The superblock's nSnapRoot is a copy of the
+ * root directory as it was then, nSnapMap a chain of blocks whose data say,
+ * a byte per block, which blocks the snapshot still needs (SNAP_HELD, or
+ * SNAP_RELEASED once the image itself no longer uses them), and nSnapRemap a
+ * chain of cs1550_remap_entry: where the image's own copy of a held block
+ * it has changed since is.
  */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                          off_t offset, struct fuse_file_info *fi)
+#define SNAP_HELD     1
+#define SNAP_RELEASED 2
+
+struct cs1550_remap_entry
 {
-    printf("\n===readdir()===\n");
-    //Since we're building with -Wall (all warnings reported) we need
-    //to "use" every parameter, so let's just cast them to void to
-    //satisfy the compiler
-    (void) offset;
-    (void) fi;
-    int res = 0;
-    char directory_name[MAX_FILENAME + 1];      // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
-    
-    memset(directory_name, 0, (MAX_FILENAME + 1));   	// initialize directory to 0
-    memset(filename, 0, (MAX_FILENAME + 1));   	        // initialize filename to 0
-    memset(extension, 0, (MAX_EXTENSION + 1));		    // initialize extension to 0
+    long nFrom;                 //held block the image refers to, 0 if the entry is free
+    long nTo;                   //where the image's copy of it is
+};
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
-    
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+//How many entries fit in one remap block?
+#define REMAP_ENTRIES (MAX_DATA_IN_BLOCK / sizeof(struct cs1550_remap_entry))
 
-    //Seek to the position of the root directory
-    fseek(file, 0, SEEK_SET);
-    //Read into memory
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
-    
-    //If path is not root
-    if (strcmp(path, "/") != 0){
-        
-        //Loop through the array of directories in root for "directory_name"
-        long cur = 0;
-        int found_dir = -1;
-        int i=0;
-        for(i=0; i < root_dir->nDirectories; i++){
-            //If "directory_name" exists as a subdirectory
-            if(strcmp(root_dir->directories[i].dname, directory_name)==0){
-                found_dir = 1;
-                cur = root_dir->directories[i].nStartBlock; //byte position of cur subdirectory
-            }
-        }
-        //if subdirectory exists
-        if(found_dir==1){
-            fseek(file, cur , SEEK_SET);                //seek to subdirectory position
-            fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
-            filler(buf, ".", NULL, 0);
-            filler(buf, "..", NULL, 0);
-            //loop through all files in subdirectory
-            int j = 0;
-            for(j=0; j<dir_entry->nFiles; j++){
-                if (strcmp(dir_entry->files[j].fname, "")!=0){       //if file has extension
-                    char fullname[13];                              //intialize an array to store filename
-                    strcpy(fullname, dir_entry->files[j].fname);    //append filename
-                    strcat(fullname, ".");                          //append .
-                    strcat(fullname, dir_entry->files[j].fext);     //append extension
-                    filler(buf, fullname, NULL, 0);                 //add to buffer
-                }
-            }
-            res = 0;
-            fclose(file);
-            //free up mem space allocated for structs
-            free(root_dir);
-            free(dir_entry);
-            
-            return res;
-        } 
-        //if subdirectory doesn't exist
-        else {
-            res = -ENOENT;
-        }
-        
-    }
-    //If path is root
-    else {
-    	//the filler function allows us to add entries to the listing
-        //read the fuse.h file for a description (in the ../include dir)
-        filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
-        
-        fseek(file, 0, SEEK_SET);
-        fread(root_dir, sizeof(cs1550_root_directory), 1, file);
-        
-        //print all directories in root directory
-        int i=0;
-        for(i=0; i<root_dir->nDirectories; i++){
-            filler(buf, root_dir->directories[i].dname, NULL, 0);
-        }
-        res = 0;
-    }
-    fclose(file);
-    //free up mem space allocated for structs
-   	free(root_dir);
-   	free(dir_entry);
-    
-    return res;
-}
+//Images made by cs1550_mkfs (or upgraded at mount) describe their layout in a
+//superblock kept in block 1. nMagic can never be the nFiles of a directory
+//block nor the nNextBlock of a data block, so older images without a
+//superblock are still recognized.
+#define SUPER_BLOCK 1
+#define CS1550_MAGIC 0x35314353
+#define CS1550_VERSION 9        //2 added the journal, 3 the name areas, 4 compressed
+                                //files, 5 deduplicated ones, 6 checksums, 7 snapshots,
+                                //8 inline files, 9 the counts
 
-// ============================================================================
-// ============================== cs1550_mkdir() ==============================
-// ============================================================================
-/*
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int cs1550_mkdir(const char *path, mode_t mode)
+struct cs1550_superblock
 {
-    printf("\n===mkdir()===\n");
-    (void) path;
-    (void) mode;
-    char directory_name[MAX_FILENAME + 1];      // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
-    
-    memset(directory_name, 0, (MAX_FILENAME + 1));
-   	memset(filename, 0, (MAX_FILENAME + 1));
-   	memset(extension, 0, (MAX_EXTENSION + 1));
-    
-    FILE * file = fopen(".disk", "rb+");	
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));	
-   
-    fseek(file, 0, SEEK_SET);
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
-    
-    sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
-    
-    printf("directory_name: %s\n", directory_name);
-    printf("filename: %s\n", filename);
-    printf("extension: %s\n", extension);
-    
-    //check for errors
-    if(strcmp(path, "/") == 0){
-        return -EEXIST;
-    } else if(strlen(directory_name)>MAX_FILENAME){
-        return -ENAMETOOLONG;
-    } else if (strlen(filename)!=0 && strlen(directory_name)!=0){
-        return -EPERM;
-    } else {
-        //Make sure directory doesn't already exist. -EEXIST if does
-        int i = 0;
-        int dir_exist = -1;
-        if(root_dir->nDirectories == 0){
-            dir_exist = -1;
-        }
-        //else if root is not empty, loop through all subdirectories to check
-        else{
-            for(i=0; i<root_dir->nDirectories; i++){
-                if(strcmp(root_dir->directories[i].dname, directory_name)==0){
-                    dir_exist = 1; 
-                    break;
-                }
-            }
-        }
-        //path's directory name already exists, -EEXIST
-        if(dir_exist==1){
-            return -EEXIST;
-        }
-        //path's directory name doesn't exist
-        else {
-            char bitmap[10240]=""; 			//bitmap array represents 10240 blocks
-            memset(bitmap, 0, 10240); 		//initialize array to contain all 0s
-            int newdir_pos = -1; 			//block position for new directory
-            
-            //load bitmap from disk
-            fseek(file, -10240, SEEK_END);
-            fread(bitmap, 10240, 1, file);
-            
-            //look for free block for new directory
-            int i = 1; 	//skip root block
-            for(i = 1; i<10240; i++){
-                if(bitmap[i]==0){
-                    bitmap[i] = 1;
-                    newdir_pos = i;		//set new directory's block location
-                    break; 				//break out of search after find free block
-                }
-            }
-            
-            /*------------
-             * Update root
-             -------------*/
-            fseek(file, 0, SEEK_SET);
-            fread(root_dir, sizeof(cs1550_root_directory), 1, file);
-            
-            //set name and byte position of new directory
-            strcpy(root_dir->directories[(root_dir->nDirectories)].dname, directory_name);
-            printf("New directory \"%s\" written to block %i\n", directory_name, newdir_pos);
-            root_dir->directories[(root_dir->nDirectories)].nStartBlock = newdir_pos*512;
-            
-            //increment number of directories in root
-            root_dir->nDirectories = (root_dir->nDirectories) + 1;
-            fseek(file, 0, SEEK_SET);
-            fwrite(root_dir, sizeof(cs1550_root_directory), 1, file);
-            
-            /*-------------------------
-             * Initialize new directory
-             ------------------------*/
-            cs1550_directory_entry * new_dir = malloc(sizeof(cs1550_directory_entry));
-            memset(new_dir, 0, (MAX_FILENAME + 1)); 	//initialize new_dir to contain all 0s
-            fseek(file, newdir_pos*512, SEEK_SET);		//seek to mem position of new directory
-            new_dir->nFiles = 0; 						//initialize new directory's nFiles to 0
-            fwrite(new_dir, sizeof(cs1550_directory_entry),1,file); //write new_dir to disk
-            
-            /*--------------
-             * Update Bitmap
-             ---------------*/
-            fseek(file, -10240, SEEK_END);
-            fwrite(bitmap, sizeof(bitmap), 1, file);
-            
-            free(new_dir);
-        }
-    }
-    //free up mem space allocated for root
-   	free(root_dir);
-    fclose(file);
-    return 0;
+    unsigned int nMagic;        //CS1550_MAGIC
+    unsigned int nVersion;      //layout version, CS1550_VERSION
+    long nBlocks;               //total number of blocks in the image
+    long nBitmapBlock;          //first block of the bitmap, one byte per block
+    long nDataStart;            //first block the allocator may hand out
+    long nDataEnd;              //one past the last block the allocator may hand out
+    long nJournalStart;         //first block of the journal
+    long nJournalBlocks;        //size of the journal, 0 if there is none
+    long nChunkTable;           //first block of the chunk table, 0 if there is none
+    long nSumStart;             //first block of the checksums
+    long nSumBlocks;            //size of the checksums, 0 if there are none
+    long nMounted;              //1 while mounted, so the checksums and counts may be stale
+    long nSnapRoot;             //root directory of the snapshot, 0 if there is none
+    long nSnapMap;              //first block of its map, 0 if there is none
+    long nSnapRemap;            //first block of its remap table, 0 if there is none
+    long nFreeBlocks;           //free blocks in the data area, see counts_load()
+    long nDirs;                 //directories in the root
+    long nFiles;                //files in them
 
-}
+    //This is some space to get this to be exactly the size of the disk block.
+    char padding[BLOCK_SIZE - 2 * sizeof(unsigned int) - 16 * sizeof(long)];
+};
 
-/*
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
+typedef struct cs1550_superblock cs1550_superblock;
+
+//The journal is made of these. Its first block is a JOURNAL_SUPER saying
+//where replay starts, the rest hold transactions.
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_SUPER      1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT     3
+
+//How many block numbers fit in one descriptor?
+#define JOURNAL_TAGS ((BLOCK_SIZE - 4 * sizeof(unsigned int) - sizeof(unsigned long)) / sizeof(long))
+
+struct cs1550_journal_block
 {
-    (void) path;
-    return 0;
-}
+    unsigned int nMagic;        //JOURNAL_MAGIC
+    unsigned int nType;         //JOURNAL_SUPER, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+    unsigned long nSequence;    //transaction this block belongs to. In the
+                                //super: the first transaction to replay
+    unsigned int nCount;        //descriptor: block images following it. In the
+                                //super: journal block replay starts at
+    unsigned int nChecksum;     //commit: checksum of the rest of the transaction
+    long nHome[JOURNAL_TAGS];   //descriptor: where each image belongs
+
+    //This is some space to get this to be exactly the size of the disk block.
+    char padding[BLOCK_SIZE - 4 * sizeof(unsigned int) - sizeof(unsigned long)
+                 - JOURNAL_TAGS * sizeof(long)];
+};
+
+typedef struct cs1550_journal_block cs1550_journal_block;
+
+//A path split into its parts by path_parse(). Only /dir and /dir/name
+//exist in this filesystem.
+struct cs1550_path
+{
+    int depth;                          //0 = the root, 1 = a directory, 2 = a file
+    char dir[MAX_NAME + 1];             //directory name
+    char name[MAX_NAME + 1];            //filename
+    int dir_len;                        //length of dir
+    int name_len;                       //length of name
+    unsigned int dir_hash;              //hash of dir
+    unsigned int name_hash;             //hash of name
+};
 
-/******************************************************************************
- *
- *                                   PART 2
- *
- *****************************************************************************/
 
 // ============================================================================
-// ============================== cs1550_mknod() ==============================
+// ================================= logging ==================================
 // ============================================================================
 /*
- * Does the actual creation of a file. Mode and dev can be ignored.
+ * All diagnostics go to stderr through the LOG_* macros below. The level used
+ * at runtime comes from the "-o loglevel=N" mount option (0 = errors only,
+ * 4 = trace every byte written, default 1 = warnings).
  *
+ * Call sites above CS1550_LOG_MAX are removed by the preprocessor, arguments
+ * included. Release builds (-DNDEBUG) keep error/warn/info only, so the
+ * debug and trace calls in the read/write paths cost nothing there.
  */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
-{
-    printf("\n===mknod()===\n");
-    (void) mode;
-    (void) dev;
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
 
-    char directory_name[MAX_FILENAME + 1];     // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
-    memset(directory_name, 0, (MAX_FILENAME + 1));      // initialize directory to 0
-    memset(filename, 0, (MAX_FILENAME + 1));            // initialize filename to 0
-    memset(extension, 0, (MAX_EXTENSION + 1));          // initialize extension to 0
+#ifndef CS1550_LOG_MAX
+#ifdef NDEBUG
+#define CS1550_LOG_MAX LOG_LEVEL_INFO
+#else
+#define CS1550_LOG_MAX LOG_LEVEL_TRACE
+#endif
+#endif
 
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory)); 
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
-    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block)); 
-   
-    fseek(file, 0, SEEK_SET);
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
-    
-    sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
+static int log_level = LOG_LEVEL_WARN;
 
-    printf("directory_name: %s\n", directory_name);
-    printf("filename: %s\n", filename);
-    printf("extension: %s\n", extension);
-    
-    int dir_pos = -1;   //directory's block position
-    /* ----------------
-     * check for errors
-       ----------------*/
-    if(strlen(filename)>MAX_FILENAME || strlen(extension)>MAX_EXTENSION){
-        printf("ENAMETOOLONG\n");
-        return -ENAMETOOLONG;
-    } else if (strlen(filename)==0 && strlen(directory_name)!=0){
-        printf("EPERM\n");
-        return -EPERM;
-    } else {
-        int file_exist = -1;
-        //search all directories in root to find directory entry position
-        int i = 0;
-        for(i=0; i<root_dir->nDirectories; i++){
-            if(strcmp(root_dir->directories[i].dname, directory_name)==0){
-                dir_pos = root_dir->directories[i].nStartBlock; //byte position of dir on disk
-                break;
-            }
-        }
-        //use directory entry position to check if file already exists in directory
-        fseek(file, dir_pos, SEEK_SET);
-        fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+static const char *log_names[] = { "error", "warn", "info", "debug", "trace" };
 
-        //search all files under directory to check if file already exist
-        int j = 0;
-        for(j=0; j<dir_entry->nFiles; j++){
-            if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-                file_exist=1;
-                break;
-            }
-        }
-        if(file_exist==1){
-            printf("EEXIST\n");
-            return -EEXIST;
-        }
-    }
+//true if messages of level lvl are compiled in and currently enabled
+#define LOG_ENABLED(lvl) (CS1550_LOG_MAX >= (lvl) && log_level >= (lvl))
 
-    // -----------------------
-    // * no errors, create file
-    // -----------------------
-    char bitmap[10240]="";          //bitmap array represents 10240 blocks
-    memset(bitmap, 0, 10240);       //initialize array to contain all 0s
-    int newfile_pos = -1;           //block position for new file
-    
-    //load bitmap from disk
-    fseek(file, -10240, SEEK_END);
-    fread(bitmap, 10240, 1, file);
-    
-    //look for free block for new file
-    int i = 1;  //skip root block
-    for(i = 1; i<10240; i++){
-        if(bitmap[i]==0){
-            bitmap[i] = 1;
-            newfile_pos = i;     //set new file's block location
-            break;               //break out of search after find free block
-        }
-    }
+#define LOG_AT(lvl, ...) \
+    do { if (log_level >= (lvl)) log_printf((lvl), __func__, __VA_ARGS__); } while (0)
 
-    /*--------------------
-     * Update subdirectory
-     --------------------*/
-    //seek to position of subdirectory
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
-    
-    //set name and byte position of new file
-    strcpy(dir_entry->files[(dir_entry->nFiles)].fname, filename);
-    strcpy(dir_entry->files[(dir_entry->nFiles)].fext, extension);
-    dir_entry->files[(dir_entry->nFiles)].fsize = 0;
-    dir_entry->files[(dir_entry->nFiles)].nStartBlock = newfile_pos*512;
-    printf("New file %s.%s written to block %i\n", filename, extension, newfile_pos);
-    //increment number of file in subdirectory
-    dir_entry->nFiles = (dir_entry->nFiles) + 1;
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
 
-    fseek(file, dir_pos, SEEK_SET);
-    fwrite(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+#if CS1550_LOG_MAX >= LOG_LEVEL_INFO
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)  ((void) 0)
+#endif
 
+#if CS1550_LOG_MAX >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
 
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
-    printf("--------------------\nThere are %i files under directory %s \n", dir_entry->nFiles, directory_name);
-    int m;
-    for (m = 0; m < dir_entry->nFiles; m++) {
-        printf("File %i: %s.%s has size %zu and is at block %ld \n", m, dir_entry->files[m].fname, 
-        dir_entry->files[m].fext, dir_entry->files[m].fsize, (dir_entry->files[m].nStartBlock)/512);
-    }   
-    /*--------------
-     * Update Bitmap
-     ---------------*/
-    fseek(file, -10240, SEEK_END);
-    fwrite(bitmap, sizeof(bitmap), 1, file);
+#if CS1550_LOG_MAX >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void) 0)
+#endif
 
-    //initialize block for new file
-    fseek(file, newfile_pos*512, SEEK_SET);
-    fwrite(file_block, sizeof(cs1550_disk_block), 1, file);
-    
-    free(root_dir);
-    free(dir_entry);
-    free(file_block);
+static void log_printf(int level, const char *func, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
 
-    fclose(file);
-    return 0;
+static void log_printf(int level, const char *func, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "cs1550 %s %s: %s\n", log_names[level], func, line);
 }
 
 // ============================================================================
-// ============================== cs1550_unlink() =============================
+// ================================ statistics ================================
 // ============================================================================
 /*
- * Deletes a file
+ * Per-operation call counts, errors and latency histograms, plus counters for
+ * the disk work done underneath (blocks read/written, bitmap scans, hops
+ * walked along nNextBlock chains). Everything is updated with atomic adds so
+ * the handlers can be called from several FUSE threads at once.
+ *
+ * The numbers can be read at any time from the virtual file /.stats and are
+ * written next to the image, as <image>.stats, when the filesystem is
+ * unmounted.
  */
-static int cs1550_unlink(const char *path)
-{
-    (void) path;
-    printf("\n===unlink()===\n");
+#define STATS_PATH "/.stats"
 
-    char directory_name[MAX_FILENAME + 1];      // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
+//the image this filesystem lives in, set with -o disk=PATH
+static const char *disk_path = ".disk";
+#define STATS_BUF_SIZE 16384
 
-    memset(directory_name, 0, (MAX_FILENAME + 1));      // initialize directory to 0
-    memset(filename, 0, (MAX_FILENAME + 1));            // initialize filename to 0
-    memset(extension, 0, (MAX_EXTENSION + 1));          // initialize extension to 0
+//latency bucket b holds calls that took less than 2^b microseconds
+#define STATS_BUCKETS 24
 
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory)); 
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
-    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block));  
+enum cs1550_op {
+    OP_GETATTR, OP_READDIR, OP_MKDIR, OP_RMDIR, OP_MKNOD, OP_UNLINK,
+    OP_READ, OP_WRITE, OP_TRUNCATE, OP_OPEN, OP_FLUSH, OP_RELEASE, OP_FSYNC,
+    OP_OPENDIR, OP_RELEASEDIR, OP_LOOKUP, OP_FORGET, OP_SETATTR, OP_STATFS,
+    NUM_OPS
+};
 
-    fseek(file, 0, SEEK_SET);
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
+static const char *op_names[NUM_OPS] = {
+    "getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink",
+    "read", "write", "truncate", "open", "flush", "release", "fsync",
+    "opendir", "releasedir", "lookup", "forget", "setattr", "statfs"
+};
+
+struct cs1550_op_stats
+{
+    unsigned long calls;                    //times the handler was called
+    unsigned long errors;                   //calls that returned < 0
+    unsigned long total_ns;                 //sum of all latencies
+    unsigned long max_ns;                   //slowest call seen
+    unsigned long hist[STATS_BUCKETS];      //latency histogram
+};
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
+static struct
+{
+    struct cs1550_op_stats ops[NUM_OPS];
+    unsigned long block_reads;              //blocks read from .disk
+    unsigned long block_writes;             //blocks written to .disk
+    unsigned long bitmap_scans;             //searches of the bitmap for a free block
+    unsigned long chain_hops;               //nNextBlock links followed
+    unsigned long journal_commits;          //batches committed to the journal
+    unsigned long journal_blocks;           //block images in those batches
+    unsigned long syncs;                    //fdatasync calls on .disk
+    unsigned long chunks_read;              //chunks loaded
+    unsigned long chunks_written;           //chunks stored
+    unsigned long chunk_bytes_in;           //bytes of data in the chunks stored
+    unsigned long chunk_bytes_out;          //bytes they took once compressed
+    unsigned long dedup_hits;               //chunks shared instead of stored
+    unsigned long dedup_copies;             //shared chunks copied to be written
+    unsigned long checksum_reads;           //blocks read whose checksum was verified
+    unsigned long checksum_errors;          //blocks read that didn't match it
+    unsigned long defrag_files;             //files moved into contiguous blocks
+    unsigned long defrag_blocks;            //blocks they had
+    unsigned long defrag_passes;            //passes of the background defragmenter
+    unsigned long frag_before;              //fragmented files before its last pass
+    unsigned long extents_before;           //extents of all the files then
+    unsigned long frag_after;               //fragmented files after it
+    unsigned long extents_after;            //extents after it
+    unsigned long snapshot_copies;          //held blocks copied on their first write
+    unsigned long inline_promoted;          //inline files that grew into blocks
+    unsigned long writeback_blocks;         //cached blocks written back
+    unsigned long writeback_runs;           //writes they took, one per run of blocks
+    unsigned long writeback_stalls;         //writes that found the cache full
+    unsigned long alloc_spilled;            //blocks allocated outside their hint's group
+    unsigned long ops_undone;               //operations that failed underneath, see undo
+} stats;
 
-    int dir_pos = -1;       //directory byte position on disk
-    int file_pos = -1;      //file byte position on disk
-    dir_pos = get_directory_pos(directory_name);
-    file_pos = get_file_pos(filename, extension, dir_pos);
+#define stats_add(counter, n) __atomic_fetch_add((counter), (n), __ATOMIC_RELAXED)
 
-    //if file is not found
-    if(file_pos==-1){
-        return -ENOENT;
-    } 
-    //if path is a directory
-    else if (strlen(directory_name)!=0 && strlen(filename)==0){
-        return -EISDIR;
-    }
+static unsigned long stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
 
-    /*-----------------------
-     * Update Directory Entry
-     -----------------------*/
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
-
-    //iterate through all file entries in directory to find file to delete
-    int i = 0;
-    for(i = 0; i < MAX_FILES_IN_DIR; i++){
-        if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-            //clear all data of the file entry
-            strcpy(dir_entry->files[i].fname, "");
-            strcpy(dir_entry->files[i].fext, "");
-            dir_entry->files[i].fsize = 0;
-            dir_entry->files[i].nStartBlock = 0;
-
-            //Shift all file positions under directory
-            int j;
-            for (j = i; j < dir_entry->nFiles-1; j++) {
-                dir_entry->files[j] = dir_entry->files[j+1];
-            }       
-            strcpy(dir_entry->files[dir_entry->nFiles-1].fname, "");
-            strcpy(dir_entry->files[dir_entry->nFiles-1].fext, "");
-            dir_entry->files[dir_entry->nFiles-1].fsize = 0;
-            
-            dir_entry->nFiles -= 1;
+//record one finished call of op that started at start_ns and returned res
+static void stats_record(enum cs1550_op op, unsigned long start_ns, int res)
+{
+    struct cs1550_op_stats *s = &stats.ops[op];
+    unsigned long ns = stats_now() - start_ns;
+    unsigned long us = ns / 1000;
+    int b = 0;
 
-            break;
-        }
+    while (b < STATS_BUCKETS - 1 && us >= (1UL << b)) {
+        b++;
+    }
+    stats_add(&s->calls, 1);
+    if (res < 0) {
+        stats_add(&s->errors, 1);
     }
+    stats_add(&s->total_ns, ns);
+    stats_add(&s->hist[b], 1);
 
-    //decrement the number of files in directory
-    // dir_entry->nFiles = dir_entry->nFiles - 1;
+    unsigned long max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
 
-    printf("Number of files under dir %i\n", dir_entry->nFiles);
-    //update directory entry
-    fseek(file, dir_pos, SEEK_SET);
-    fwrite(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+//latency (in us) below which pct percent of the calls of s completed
+static unsigned long stats_percentile(struct cs1550_op_stats *s, unsigned long calls, int pct)
+{
+    unsigned long want = (calls * pct + 99) / 100;
+    unsigned long seen = 0;
+    int b;
+    for (b = 0; b < STATS_BUCKETS; b++) {
+        seen += s->hist[b];
+        if (seen >= want) {
+            return 1UL << b;
+        }
+    }
+    return 1UL << (STATS_BUCKETS - 1);
+}
 
-    /*------------------------
-     * Update File Disk Blocks
-     ------------------------*/
-    //clear all file blocks
-    fseek(file, file_pos, SEEK_SET);
-    fread(file_block, sizeof(cs1550_disk_block), 1, file);
+//format the statistics as text into buf, returns the length of the text
+static int stats_render(char *buf, size_t size)
+{
+    int len = 0;
+    int i, b;
 
-    //set all bytes in first file block to 0
-    memset(file_block, 0, sizeof(MAX_DATA_IN_BLOCK));
+#define STATS_PRINT(...) \
+    len += snprintf((size_t)len < size ? buf + len : NULL, \
+                    (size_t)len < size ? size - len : 0, __VA_ARGS__)
 
-    fseek(file, file_pos, SEEK_SET);
-    fwrite(file_block, sizeof(cs1550_disk_block), 1, file);
+    STATS_PRINT("%-10s %10s %8s %10s %10s %10s %10s\n",
+                "op", "calls", "errors", "avg_us", "p50_us", "p99_us", "max_us");
+    for (i = 0; i < NUM_OPS; i++) {
+        struct cs1550_op_stats *s = &stats.ops[i];
+        unsigned long calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+        if (calls == 0) {
+            continue;
+        }
+        STATS_PRINT("%-10s %10lu %8lu %10lu %10lu %10lu %10lu\n", op_names[i], calls,
+                    s->errors, s->total_ns / calls / 1000,
+                    stats_percentile(s, calls, 50), stats_percentile(s, calls, 99),
+                    s->max_ns / 1000);
+    }
 
-    /*--------------
-     * Update Bitmap
-     --------------*/
-    //load bitmap
-    char bitmap[10240]="";          //bitmap array represents 10240 blocks
-    memset(bitmap, 0, 10240);       //initialize array to contain all 0s
-    
-    //mark deleted file's position in bitmap to free (0)
-    fseek(file, -10240, SEEK_END);
-    fread(bitmap, 10240, 1, file);
-    bitmap[file_pos/512] = 0;
-    printf("Deleted file at block %i\n", file_pos/512);
-
-    //if file occupies more than 1 block, continue and clear
-    while(file_block->nNextBlock != 0){
-        printf("There's more than 1 block\n");
-        file_pos = file_block->nNextBlock;  //update position of next deleting block
-        file_block->nNextBlock = 0;         //unlink next block from current block
-        fwrite(file_block, sizeof(cs1550_disk_block), 1, file); //update current block
-        
-        //update new block with new file block position
-        fseek(file, file_pos, SEEK_SET);    //seek to new block to delete
-        fread(file_block, sizeof(cs1550_disk_block), 1, file);
+    STATS_PRINT("\nlatency histogram (calls per bucket, bucket = below N us)\n");
+    for (i = 0; i < NUM_OPS; i++) {
+        struct cs1550_op_stats *s = &stats.ops[i];
+        if (s->calls == 0) {
+            continue;
+        }
+        STATS_PRINT("%-10s", op_names[i]);
+        for (b = 0; b < STATS_BUCKETS; b++) {
+            if (s->hist[b] != 0) {
+                STATS_PRINT(" <%lu:%lu", 1UL << b, s->hist[b]);
+            }
+        }
+        STATS_PRINT("\n");
+    }
 
-        memset(file_block, 0, sizeof(MAX_DATA_IN_BLOCK));
+    STATS_PRINT("\nblock_reads  %lu\n", stats.block_reads);
+    STATS_PRINT("block_writes %lu\n", stats.block_writes);
+    STATS_PRINT("bitmap_scans %lu\n", stats.bitmap_scans);
+    STATS_PRINT("chain_hops   %lu\n", stats.chain_hops);
+    STATS_PRINT("journal_commits %lu\n", stats.journal_commits);
+    STATS_PRINT("journal_blocks  %lu\n", stats.journal_blocks);
+    STATS_PRINT("syncs           %lu\n", stats.syncs);
+    STATS_PRINT("chunks_read     %lu\n", stats.chunks_read);
+    STATS_PRINT("chunks_written  %lu\n", stats.chunks_written);
+    STATS_PRINT("chunk_bytes_in  %lu\n", stats.chunk_bytes_in);
+    STATS_PRINT("chunk_bytes_out %lu\n", stats.chunk_bytes_out);
+    STATS_PRINT("dedup_hits      %lu\n", stats.dedup_hits);
+    STATS_PRINT("dedup_copies    %lu\n", stats.dedup_copies);
+    STATS_PRINT("checksum_reads  %lu\n", stats.checksum_reads);
+    STATS_PRINT("checksum_errors %lu\n", stats.checksum_errors);
+    STATS_PRINT("defrag_files    %lu\n", stats.defrag_files);
+    STATS_PRINT("defrag_blocks   %lu\n", stats.defrag_blocks);
+    STATS_PRINT("defrag_passes   %lu\n", stats.defrag_passes);
+    STATS_PRINT("frag_before     %lu\n", stats.frag_before);
+    STATS_PRINT("extents_before  %lu\n", stats.extents_before);
+    STATS_PRINT("frag_after      %lu\n", stats.frag_after);
+    STATS_PRINT("extents_after   %lu\n", stats.extents_after);
+    STATS_PRINT("snapshot_copies %lu\n", stats.snapshot_copies);
+    STATS_PRINT("inline_promoted %lu\n", stats.inline_promoted);
+    STATS_PRINT("writeback_blocks %lu\n", stats.writeback_blocks);
+    STATS_PRINT("writeback_runs  %lu\n", stats.writeback_runs);
+    STATS_PRINT("writeback_stalls %lu\n", stats.writeback_stalls);
+    STATS_PRINT("alloc_spilled   %lu\n", stats.alloc_spilled);
+    STATS_PRINT("ops_undone      %lu\n", stats.ops_undone);
+#undef STATS_PRINT
 
-        fseek(file, file_pos, SEEK_SET);
-        fwrite(file_block, sizeof(cs1550_disk_block), 1, file);
+    return len;
+}
 
-        /*--------------
-         * Update Bitmap
-         --------------*/
-        //mark deleted file's position in bitmap to free (0)
-        bitmap[file_pos/512] = 0;
-        printf("Deleted file at block %i\n", file_pos/512);
-    }
-    fseek(file, -10240, SEEK_END);
-    fwrite(bitmap, sizeof(bitmap), 1, file);
+//getattr for the virtual stats file
+static int stats_getattr(struct stat *stbuf)
+{
+    char *text = malloc(STATS_BUF_SIZE);
+    int len = stats_render(text, STATS_BUF_SIZE);
+    free(text);
 
-    fclose(file);
-    free(root_dir);
-    free(dir_entry);
-    free(file_block);
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = len;
     return 0;
 }
 
+//read for the virtual stats file
+static int stats_read(char *buf, size_t size, off_t offset)
+{
+    char *text = malloc(STATS_BUF_SIZE);
+    int len = stats_render(text, STATS_BUF_SIZE);
+    if (len > STATS_BUF_SIZE - 1) {
+        len = STATS_BUF_SIZE - 1;
+    }
+
+    int res = 0;
+    if (offset < len) {
+        res = len - offset;
+        if ((size_t)res > size) {
+            res = size;
+        }
+        memcpy(buf, text + offset, res);
+    }
+    free(text);
+    return res;
+}
+
+//write the statistics to <image>.stats, called on unmount
+static void stats_dump(void)
+{
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s.stats", disk_path);
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return;
+    }
+    char *text = malloc(STATS_BUF_SIZE);
+    int len = stats_render(text, STATS_BUF_SIZE);
+    if (len > STATS_BUF_SIZE - 1) {
+        len = STATS_BUF_SIZE - 1;
+    }
+    fwrite(text, len, 1, out);
+    free(text);
+    fclose(out);
+}
+
+//the mounted image, opened once by cs1550_mount
+static int disk_fd = -1;
+
+//keeps the checksums up to date, see "checksums" below
+static void sums_written(const void *ptr, size_t size, long pos);
+
+//read/write size bytes at byte position pos of .disk, counting the blocks
+//covered. Returns 1 if all of it was transferred, like fread(ptr, size, 1).
+static size_t disk_read(void *ptr, size_t size, long pos)
+{
+    size_t done = 0;
+    stats_add(&stats.block_reads, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    while (done < size) {
+        ssize_t n = pread(disk_fd, (char *) ptr + done, size - done, pos + done);
+        if (n <= 0) {
+            //past the end of the image reads as zeros
+            memset((char *) ptr + done, 0, size - done);
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+//write size bytes at byte position pos like disk_write(), but leave the
+//checksums alone, for the flusher, which sets them once it has fs_mutex
+static size_t disk_put(const void *ptr, size_t size, long pos)
+{
+    size_t done = 0;
+    stats_add(&stats.block_writes, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    while (done < size) {
+        ssize_t n = pwrite(disk_fd, (const char *) ptr + done, size - done, pos + done);
+        if (n <= 0) {
+            LOG_ERROR("writing block %ld: %s", (long) ((pos + done) / BLOCK_SIZE),
+                      n < 0 ? strerror(errno) : "short write");
+            return 0;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+static size_t disk_write(const void *ptr, size_t size, long pos)
+{
+    if (disk_put(ptr, size, pos) != 1) {
+        return 0;
+    }
+    sums_written(ptr, size, pos);
+    return 1;
+}
+
+static void disk_sync(void)
+{
+    stats_add(&stats.syncs, 1);
+    if (fdatasync(disk_fd) != 0) {
+        LOG_ERROR("fdatasync: %s", strerror(errno));
+    }
+}
+
 // ============================================================================
-// ============================== cs1550_read() ===============================
+// ================================== tracing =================================
 // ============================================================================
 /*
- * Read size bytes from file into buf starting from offset
+ * With -o trace=FILE every call is appended to FILE once it is done, so
+ * cs1550_replay can run the same calls against a copy of the image later.
+ * The file is a struct cs1550_trace_header followed by a struct
+ * cs1550_trace_record for each call, each followed in turn by the nPathLen
+ * bytes of its path. The data read and written isn't kept, only how much
+ * of it there was.
  *
+ * Calls of the low-level API are recorded with the path their inode had
+ * when they came in (see ll_path()), and with none for a file that was
+ * unlinked or a call on an open file that the kernel sends without one;
+ * nHandle tells which open those belong to. A call is handed to
+ * trace_record() before it leaves and fs_leave() appends it with its final
+ * result, while fs_mutex is still held, so the records are in the order
+ * the calls ran. They go through a stdio buffer and are written out when
+ * the filesystem is unmounted.
  */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-                       struct fuse_file_info *fi)
-{
-    printf("\n===read()===\n");
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
+#define TRACE_MAGIC 0x45435254
+#define TRACE_VERSION 1
 
-    char directory_name[MAX_FILENAME + 1];      // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
+//longest path a record can have: /.snapshot/dir/name
+#define TRACE_PATH_MAX (sizeof("/.snapshot//") + 2 * MAX_NAME)
 
-    memset(directory_name, 0, (MAX_FILENAME + 1));      // initialize directory to 0
-    memset(filename, 0, (MAX_FILENAME + 1));            // initialize filename to 0
-    memset(extension, 0, (MAX_EXTENSION + 1));          // initialize extension to 0
-
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory)); 
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
-    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block));  
+struct cs1550_trace_header
+{
+    unsigned int nMagic;        //TRACE_MAGIC
+    unsigned int nVersion;      //TRACE_VERSION
+    long nStarted;              //when the trace started, seconds since the epoch
+};
 
-    fseek(file, 0, SEEK_SET);
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
+struct cs1550_trace_record
+{
+    long nTime;                 //ns from the start of the trace to the call
+    long nLatency;              //ns the call took
+    long nOffset;               //read, write, readdir: offset. truncate: the size
+    long nHandle;               //fh of the open the call came through, 0 if none
+    int nSize;                  //read, write: bytes asked for. fsync: datasync
+    int nResult;                //what the call returned
+    short nOp;                  //enum cs1550_op
+    short nPathLen;             //bytes of path after the record, no '\0'
+    char padding[4];
+};
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
+static struct
+{
+    FILE *out;                  //NULL when not tracing
+    unsigned long start_ns;     //stats_now() when the trace started
+    struct cs1550_trace_record rec; //the running call, for fs_leave() to append
+    const char *path;           //and its path, NULL if there is no call to append
+} trace;
 
-    int dir_pos = -1;       //directory byte position on disk
-    int file_pos = -1;      //file byte position on disk
-    size_t file_size = -1;  //size of file
-    dir_pos = get_directory_pos(directory_name);
-    file_pos = get_file_pos(filename, extension, dir_pos);
-    file_size = get_file_size(filename, extension, dir_pos);
+//start tracing to the file at path. Returns 0 or -errno.
+#ifndef CS1550_NO_MAIN
+static int trace_open(const char *path)
+{
+    struct cs1550_trace_header header;
 
-    //check to make sure path exists
-    if(dir_pos==-1 || file_pos==-1){
-        printf("ENOENT: Path doesn't exist\n");
-        return -ENOENT;
-    }
-    else if(strlen(directory_name)!=0 && strlen(filename)==0){
-        return -EISDIR;
-    }
-    //check that size is > 0
-    else if (size <= 0){
-        printf("Size is not bigger than 0\n");
-        return 0;
+    if ((trace.out = fopen(path, "w")) == NULL) {
+        return -errno;
     }
-    //find the location of the directory
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
-
-    //find the location of the file
-    fseek(file, file_pos, SEEK_SET);
-    fread(file_block, sizeof(cs1550_disk_block), 1, file);
+    setvbuf(trace.out, NULL, _IOFBF, 1 << 20);
+    memset(&header, 0, sizeof(header));
+    header.nMagic = TRACE_MAGIC;
+    header.nVersion = TRACE_VERSION;
+    header.nStarted = time(NULL);
+    fwrite(&header, sizeof(header), 1, trace.out);
+    trace.start_ns = stats_now();
+    return 0;
+}
+#endif
 
-    //locate start byte to read. B/c read only read 8192 bytes at once
-    int start_block = offset/MAX_DATA_IN_BLOCK;     //the # of the block where we should write to. Start from block 0
-    int pos_in_block = offset%MAX_DATA_IN_BLOCK;    //byte position in the block of where we should write
-    int left_in_block = MAX_DATA_IN_BLOCK - pos_in_block; //remaining bytes in current block not read
-    int left_in_file = 0;  //remaining bytes in entire file not yet read
-    int i = 0;
-    for(i = 0; i<dir_entry->nFiles; i++){
-        if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-            left_in_file = dir_entry->files[i].fsize - offset;
-        }
+static void trace_close(void)
+{
+    if (trace.out != NULL && fclose(trace.out) != 0) {
+        LOG_ERROR("writing the trace: %s", strerror(errno));
     }
+    trace.out = NULL;
+}
 
-    int cur = 0;                //number of current block
-    int cur_block_pos = 0;      //byte position of next linked disk block
-    
-    //traverse to find the block where the first byte to read resides
-    while (cur != start_block){
-        cur_block_pos = file_block->nNextBlock;  //get block position of the next block
-        fseek(file, cur_block_pos, SEEK_SET);
-        fread(file_block, sizeof(cs1550_disk_block), 1, file);
-        cur = cur + 1;
-    }
-    printf("Start block is %i\n", start_block);
-
-    int new_data = 0;
-    //read in data
-    while(left_in_file > 0){
-        //find the location of the file
-        fseek(file, file_pos, SEEK_SET);
-        fread(file_block, sizeof(cs1550_disk_block), 1, file);
-        
-        //in case block is not fully filled
-        if (left_in_block > left_in_file) {
-            left_in_block = left_in_file;
-        }
-        //read from where we left off last time
-        if (left_in_block > 0) {
-            int m = 0;
-            for (m = pos_in_block; m < MAX_DATA_IN_BLOCK; m++) {
-                buf[new_data] = file_block->data[m];
-                new_data++;
-                left_in_block = left_in_block - 1;
-                left_in_file = left_in_file - 1;
-            } 
-        }
-        //read entire block from beginning byte
-        else {
-            int n = 0;
-            for (n = 0; n < MAX_DATA_IN_BLOCK; n++) {
-                buf[new_data] = file_block->data[n];
-                new_data++;
-                left_in_file = left_in_file - 1;
-            }
-        }
-        //continue to next file block to read
-        if(file_block->nNextBlock!=0){
-            file_pos = file_block->nNextBlock;
-            left_in_block = MAX_DATA_IN_BLOCK;
-        } else {
-            printf("ERROR: Should have next block");
-        }
+//the running call is to op and started at start: fs_leave() appends it to
+//the trace. path has to stay valid until then.
+static void trace_record(enum cs1550_op op, unsigned long start, const char *path,
+                         size_t size, off_t offset, const struct fuse_file_info *fi)
+{
+    struct cs1550_trace_record *rec = &trace.rec;
+
+    if (trace.out == NULL) {
+        return;
     }
-    //set size and return, or error
-    fclose(file);
-    free(root_dir);
-    free(dir_entry);
-    free(file_block);
-    return file_size;
+    memset(rec, 0, sizeof(*rec));
+    rec->nTime = start - trace.start_ns;
+    rec->nOffset = offset;
+    rec->nHandle = fi != NULL ? (long) fi->fh : 0;
+    rec->nSize = size;
+    rec->nOp = op;
+    trace.path = path != NULL ? path : "";
 }
 
+//append the running call, which returned res, to the trace. Called by
+//fs_leave() with fs_mutex held.
+static void trace_append(int res)
+{
+    struct cs1550_trace_record *rec = &trace.rec;
 
+    if (trace.path == NULL) {
+        return;
+    }
+    rec->nLatency = stats_now() - trace.start_ns - rec->nTime;
+    rec->nResult = res;
+    rec->nPathLen = strnlen(trace.path, TRACE_PATH_MAX - 1);
+    fwrite(rec, sizeof(*rec), 1, trace.out);
+    fwrite(trace.path, 1, rec->nPathLen, trace.out);
+    trace.path = NULL;
+}
 
 // ============================================================================
-// ============================== cs1550_write() ==============================
+// ================================ disk layout ===============================
 // ============================================================================
-/* 
- * Write size bytes from buf into file starting from offset
+/*
+ * An image is laid out as
+ *
+ *   block 0                      root directory
+ *   block 1                      superblock
+ *   nJournalStart ..             journal, nJournalBlocks long (may be empty)
+ *   nDataStart .. nDataEnd - 1   directory and file blocks
+ *   nSumStart ..                 checksums, nSumBlocks long (may be empty)
+ *   nBitmapBlock ..              bitmap, one byte per block of the image
  *
+ * The bitmap always fills the tail of the image, so a 10240 block image
+ * keeps its bitmap in the last 10240 bytes just like the images made before
+ * there was a superblock. Those are upgraded in place when mounted, without
+ * a journal.
  */
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-                        off_t offset, struct fuse_file_info *fi)
-{
-    printf("\n===write()===\n");
-    (void) buf;
-    (void) offset;
-    (void) fi;
-    (void) path;
-    int res = 0;
+static cs1550_superblock sb;    //layout of the mounted image
 
-    char directory_name[MAX_FILENAME + 1];      // subdirectory
-    char filename[MAX_FILENAME + 1];            // filename
-    char extension[MAX_EXTENSION + 1];          // extension
+//number of blocks needed to hold the bitmap of an nblocks image
+#define BITMAP_BLOCKS(nblocks) (((nblocks) + BLOCK_SIZE - 1) / BLOCK_SIZE)
 
-    memset(directory_name, 0, (MAX_FILENAME + 1));      // initialize directory to 0
-    memset(filename, 0, (MAX_FILENAME + 1));            // initialize filename to 0
-    memset(extension, 0, (MAX_EXTENSION + 1));          // initialize extension to 0
+//number of blocks needed to hold a checksum for every block of an nblocks image
+#define SUM_BLOCKS(nblocks) (((nblocks) * sizeof(unsigned int) + BLOCK_SIZE - 1) / BLOCK_SIZE)
 
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory)); 
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
-    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block));  
+//journal made by cs1550_mkfs unless told otherwise: 1/16 of the image, at
+//most JOURNAL_DEFAULT_BLOCKS
+#define JOURNAL_DEFAULT_BLOCKS 1024
 
-    fseek(file, 0, SEEK_SET);
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
+//smallest journal that can hold a transaction of one full descriptor
+#define JOURNAL_MIN_BLOCKS (JOURNAL_TAGS + 3)
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory_name, filename, extension);
+//is pos the byte position of a block the allocator could have handed out?
+static int valid_block_pos(long pos)
+{
+    return pos > 0 && pos % BLOCK_SIZE == 0
+        && pos / BLOCK_SIZE >= sb.nDataStart && pos / BLOCK_SIZE < sb.nDataEnd;
+}
 
-    int dir_pos = -1;       //directory byte position on disk
-    int file_pos = -1;      //file byte position on disk
-    size_t file_size = -1;  //size of file
-    dir_pos = get_directory_pos(directory_name);
-    file_pos = get_file_pos(filename, extension, dir_pos);
-    file_size = get_file_size(filename, extension, dir_pos);
+//names are hashed with FNV-1a, starting from NAME_HASH_INIT
+#define NAME_HASH_INIT 2166136261u
+#define NAME_HASH_PRIME 16777619u
 
-    //check to make sure path exists
-    if(dir_pos==-1 || file_pos==-1){
-        printf("ENOENT: Path doesn't exist\n");
-        return -ENOENT;
-    }
-    //check that size is > 0
-    else if (size <= 0){
-        printf("Size is not bigger than 0\n");
-        return 0;
-    }
-    //check that offset is <= to the file size
-    else if(offset > file_size){
-        printf("Offset is beyond file size\n");
-        res = -EFBIG; //needs to handle append
-    }
-    //find the location of the directory
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+//most bytes a name area can need, for a root full of MAX_NAME long names or
+//a directory full of inline files with them
+#define NAMES_MAX_ROOT (MAX_DIRS_IN_ROOT * MAX_NAME)
+#define NAMES_MAX_DIR (MAX_FILES_IN_DIR * (MAX_NAME + INLINE_MAX))
+#define NAMES_MAX_BLOCKS (((NAMES_MAX_ROOT > NAMES_MAX_DIR ? NAMES_MAX_ROOT : NAMES_MAX_DIR) \
+                           + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK)
 
-    //find the location of the file
-    fseek(file, file_pos, SEEK_SET);
-    fread(file_block, sizeof(cs1550_disk_block), 1, file);
+//the nHash of the len byte name at name
+static unsigned int name_hash(const char *name, size_t len)
+{
+    unsigned int h = NAME_HASH_INIT;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) name[i]) * NAME_HASH_PRIME;
+    }
+    return h;
+}
 
-    //locate start byte to write. B/c read only read 4096 bytes at once
-    int start_block = offset/MAX_DATA_IN_BLOCK;     //the # of the block where we should write to. Start from block 0
-    int pos_in_block = offset%MAX_DATA_IN_BLOCK;    //byte position in the block of where we should write
+/*
+ * CRC32C (Castagnoli) of size bytes at data, for the block checksums. With
+ * SSE4.2 it takes one crc32 instruction per 8 bytes. Each one waits for the
+ * one before, so with PCLMUL too a whole block is done as three streams of
+ * CRC32C_STREAM bytes side by side, which are joined by shifting the first
+ * two over what follows them: a carry-less multiply by x^(8n - 33) mod P,
+ * brought back to 32 bits by one more crc32, shifts a crc over n zero
+ * bytes. Without SSE4.2 eight tables do it 8 bytes at a time (slicing-by-8).
+ */
+#define CRC32C_POLY 0x82f63b78u
+#define CRC32C_STREAM ((BLOCK_SIZE / 3) & ~7)
 
-    int cur = 0;    //number of current block
-    int cur_block_pos = file_pos; //byte position of next linked disk block
+static unsigned int crc32c_table[8][256];
+static int crc32c_hw = -1;          //-1 until crc32c_init() ran, 2 with PCLMUL
+static unsigned int crc32c_shift1;  //x^(8 * CRC32C_STREAM - 33) mod P
+static unsigned int crc32c_shift2;  //x^(16 * CRC32C_STREAM - 33) mod P
 
-    //traverse to find the block where the first byte resides
-    while (cur != start_block){
-        cur_block_pos = file_block->nNextBlock;  //get block position of the next block
-        fseek(file, cur_block_pos, SEEK_SET);
-        fread(file_block, sizeof(cs1550_disk_block), 1, file);
-        cur = cur + 1;
+//x^n mod P, bit reflected like the crc
+static unsigned int crc32c_xpow(long n)
+{
+    unsigned int v = 0x80000000u;
+    while (n-- > 0) {
+        v = v & 1 ? (v >> 1) ^ CRC32C_POLY : v >> 1;
     }
+    return v;
+}
 
-    int new_data = 0;  //total amount of new data being written
-    
-    //while total data being written is less than size (4096)
-    while(new_data<size){     
-        //if current block is full
-        if(pos_in_block >= MAX_DATA_IN_BLOCK){
-            printf("Creating new block\n");
-
-            //create new block
-            char bitmap[10240]="";              //bitmap array represents 10240 blocks
-            memset(bitmap, 0, 10240);           //initialize array to contain all 0s
-            int newblock_pos = -1;              //block position for new file block
-            
-            //load bitmap from disk
-            fseek(file, -10240, SEEK_END);
-            fread(bitmap, 10240, 1, file);
-            
-            //look for free block for new file
-            int i = 1;                      //skip root block
-            for(i = 1; i<10240; i++){
-                if(bitmap[i]==0){
-                    bitmap[i] = 1;
-                    newblock_pos = i;       //set file's new block location
-                    break;                  //break out of search after find free block
-                }
-            }
-            //update bitmap to disk
-            fseek(file, -10240, SEEK_END);
-            fwrite(bitmap, sizeof(bitmap), 1, file);
-
-            //link current block to newly allocated block
-            file_block->nNextBlock = newblock_pos*512;
-            //write full block to disk
-            fseek(file, cur_block_pos, SEEK_SET);
-            fwrite(file_block, sizeof(cs1550_disk_block), 1, file);
-            //load in new file block as new file_block, update cur_block_pos
-            fseek(file, newblock_pos*512, SEEK_SET);
-            cur_block_pos = newblock_pos*512;
-            printf("New block at block: %i\n", cur_block_pos/512);
-            file_pos = cur_block_pos;
-            fread(file_block, sizeof(cs1550_disk_block), 1, file);
-            pos_in_block = 0;
-        }
-        if(pos_in_block >= 504){
-            printf("Overflowing!\n");
+static void crc32c_init(void)
+{
+    unsigned int i, j, c;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
         }
-        //if current block is not full
-        file_block->data[pos_in_block] = buf[new_data]; //write cur byte in buf to cur block position
-        printf("Writting buf[%i] into file block %i data[%i]\n", new_data, cur_block_pos/512, pos_in_block);
-        file_size = file_size + 1;                      //increment file size
-        new_data = new_data + 1;                        //increment amount of new data being written
-        pos_in_block = pos_in_block + 1;                //increment to next position in file block
+        crc32c_table[0][i] = c;
     }
-    //set size (should be same as input) and return, or error
-    int i = 0;
-    for(i = 0; i<dir_entry->nFiles; i++){
-        if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-            dir_entry->files[i].fsize = file_size;
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            c = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
         }
     }
-    //find the location of the file
-    fseek(file, file_pos, SEEK_SET);
-    fwrite(file_block, sizeof(cs1550_disk_block), 1, file);
-
-    printf("File size: %zu\n", file_size);
-    //find the location of the directory
-    fseek(file, dir_pos, SEEK_SET);
-    fwrite(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+    crc32c_shift1 = crc32c_xpow(8L * CRC32C_STREAM - 33);
+    crc32c_shift2 = crc32c_xpow(16L * CRC32C_STREAM - 33);
+#if defined(__x86_64__)
+    crc32c_hw = !__builtin_cpu_supports("sse4.2") ? 0 : __builtin_cpu_supports("pclmul") ? 2 : 1;
+#else
+    crc32c_hw = 0;
+#endif
+}
 
-    fclose(file);
-    free(root_dir);
-    free(dir_entry);
-    free(file_block);
-    return file_size;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t size)
+{
+    unsigned long c = crc;
+    unsigned long word;
+    size_t i;
+    for (i = 0; i + 8 <= size; i += 8) {
+        memcpy(&word, p + i, sizeof(word));
+        c = __builtin_ia32_crc32di(c, word);
+    }
+    crc = c;
+    for (; i < size; i++) {
+        crc = __builtin_ia32_crc32qi(crc, p[i]);
+    }
+    return crc;
 }
 
-//returns byte position of directory on disk
-int get_directory_pos(char * directory_name){
-    int dir_pos = -1;   //byte position of directory
+//crc shifted over the n bytes k = x^(8n - 33) mod P stands for
+__attribute__((target("sse4.2,pclmul")))
+static unsigned long crc32c_shift(unsigned int crc, unsigned int k)
+{
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+    return __builtin_ia32_crc32di(0, _mm_cvtsi128_si64(product));
+}
 
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory)); 
+__attribute__((target("sse4.2,pclmul")))
+static unsigned int crc32c_block(unsigned int crc, const unsigned char *p)
+{
+    const unsigned char *p1 = p + CRC32C_STREAM, *p2 = p + 2 * CRC32C_STREAM;
+    unsigned long c0 = crc, c1 = 0, c2 = 0;
+    unsigned long w0, w1, w2;
+    size_t i;
+    for (i = 0; i < CRC32C_STREAM; i += 8) {
+        memcpy(&w0, p + i, 8);
+        memcpy(&w1, p1 + i, 8);
+        memcpy(&w2, p2 + i, 8);
+        c0 = __builtin_ia32_crc32di(c0, w0);
+        c1 = __builtin_ia32_crc32di(c1, w1);
+        c2 = __builtin_ia32_crc32di(c2, w2);
+    }
+    crc = crc32c_shift(c0, crc32c_shift2) ^ crc32c_shift(c1, crc32c_shift1) ^ c2;
+    return crc32c_sse42(crc, p + 3 * CRC32C_STREAM, BLOCK_SIZE - 3 * CRC32C_STREAM);
+}
+#endif
 
-    fseek(file, 0, SEEK_SET);
-    fread(root_dir, sizeof(cs1550_root_directory), 1, file);
+static unsigned int crc32c(const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    unsigned int crc = 0xffffffffu;
+    size_t i;
 
-    int i = 0;
-    for(i = 0; i<root_dir->nDirectories; i++){
-        if(strcmp(root_dir->directories[i].dname, directory_name)==0){
-            dir_pos = root_dir->directories[i].nStartBlock;
-            break;
-        }
+    if (crc32c_hw == -1) {
+        crc32c_init();
     }
-    fclose(file);
-    free(root_dir);
-    return dir_pos;
+#if defined(__x86_64__)
+    if (crc32c_hw == 2 && size == BLOCK_SIZE) {
+        return ~crc32c_block(crc, p);
+    }
+    if (crc32c_hw) {
+        return ~crc32c_sse42(crc, p, size);
+    }
+#endif
+    for (i = 0; i + 8 <= size; i += 8) {
+        unsigned int lo, hi;
+        memcpy(&lo, p + i, 4);
+        memcpy(&hi, p + i + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+            ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+            ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; i < size; i++) {
+        crc = crc32c_table[0][(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
 }
 
-//returns byte position of file on disk
-int get_file_pos(char * filename, char * extension, int dir_pos){
-    int file_pos = -1; //byte position of file
+//does block of an image laid out as super have a checksum? Everything but
+//the superblock, the journal (which has its own) and the checksums do.
+static int sum_covers(const cs1550_superblock *super, long block)
+{
+    return super->nSumBlocks != 0 && block != SUPER_BLOCK
+        && (block < super->nJournalStart || block >= super->nJournalStart + super->nJournalBlocks)
+        && (block < super->nSumStart || block >= super->nSumStart + super->nSumBlocks)
+        && block < super->nBlocks;
+}
 
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
+//read the whole bitmap into a buffer the caller frees. The buffer is padded
+//with zeros to a whole number of blocks.
+static char * bitmap_load(void)
+{
+    char *map = calloc(BITMAP_BLOCKS(sb.nBlocks), BLOCK_SIZE);
+    disk_read(map, sb.nBlocks, sb.nBitmapBlock * BLOCK_SIZE);
+    return map;
+}
 
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+static void bitmap_store(const char *map)
+{
+    disk_write(map, sb.nBlocks, sb.nBitmapBlock * BLOCK_SIZE);
+}
 
-    int i = 0;
-    for(i = 0; i<dir_entry->nFiles; i++){
-        if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-            file_pos = dir_entry->files[i].nStartBlock;
-            break;
-        }
-    }
-    fclose(file);
-    free(dir_entry);
-    return file_pos;
+//fill in sb for an nblocks image with the standard layout, a journal of
+//njournal blocks and checksums if sums is set
+static void layout_init(cs1550_superblock *super, long nblocks, long njournal, int sums)
+{
+    memset(super, 0, sizeof(*super));
+    super->nMagic = CS1550_MAGIC;
+    super->nVersion = CS1550_VERSION;
+    super->nBlocks = nblocks;
+    super->nBitmapBlock = nblocks - BITMAP_BLOCKS(nblocks);
+    super->nJournalStart = SUPER_BLOCK + 1;
+    super->nJournalBlocks = njournal;
+    super->nDataStart = super->nJournalStart + njournal;
+    super->nSumBlocks = sums ? (long) SUM_BLOCKS(nblocks) : 0;
+    super->nSumStart = super->nBitmapBlock - super->nSumBlocks;
+    super->nDataEnd = super->nSumStart;
+    super->nFreeBlocks = super->nDataEnd - super->nDataStart;
 }
 
-//returns size of file
-size_t get_file_size(char * filename, char * extension, int dir_pos){
-    size_t file_size = -1;
+#ifdef CS1550_NO_MAIN
+//size of the journal cs1550_mkfs gives an nblocks image by default
+static long journal_default_blocks(long nblocks)
+{
+    long njournal = nblocks / 16 < JOURNAL_DEFAULT_BLOCKS ? nblocks / 16 : JOURNAL_DEFAULT_BLOCKS;
+    return njournal < (long) JOURNAL_MIN_BLOCKS ? 0 : njournal;
+}
 
-    FILE * file = fopen(".disk", "rb+");
-    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+/*
+ * Create a new, empty image of nblocks blocks at path, replacing whatever
+ * was there, with a journal of njournal blocks (0 for none, -1 for the
+ * default size). The image is extended with ftruncate so large images are
+ * sparse and quick to make.
+ */
+CS1550_API int cs1550_format(const char *path, long nblocks, long njournal)
+{
+    cs1550_superblock super;
+    long i;
+
+    if (njournal < 0) {
+        njournal = journal_default_blocks(nblocks);
+    }
+    if (njournal != 0 && njournal < (long) JOURNAL_MIN_BLOCKS) {
+        return -EINVAL;
+    }
+    if (nblocks < (long) (SUPER_BLOCK + 2 + njournal + SUM_BLOCKS(nblocks) + BITMAP_BLOCKS(nblocks))) {
+        return -EINVAL;
+    }
+    layout_init(&super, nblocks, njournal, 1);
+
+    FILE *file = fopen(path, "wb+");
+    if (file == NULL) {
+        return -errno;
+    }
+    if (ftruncate(fileno(file), (off_t) nblocks * BLOCK_SIZE) != 0) {
+        int res = -errno;
+        fclose(file);
+        return res;
+    }
 
-    fseek(file, dir_pos, SEEK_SET);
-    fread(dir_entry, sizeof(cs1550_directory_entry), 1, file);
+    //the root directory is block 0 and is already all zeros
+    fseek(file, (long) SUPER_BLOCK * BLOCK_SIZE, SEEK_SET);
+    fwrite(&super, sizeof(super), 1, file);
 
-    int i = 0;
-    for(i = 0; i<dir_entry->nFiles; i++){
-        if(strcmp(dir_entry->files[i].fname, filename)==0 && strcmp(dir_entry->files[i].fext, extension)==0){
-            file_size = dir_entry->files[i].fsize;
-            break;
+    //an empty journal: replay starts with transaction 1 at its second block
+    if (njournal != 0) {
+        cs1550_journal_block jsb;
+        memset(&jsb, 0, sizeof(jsb));
+        jsb.nMagic = JOURNAL_MAGIC;
+        jsb.nType = JOURNAL_SUPER;
+        jsb.nSequence = 1;
+        jsb.nCount = 1;
+        fseek(file, super.nJournalStart * BLOCK_SIZE, SEEK_SET);
+        fwrite(&jsb, sizeof(jsb), 1, file);
+    }
+
+    //everything outside the data area is in use from the start
+    char *map = calloc(BITMAP_BLOCKS(nblocks), BLOCK_SIZE);
+    for (i = 0; i < super.nDataStart; i++) {
+        map[i] = 1;
+    }
+    for (i = super.nDataEnd; i < nblocks; i++) {
+        map[i] = 1;
+    }
+    fseek(file, super.nBitmapBlock * BLOCK_SIZE, SEEK_SET);
+    fwrite(map, nblocks, 1, file);
+
+    //every other block is still all zeros
+    unsigned int *sums = calloc(super.nSumBlocks, BLOCK_SIZE);
+    char zero[BLOCK_SIZE];
+    memset(zero, 0, sizeof(zero));
+    unsigned int zero_sum = crc32c(zero, BLOCK_SIZE);
+    for (i = 0; i < nblocks; i++) {
+        if (!sum_covers(&super, i)) {
+            continue;
         }
+        sums[i] = i >= super.nBitmapBlock
+            ? crc32c(map + (i - super.nBitmapBlock) * BLOCK_SIZE, BLOCK_SIZE) : zero_sum;
     }
-    fclose(file);
-    free(dir_entry);
-    return file_size;
-}
+    fseek(file, super.nSumStart * BLOCK_SIZE, SEEK_SET);
+    fwrite(sums, super.nSumBlocks * BLOCK_SIZE, 1, file);
+    free(sums);
+    free(map);
 
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        int res = -errno;
+        fclose(file);
+        return res;
+    }
+    if (fclose(file) != 0) {
+        return -errno;
+    }
+    return 0;
+}
+#endif
 
+// ============================================================================
+// ================================= checksums ================================
+// ============================================================================
 /*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
+ * Images made by this version keep a CRC32C of every block (but the few
+ * sum_covers() leaves out), in the checksum blocks. They are in memory while
+ * mounted, updated by every disk_write() and written back when the journal
+ * commits and on unmount. A block read with block_read() is checked against
+ * its checksum the first time it is read from disk; after that it is known
+ * to be good until it is written, which sets its checksum from what was
+ * written, so later reads of it don't hash it again.
+ *
+ * A block that doesn't match is returned as zeros, so nothing follows its
+ * links, and the operation fails with EIO. Its writes after that point are
+ * dropped, and fs_leave() undoes the ones before it, along with whatever it
+ * changed in memory, before anything of it can be committed (see "undo").
  *
+ * Data goes home before the checksums that describe it, so after a crash
+ * some of them are stale. nMounted in the superblock is set while mounted,
+ * and if a mount finds it still set the checksums are computed again from
+ * what is on disk.
  */
-static int cs1550_truncate(const char *path, off_t size)
+static struct
 {
-    (void) path;
-    (void) size;
-    
-    return 0;
-}
+    unsigned int *sums;         //checksum of every block, NULL if the image has none
+    char *verified;             //per block: matched its checksum or was written since mount
+    char *dirty;                //per checksum block: changed since it was written
+} sums;
 
+//the errno an operation failed with below the handlers: EIO if it read a
+//block that didn't match its checksum, ENOSPC if a snapshot left no room
+static int fs_failed;
 
-/* 
- * Called when we open a file
- *
- */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
+//checksums in one checksum block
+#define SUMS_PER_BLOCK (BLOCK_SIZE / sizeof(unsigned int))
+
+//blocks read per request by sums_rebuild()
+#define SUMS_SCAN_BLOCKS 256
+
+//compute the checksum of every block from the disk
+static void sums_rebuild(void)
 {
-    (void) path;
-    (void) fi;
-    /*
-     //if we can't find the desired file, return an error
-     return -ENOENT;
-     */
-    
-    //It's not really necessary for this project to anything in open
-    
-    /* We're not going to worry about permissions for this project, but 
-     if we were and we don't have them to the file we should return an error
-     
-     return -EACCES;
-     */
-    
-    return 0; //success!
+    char *buf = malloc(SUMS_SCAN_BLOCKS * BLOCK_SIZE);
+    long b, i;
+
+    for (b = 0; b < sb.nBlocks; b += SUMS_SCAN_BLOCKS) {
+        long n = sb.nBlocks - b < SUMS_SCAN_BLOCKS ? sb.nBlocks - b : SUMS_SCAN_BLOCKS;
+        disk_read(buf, n * BLOCK_SIZE, b * BLOCK_SIZE);
+        for (i = 0; i < n; i++) {
+            if (sum_covers(&sb, b + i)) {
+                sums.sums[b + i] = crc32c(buf + i * BLOCK_SIZE, BLOCK_SIZE);
+                sums.dirty[(b + i) / SUMS_PER_BLOCK] = 1;
+            }
+        }
+    }
+    free(buf);
 }
 
-/*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file 
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
- */
-static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+//write the checksum blocks that changed
+static void sums_flush(void)
 {
-    (void) path;
-    (void) fi;
-    
-    return 0; //success!
+    long i;
+    if (sums.sums == NULL) {
+        return;
+    }
+    for (i = 0; i < sb.nSumBlocks; i++) {
+        if (sums.dirty[i]) {
+            sums.dirty[i] = 0;
+            disk_write((char *) sums.sums + i * BLOCK_SIZE, BLOCK_SIZE,
+                       (sb.nSumStart + i) * BLOCK_SIZE);
+        }
+    }
+}
+
+//load the checksums of the mounted image, or compute them again if it
+//wasn't unmounted cleanly
+static void sums_load(void)
+{
+    if (sb.nSumBlocks == 0) {
+        return;
+    }
+    sums.sums = malloc(sb.nSumBlocks * BLOCK_SIZE);
+    sums.verified = calloc(sb.nBlocks, 1);
+    sums.dirty = calloc(sb.nSumBlocks, 1);
+    if (sb.nMounted) {
+        LOG_WARN("%s was not unmounted cleanly, computing its checksums again", disk_path);
+        sums_rebuild();
+        sums_flush();
+    } else {
+        disk_read(sums.sums, sb.nSumBlocks * BLOCK_SIZE, sb.nSumStart * BLOCK_SIZE);
+    }
+}
+
+static void sums_free(void)
+{
+    free(sums.sums);
+    free(sums.verified);
+    free(sums.dirty);
+    memset(&sums, 0, sizeof(sums));
+}
+
+static void sums_written(const void *ptr, size_t size, long pos)
+{
+    char block[BLOCK_SIZE];
+    long b;
+
+    if (sums.sums == NULL) {
+        return;
+    }
+    for (b = pos / BLOCK_SIZE; b * BLOCK_SIZE < pos + (long) size; b++) {
+        if (!sum_covers(&sb, b)) {
+            continue;
+        }
+        const char *data = (const char *) ptr + (b * BLOCK_SIZE - pos);
+        if (b * BLOCK_SIZE < pos || (b + 1) * BLOCK_SIZE > pos + (long) size) {
+            //only part of it was written, hash all of it
+            disk_read(block, BLOCK_SIZE, b * BLOCK_SIZE);
+            data = block;
+        }
+        sums.sums[b] = crc32c(data, BLOCK_SIZE);
+        sums.verified[b] = 1;
+        sums.dirty[b / SUMS_PER_BLOCK] = 1;
+    }
+}
+
+//check the block at byte position pos, just read into buf. On a mismatch
+//buf is cleared, the operation fails and -EIO is returned.
+static int sums_check(long pos, void *buf)
+{
+    long b = pos / BLOCK_SIZE;
+    if (sums.sums == NULL || sums.verified[b] || !sum_covers(&sb, b)) {
+        return 0;
+    }
+    stats_add(&stats.checksum_reads, 1);
+    if (crc32c(buf, BLOCK_SIZE) == sums.sums[b]) {
+        sums.verified[b] = 1;
+        return 0;
+    }
+    stats_add(&stats.checksum_errors, 1);
+    LOG_ERROR("block %ld doesn't match its checksum", b);
+    memset(buf, 0, BLOCK_SIZE);
+    fs_failed = EIO;
+    return -EIO;
+}
+
+// ============================================================================
+// ================================== journal =================================
+// ============================================================================
+/*
+ * Metadata is never written in place while the filesystem is mounted. The
+ * root, directory blocks, bitmap blocks and committed data blocks whose
+ * nNextBlock changes are copied into the running batch instead, and a batch
+ * is committed as a whole: one sequential write of it into the journal,
+ * one fdatasync, and only then the blocks are written home, without waiting
+ * for them (the next sync takes them along). Mounting replays the committed
+ * batches still in the journal, so after a crash the metadata is exactly as
+ * it was at some commit.
+ *
+ * In the journal a transaction is
+ *
+ *   descriptor, images..., [descriptor, images...], commit
+ *
+ * with up to JOURNAL_TAGS images per descriptor. The commit block holds a
+ * checksum of everything before it, so a transaction torn by a crash in the
+ * middle of its write is ignored. Transactions are appended one after the
+ * other; when the next one doesn't fit, everything is synced and the journal
+ * starts over from the top.
+ *
+ * Data goes straight to its block. Blocks handed out by the allocator in the
+ * running batch (BITMAP_NEW) aren't referenced by anything committed, so
+ * their links are written in place too. Blocks freed in the running batch
+ * (BITMAP_FREED) aren't handed out again until it commits, so a crash can't
+ * leave a committed file pointing at another file's data.
+ *
+ * Neither holds for a block with an image in a committed transaction still
+ * in the journal (journal.live): replay would put that image back over
+ * whatever was written in place since, be it data, a new block's link or
+ * a block freed and handed out again. Until the journal starts over, every
+ * write to such a block goes through the running batch too, so the last
+ * image replay puts there is the newest.
+ *
+ * A batch is committed when it holds journal.batch blocks or is older than
+ * journal_commit_ns as an operation finishes, on fsync and on unmount. An
+ * operation that doesn't fit in what is left of the journal is split across
+ * two batches; each handler changes things in an order where that can only
+ * leak blocks, which fsck gets back.
+ *
+ * Images without a journal write metadata in place as soon as it changes.
+ */
+
+//in-memory bitmap values. Only BITMAP_FREE and BITMAP_USED are ever on disk.
+#define BITMAP_FREE  0
+#define BITMAP_USED  1
+#define BITMAP_NEW   2      //allocated in the running batch
+#define BITMAP_FREED 3      //freed in the running batch, not reusable until it commits
+
+static char *bitmap;        //the bitmap of the mounted image, see bitmap_load()
+
+//blocks in a batch before it is committed
+#define JOURNAL_BATCH 256
+
+//seconds a batch may wait for more blocks, -o commit=N
+#define JOURNAL_COMMIT_SEC 5
+
+static unsigned long journal_commit_ns = JOURNAL_COMMIT_SEC * 1000000000UL;
+
+struct journal_buf
+{
+    long block;                 //where it goes
+    unsigned long undo_op;      //undo has its copy from before, see undo_journal()
+    char data[BLOCK_SIZE];      //what goes there
+};
+
+static struct
+{
+    struct journal_buf *bufs;   //the running batch, nbufs blocks long
+    long nbufs;
+    long max;                   //most images one transaction can hold, 0 = no journal
+    long batch;                 //commit once a finished operation leaves this many
+    long *index;                //hash of block number -> slot in bufs, -1 if empty
+    long index_mask;
+    char *out;                  //a transaction as it is written to the journal
+    unsigned long sequence;     //number of the next transaction
+    long head;                  //journal block it will be written at
+    unsigned long started_ns;   //when the running batch got its first block
+    char *live;                 //per block: has an image a mount would replay
+} journal;
+
+//the lock every operation holds, see fs_enter()
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//data blocks wait in the write-back cache on their way to disk, see below
+static int wb_read(long block, void *buf);
+static void wb_write(long block, const void *buf);
+static void wb_flush(void);
+
+//an operation that fails underneath is undone as a whole, see "undo" below
+struct wb_buf;
+static void undo_begin(int split);
+static void undo_end(void);
+static void undo_abort(void);
+static void undo_journal(struct journal_buf *jb);
+static void undo_cache(struct wb_buf *b, int cached);
+static int undo_keeps(const struct wb_buf *b);
+static void undo_bitmap(long block);
+
+//journal blocks a transaction of nimages takes
+static long journal_span(long nimages)
+{
+    return nimages + (nimages + JOURNAL_TAGS - 1) / JOURNAL_TAGS + 1;
+}
+
+//FNV-1a, enough to tell a whole transaction from a torn one
+static unsigned int journal_checksum(unsigned int h, const char *data, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#define JOURNAL_CHECKSUM_INIT 2166136261u
+
+static long * journal_slot(long block)
+{
+    long i = ((unsigned long) block * 0x9e3779b97f4a7c15UL >> 17) & journal.index_mask;
+    while (journal.index[i] != -1 && journal.bufs[journal.index[i]].block != block) {
+        i = (i + 1) & journal.index_mask;
+    }
+    return &journal.index[i];
+}
+
+//the running batch's copy of block, or NULL if it has none
+static struct journal_buf * journal_find(long block)
+{
+    if (journal.nbufs == 0) {
+        return NULL;
+    }
+    long slot = *journal_slot(block);
+    return slot == -1 ? NULL : &journal.bufs[slot];
+}
+
+//is block one of the bitmap's?
+static int is_bitmap_block(long block)
+{
+    return block >= sb.nBitmapBlock && block < sb.nBlocks;
+}
+
+//copy bitmap block into data as it should be on disk
+static void bitmap_snapshot(long block, char *data)
+{
+    const char *map = bitmap + (block - sb.nBitmapBlock) * BLOCK_SIZE;
+    int i;
+    for (i = 0; i < BLOCK_SIZE; i++) {
+        data[i] = map[i] == BITMAP_NEW ? BITMAP_USED
+                : map[i] == BITMAP_FREED ? BITMAP_FREE : map[i];
+    }
+}
+
+//start the journal over once everything in it is home for good
+static void journal_reset(void)
+{
+    cs1550_journal_block jsb;
+
+    disk_sync();
+    memset(&jsb, 0, sizeof(jsb));
+    jsb.nMagic = JOURNAL_MAGIC;
+    jsb.nType = JOURNAL_SUPER;
+    jsb.nSequence = journal.sequence;
+    jsb.nCount = 1;
+    disk_write(&jsb, sizeof(jsb), sb.nJournalStart * BLOCK_SIZE);
+    disk_sync();
+    journal.head = 1;
+    if (journal.live != NULL) {
+        memset(journal.live, 0, sb.nBlocks);
+    }
+}
+
+//write the running batch to the journal, then home
+static void journal_commit(void)
+{
+    long i, j;
+
+    //a failed operation's part of the batch never is
+    if (fs_failed) {
+        undo_abort();
+    }
+    long n = journal.nbufs;
+    if (n == 0) {
+        return;
+    }
+    //the blocks the batch links in go home before it is committed
+    wb_flush();
+    long span = journal_span(n);
+    if (journal.head + span > sb.nJournalBlocks) {
+        journal_reset();
+    }
+
+    //descriptors and images, then the commit block
+    char *out = journal.out;
+    unsigned int sum = JOURNAL_CHECKSUM_INIT;
+    long pos = 0;
+    for (i = 0; i < n; i += JOURNAL_TAGS) {
+        cs1550_journal_block *desc = (cs1550_journal_block *) (out + pos * BLOCK_SIZE);
+        long count = n - i < (long) JOURNAL_TAGS ? n - i : (long) JOURNAL_TAGS;
+        memset(desc, 0, sizeof(*desc));
+        desc->nMagic = JOURNAL_MAGIC;
+        desc->nType = JOURNAL_DESCRIPTOR;
+        desc->nSequence = journal.sequence;
+        desc->nCount = count;
+        pos++;
+        for (j = 0; j < count; j++) {
+            struct journal_buf *jb = &journal.bufs[i + j];
+            if (is_bitmap_block(jb->block)) {
+                bitmap_snapshot(jb->block, jb->data);
+            }
+            desc->nHome[j] = jb->block;
+            memcpy(out + pos * BLOCK_SIZE, jb->data, BLOCK_SIZE);
+            pos++;
+        }
+    }
+    sum = journal_checksum(sum, out, pos * BLOCK_SIZE);
+    cs1550_journal_block *commit = (cs1550_journal_block *) (out + pos * BLOCK_SIZE);
+    memset(commit, 0, sizeof(*commit));
+    commit->nMagic = JOURNAL_MAGIC;
+    commit->nType = JOURNAL_COMMIT;
+    commit->nSequence = journal.sequence;
+    commit->nChecksum = sum;
+
+    disk_write(out, span * BLOCK_SIZE, (sb.nJournalStart + journal.head) * BLOCK_SIZE);
+    disk_sync();
+    LOG_DEBUG("transaction %lu: %ld blocks at journal block %ld",
+              journal.sequence, n, journal.head);
+
+    //now the blocks can go home, and the bitmap settles
+    for (i = 0; i < n; i++) {
+        struct journal_buf *jb = &journal.bufs[i];
+        disk_write(jb->data, BLOCK_SIZE, jb->block * BLOCK_SIZE);
+        journal.live[jb->block] = 1;
+        if (is_bitmap_block(jb->block)) {
+            char *map = bitmap + (jb->block - sb.nBitmapBlock) * BLOCK_SIZE;
+            for (j = 0; j < BLOCK_SIZE; j++) {
+                if (map[j] == BITMAP_NEW) {
+                    map[j] = BITMAP_USED;
+                } else if (map[j] == BITMAP_FREED) {
+                    map[j] = BITMAP_FREE;
+                }
+            }
+        }
+    }
+
+    sums_flush();
+
+    stats_add(&stats.journal_commits, 1);
+    stats_add(&stats.journal_blocks, n);
+    journal.head += span;
+    journal.sequence++;
+    journal.nbufs = 0;
+    memset(journal.index, -1, (journal.index_mask + 1) * sizeof(long));
+    //what the running operation did so far is for good now
+    undo_begin(1);
+}
+
+//drop the blocks the running batch got from slot n on
+static void journal_truncate(long n)
+{
+    long i;
+    if (journal.max == 0) {
+        return;
+    }
+    journal.nbufs = n;
+    memset(journal.index, -1, (journal.index_mask + 1) * sizeof(long));
+    for (i = 0; i < n; i++) {
+        *journal_slot(journal.bufs[i].block) = i;
+    }
+}
+
+//the running batch's copy of block, added to the batch if it isn't in it yet
+static struct journal_buf * journal_get(long block)
+{
+    struct journal_buf *jb = journal_find(block);
+    if (jb != NULL) {
+        return jb;
+    }
+    if (journal.nbufs == journal.max) {
+        LOG_DEBUG("batch full, committing in the middle of an operation");
+        journal_commit();
+    }
+    if (journal.nbufs == 0) {
+        journal.started_ns = stats_now();
+    }
+    *journal_slot(block) = journal.nbufs;
+    jb = &journal.bufs[journal.nbufs++];
+    jb->block = block;
+    return jb;
+}
+
+//the snapshot sends reads and writes of some blocks elsewhere, see below
+static long snap_pos(long pos);
+static long snap_cow(long pos);
+static int snap_release(long block);
+
+//read the block at byte position pos, as changed by the running batch.
+//Returns -EIO if it doesn't match its checksum, see sums_check().
+static int block_read(long pos, void *buf)
+{
+    pos = snap_pos(pos);
+    struct journal_buf *jb = journal_find(pos / BLOCK_SIZE);
+    if (jb != NULL) {
+        memcpy(buf, jb->data, BLOCK_SIZE);
+        return 0;
+    }
+    if (wb_read(pos / BLOCK_SIZE, buf)) {
+        return 0;
+    }
+    disk_read(buf, BLOCK_SIZE, pos);
+    return sums_check(pos, buf);
+}
+
+//write data to the block at byte position pos, through the write-back cache,
+//or through the journal if replay would write over it
+static void block_write(long pos, const void *buf)
+{
+    if (fs_failed || (pos = snap_cow(pos)) == -1) {
+        return;
+    }
+    long block = pos / BLOCK_SIZE;
+    struct journal_buf *jb = journal_find(block);
+    if (jb == NULL && journal.live != NULL && journal.live[block]) {
+        jb = journal_get(block);
+    }
+    if (jb != NULL) {
+        undo_journal(jb);
+        memcpy(jb->data, buf, BLOCK_SIZE);
+    } else {
+        wb_write(block, buf);
+    }
+}
+
+//write metadata to the block at byte position pos, through the journal
+static void meta_write(long pos, const void *buf)
+{
+    if (fs_failed || (pos = snap_cow(pos)) == -1) {
+        return;
+    }
+    long block = pos / BLOCK_SIZE;
+    if (journal.max == 0 || bitmap[block] == BITMAP_NEW) {
+        block_write(pos, buf);
+    } else {
+        struct journal_buf *jb = journal_get(block);
+        undo_journal(jb);
+        memcpy(jb->data, buf, BLOCK_SIZE);
+    }
+}
+
+/*
+ * The data area is split into allocation groups of AG_BLOCKS blocks, the
+ * last one possibly shorter, each with a count of its free blocks. They
+ * only exist in memory, groups_load() counts them from the bitmap at mount.
+ * New directories go to the groups with the most room, in turn (see
+ * dir_group()), and every other block is allocated as close after a block
+ * it belongs with as there is room, in that block's group first: a file's
+ * blocks follow its directory and each other instead of taking the first
+ * free block of the image, which another file is just as likely to want.
+ */
+#define AG_BLOCKS 1024
+
+static struct
+{
+    long *free;                 //free blocks in each group
+    long count;
+    long next_dir;              //group dir_group() looks at first
+} groups;
+
+static long group_of(long block)
+{
+    return (block - sb.nDataStart) / AG_BLOCKS;
+}
+
+static long group_end(long g)
+{
+    long end = sb.nDataStart + (g + 1) * AG_BLOCKS;
+    return end < sb.nDataEnd ? end : sb.nDataEnd;
+}
+
+static void groups_load(void)
+{
+    long b;
+    groups.count = (sb.nDataEnd - sb.nDataStart + AG_BLOCKS - 1) / AG_BLOCKS;
+    groups.free = calloc(groups.count > 0 ? groups.count : 1, sizeof(long));
+    groups.next_dir = 0;
+    for (b = sb.nDataStart; b < sb.nDataEnd; b++) {
+        groups.free[group_of(b)] += bitmap[b] == BITMAP_FREE;
+    }
+}
+
+static void groups_free(void)
+{
+    free(groups.free);
+    groups.free = NULL;
+    groups.count = 0;
+}
+
+//set block's bitmap entry to value, keeping the free counts right. A block
+//freed in the running batch counts as free, though it can't be used yet;
+//BITMAP_FREED only stays that for one committed as used.
+static void bitmap_set(long block, char value)
+{
+    long bblock = sb.nBitmapBlock + block / BLOCK_SIZE;
+    //its bitmap block joins the batch first, as making room for it commits
+    //the batch, which settles the bitmap. It is filled in from bitmap then.
+    if (journal.max != 0) {
+        journal_get(bblock);
+    }
+    if (value == BITMAP_FREED && (journal.max == 0 || bitmap[block] != BITMAP_USED)) {
+        value = BITMAP_FREE;
+    }
+    long was = bitmap[block] == BITMAP_FREE || bitmap[block] == BITMAP_FREED;
+    long now = value == BITMAP_FREE || value == BITMAP_FREED;
+    undo_bitmap(block);
+    bitmap[block] = value;
+    if (journal.max == 0) {
+        disk_write(bitmap + (bblock - sb.nBitmapBlock) * BLOCK_SIZE, BLOCK_SIZE,
+                   bblock * BLOCK_SIZE);
+    }
+    sb.nFreeBlocks += now - was;
+    if (groups.free != NULL) {
+        groups.free[group_of(block)] += now - was;
+    }
+}
+
+//the first free block in [from, to), marked used, or -1
+static long bitmap_take(long from, long to)
+{
+    long i;
+    for (i = from; i < to; i++) {
+        if (bitmap[i] == BITMAP_FREE) {
+            bitmap_set(i, journal.max != 0 ? BITMAP_NEW : BITMAP_USED);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Find a free block as close after block near as there is one, which is
+ * marked used: from near to the end of its group, then the start of the
+ * group, then each group after it. near is a block the new one belongs with,
+ * the one before it in the file or the file's directory, or 0 for none.
+ * Returns the block number, or -1 if the image is full.
+ */
+static long bitmap_alloc(long near)
+{
+    long g, k, b;
+    if (sb.nFreeBlocks == 0) {
+        return -1;
+    }
+    if (near < sb.nDataStart || near >= sb.nDataEnd) {
+        near = sb.nDataStart;
+    }
+    stats_add(&stats.bitmap_scans, 1);
+    g = group_of(near);
+    if (groups.free[g] != 0) {
+        long first = sb.nDataStart + g * AG_BLOCKS;
+        if ((b = bitmap_take(near, group_end(g))) != -1
+            || (b = bitmap_take(first, near)) != -1) {
+            return b;
+        }
+    }
+    for (k = 1; k < groups.count; k++) {
+        g = (g + 1) % groups.count;
+        if (groups.free[g] != 0
+            && (b = bitmap_take(sb.nDataStart + g * AG_BLOCKS, group_end(g))) != -1) {
+            stats_add(&stats.alloc_spilled, 1);
+            return b;
+        }
+    }
+    return -1;
+}
+
+//a block to allocate a new directory near: the first of the next group, in
+//turn, with at least an average share of the free blocks
+static long dir_group(void)
+{
+    long k;
+    for (k = 0; k < groups.count; k++) {
+        long g = (groups.next_dir + k) % groups.count;
+        if (groups.free[g] * groups.count >= sb.nFreeBlocks) {
+            groups.next_dir = (g + 1) % groups.count;
+            return sb.nDataStart + g * AG_BLOCKS;
+        }
+    }
+    return 0;
+}
+
+static void bitmap_free(long block)
+{
+    //whatever pointed to it may still be there
+    if (fs_failed || snap_release(block)) {
+        return;
+    }
+    if (block >= sb.nDataStart && block < sb.nDataEnd) {
+        //a block from the running batch was never committed as used
+        bitmap_set(block, BITMAP_FREED);
+    }
+}
+
+/*
+ * Apply every complete transaction in the journal, then empty it. Runs at
+ * mount, before anything else looks at the image.
+ */
+static int journal_replay(void)
+{
+    cs1550_journal_block jsb;
+    long count = 0;
+    long i;
+
+    disk_read(&jsb, sizeof(jsb), sb.nJournalStart * BLOCK_SIZE);
+    if (jsb.nMagic != JOURNAL_MAGIC || jsb.nType != JOURNAL_SUPER
+        || jsb.nCount < 1 || jsb.nCount >= sb.nJournalBlocks) {
+        LOG_ERROR("%s: the journal is damaged", disk_path);
+        return -EUCLEAN;
+    }
+
+    //the whole journal, read in one go
+    char *log = malloc(sb.nJournalBlocks * BLOCK_SIZE);
+    disk_read(log, sb.nJournalBlocks * BLOCK_SIZE, sb.nJournalStart * BLOCK_SIZE);
+
+    unsigned long seq = jsb.nSequence;
+    long pos = jsb.nCount;
+    for (;;) {
+        //find the commit block, checking the descriptors on the way
+        unsigned int sum = JOURNAL_CHECKSUM_INIT;
+        long start = pos;
+        int ok = 0;
+        while (pos < sb.nJournalBlocks) {
+            cs1550_journal_block *jb = (cs1550_journal_block *) (log + pos * BLOCK_SIZE);
+            if (jb->nMagic != JOURNAL_MAGIC || jb->nSequence != seq) {
+                break;
+            }
+            if (jb->nType == JOURNAL_COMMIT) {
+                sum = journal_checksum(sum, log + start * BLOCK_SIZE, (pos - start) * BLOCK_SIZE);
+                ok = pos > start && jb->nChecksum == sum;
+                break;
+            }
+            if (jb->nType != JOURNAL_DESCRIPTOR || jb->nCount == 0 || jb->nCount > JOURNAL_TAGS
+                || pos + 1 + jb->nCount >= sb.nJournalBlocks) {
+                break;
+            }
+            for (i = 0; i < jb->nCount; i++) {
+                long home = jb->nHome[i];
+                if (home < 0 || home >= sb.nBlocks
+                    || (home >= sb.nJournalStart && home < sb.nJournalStart + sb.nJournalBlocks)) {
+                    break;
+                }
+            }
+            if (i < jb->nCount) {
+                break;
+            }
+            pos += 1 + jb->nCount;
+        }
+        if (!ok) {
+            break;
+        }
+
+        //it's whole, put every image where it belongs
+        long p = start;
+        while (p < pos) {
+            cs1550_journal_block *desc = (cs1550_journal_block *) (log + p * BLOCK_SIZE);
+            for (i = 0; i < desc->nCount; i++) {
+                disk_write(log + (p + 1 + i) * BLOCK_SIZE, BLOCK_SIZE, desc->nHome[i] * BLOCK_SIZE);
+            }
+            p += 1 + desc->nCount;
+        }
+        count++;
+        seq++;
+        pos++;
+    }
+    free(log);
+
+    if (count != 0) {
+        LOG_WARN("%s: replayed %ld transactions from the journal", disk_path, count);
+        //the superblock may have been one of them: where the chunk table
+        //and the snapshot start is only in there
+        disk_read(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+    }
+    journal.sequence = seq;
+    journal_reset();
+    return 0;
+}
+
+//set up the journal of the mounted image, replaying what is in it
+static int journal_open(void)
+{
+    long size;
+
+    memset(&journal, 0, sizeof(journal));
+    if (sb.nJournalBlocks == 0) {
+        return 0;
+    }
+
+    int res = journal_replay();
+    if (res != 0) {
+        return res;
+    }
+
+    //the biggest transaction that fits after the journal super
+    journal.max = (sb.nJournalBlocks - 2) * JOURNAL_TAGS / (JOURNAL_TAGS + 1);
+    while (journal_span(journal.max) > sb.nJournalBlocks - 1) {
+        journal.max--;
+    }
+    journal.batch = journal.max / 2 < JOURNAL_BATCH ? journal.max / 2 : JOURNAL_BATCH;
+    journal.bufs = malloc(journal.max * sizeof(struct journal_buf));
+    journal.out = malloc(journal_span(journal.max) * BLOCK_SIZE);
+    for (size = 1; size < 2 * journal.max; size *= 2) {
+    }
+    journal.index = malloc(size * sizeof(long));
+    journal.index_mask = size - 1;
+    memset(journal.index, -1, size * sizeof(long));
+    journal.live = calloc(sb.nBlocks, 1);
+    return 0;
+}
+
+//commit what is left and empty the journal, so the next mount has nothing
+//to replay
+static void journal_close(void)
+{
+    if (journal.max != 0) {
+        journal_commit();
+        journal_reset();
+    }
+    free(journal.bufs);
+    free(journal.out);
+    free(journal.index);
+    free(journal.live);
+    memset(&journal, 0, sizeof(journal));
+}
+
+//every operation runs between these, one at a time
+static void fs_enter(void)
+{
+    pthread_mutex_lock(&fs_mutex);
+    undo_begin(0);
+}
+
+//and returns res, or the error the operation failed with underneath, after
+//undoing it: what it did is never committed
+static int fs_leave(int res)
+{
+    if (fs_failed) {
+        undo_abort();
+        res = -fs_failed;
+        fs_failed = 0;
+    }
+    undo_end();
+    if (journal.nbufs != 0 && (journal.nbufs >= journal.batch
+                               || stats_now() - journal.started_ns >= journal_commit_ns)) {
+        journal_commit();
+    }
+    trace_append(res);
+    pthread_mutex_unlock(&fs_mutex);
+    return res;
+}
+
+// ============================================================================
+// ================================ write-back ================================
+// ============================================================================
+/*
+ * Blocks written with block_write() don't go to disk right away: they wait
+ * in the write-back cache, which block_read() looks in after the running
+ * batch, so a write costs a copy into memory. The flusher thread writes
+ * them back once they are wb.age_ns old (-o writeback), or as soon as half
+ * of the cache is dirty, in order of block number and with one write per
+ * run of consecutive blocks. It copies them out with fs_mutex held but
+ * writes them with it dropped, holding wb.io instead, so the handlers go on
+ * meanwhile; a block written again in the meantime stays dirty.
+ *
+ * A write that finds all wb.max blocks (-o dirty) dirty writes the whole
+ * cache back itself, which holds back a writer that is faster than the
+ * disk. Committing the journal writes it back first, so the blocks a
+ * transaction links in are on disk before it is. flush (close) writes it
+ * back, fsync also commits the batch, which syncs both. Everything that
+ * waits for the cache waits for wb.io first, so the flusher's writes never
+ * land after newer ones.
+ *
+ * The tools have the cache but no flusher: their commits and unmount write
+ * it back.
+ */
+#define WB_DIRTY_BLOCKS 4096        //-o dirty default, 2MB
+#define WRITEBACK_SEC 1             //-o writeback default
+#define WB_DRAIN_BLOCKS 256         //most blocks written back at a time
+
+struct wb_buf
+{
+    long block;                 //where it goes, -1 if the buf is free
+    long next;                  //next buf in its hash chain or the free list, -1 at the end
+    unsigned long dirtied_ns;   //when it was first written since it was last home
+    unsigned long gen;          //changes with every write of it
+    unsigned long flushing;     //gen the flusher is writing back, 0 if none
+    unsigned long undo_op;      //undo knows what it was before, see undo_cache()
+    char data[BLOCK_SIZE];
+};
+
+static struct
+{
+    struct wb_buf *bufs;        //max of them, NULL if there is no cache
+    long max;                   //most dirty blocks, -o dirty=N, 0 = write through
+    long count;                 //bufs in use
+    long *index;                //hash of block number -> first buf of its chain, -1 if none
+    long index_mask;
+    long free;                  //first free buf, -1 if there is none
+    unsigned long gen;          //last gen given out
+    unsigned long age_ns;       //how long a block may stay dirty
+    pthread_mutex_t io;         //held by the flusher while it writes without fs_mutex
+    int running;                //the flusher was started
+    int stop;                   //asks it to finish
+    int kick;                   //asks it to write back now
+    pthread_t thread;
+    pthread_mutex_t lock;       //guards stop and kick
+    pthread_cond_t wake;
+} wb = { NULL, WB_DIRTY_BLOCKS, 0, NULL, 0, -1, 0, WRITEBACK_SEC * 1000000000UL,
+         PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+//set up the cache of the mounted image, unless -o dirty=0
+static void wb_open(void)
+{
+    long i, size;
+
+    if (wb.max <= 0) {
+        return;
+    }
+    wb.bufs = malloc(wb.max * sizeof(struct wb_buf));
+    for (i = 0; i < wb.max; i++) {
+        wb.bufs[i].block = -1;
+        wb.bufs[i].next = i + 1 < wb.max ? i + 1 : -1;
+    }
+    wb.free = 0;
+    wb.count = 0;
+    for (size = 1; size < 2 * wb.max; size *= 2) {
+    }
+    wb.index = malloc(size * sizeof(long));
+    wb.index_mask = size - 1;
+    memset(wb.index, -1, size * sizeof(long));
+}
+
+//and drop it once it is written back
+static void wb_close(void)
+{
+    free(wb.bufs);
+    free(wb.index);
+    wb.bufs = NULL;
+    wb.index = NULL;
+    wb.count = 0;
+}
+
+static long * wb_head(long block)
+{
+    return &wb.index[((unsigned long) block * 0x9e3779b97f4a7c15UL >> 17) & wb.index_mask];
+}
+
+//the cached copy of block, NULL if it has none
+static struct wb_buf * wb_find(long block)
+{
+    long i;
+    if (wb.count == 0) {
+        return NULL;
+    }
+    for (i = *wb_head(block); i != -1; i = wb.bufs[i].next) {
+        if (wb.bufs[i].block == block) {
+            return &wb.bufs[i];
+        }
+    }
+    return NULL;
+}
+
+//b is home, take it out of the cache
+static void wb_remove(struct wb_buf *b)
+{
+    long i = b - wb.bufs;
+    long *link = wb_head(b->block);
+    while (*link != i) {
+        link = &wb.bufs[*link].next;
+    }
+    *link = b->next;
+    b->block = -1;
+    b->flushing = 0;
+    b->next = wb.free;
+    wb.free = i;
+    wb.count--;
+}
+
+static int wb_cmp(const void *a, const void *b)
+{
+    long x = (*(struct wb_buf * const *) a)->block;
+    long y = (*(struct wb_buf * const *) b)->block;
+    return x < y ? -1 : x > y;
+}
+
+//the bufs in use that want writing back, all of them if all is set, sorted
+//by block into a list the caller frees. Returns how many there are.
+static long wb_dirty(int all, struct wb_buf ***list)
+{
+    unsigned long now = stats_now();
+    long i, n = 0;
+
+    *list = malloc((wb.count + 1) * sizeof(struct wb_buf *));
+    for (i = 0; i < wb.max; i++) {
+        struct wb_buf *b = &wb.bufs[i];
+        if (b->block != -1 && (all || (b->flushing == 0 && now - b->dirtied_ns >= wb.age_ns))) {
+            (*list)[n++] = b;
+        }
+    }
+    qsort(*list, n, sizeof(struct wb_buf *), wb_cmp);
+    return n;
+}
+
+//write the n blocks at data home, with blocks[] their numbers in order:
+//one write per run of consecutive ones. put is disk_write, or disk_put
+//without fs_mutex.
+static void wb_put(const long *blocks, const char *data, long n,
+                   size_t (*put)(const void *, size_t, long))
+{
+    long i, j;
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && blocks[j] == blocks[j - 1] + 1; j++) {
+        }
+        put(data + i * BLOCK_SIZE, (j - i) * BLOCK_SIZE, blocks[i] * BLOCK_SIZE);
+        stats_add(&stats.writeback_runs, 1);
+    }
+    stats_add(&stats.writeback_blocks, n);
+}
+
+//write the whole cache back, but for what undo keeps if keep is set
+static void wb_drain(int keep)
+{
+    struct wb_buf **list;
+    long blocks[WB_DRAIN_BLOCKS];
+    long i, m = 0;
+
+    if (wb.count == 0) {
+        return;
+    }
+    //whatever the flusher is writing lands first
+    pthread_mutex_lock(&wb.io);
+    pthread_mutex_unlock(&wb.io);
+
+    long n = wb_dirty(1, &list);
+    char *out = malloc(WB_DRAIN_BLOCKS * BLOCK_SIZE);
+    for (i = 0; i < n; i++) {
+        struct wb_buf *b = list[i];
+        if (keep && undo_keeps(b)) {
+            continue;
+        }
+        //the flusher wrote this very copy, only its checksum is missing
+        if (b->flushing == b->gen) {
+            sums_written(b->data, BLOCK_SIZE, b->block * BLOCK_SIZE);
+            wb_remove(b);
+            continue;
+        }
+        blocks[m] = b->block;
+        memcpy(out + m * BLOCK_SIZE, b->data, BLOCK_SIZE);
+        wb_remove(b);
+        if (++m == WB_DRAIN_BLOCKS) {
+            wb_put(blocks, out, m, disk_write);
+            m = 0;
+        }
+    }
+    wb_put(blocks, out, m, disk_write);
+    free(out);
+    free(list);
+}
+
+static void wb_flush(void)
+{
+    wb_drain(0);
+}
+
+//wake the flusher up to write back now
+static void wb_kick(void)
+{
+    if (!wb.running) {
+        return;
+    }
+    pthread_mutex_lock(&wb.lock);
+    wb.kick = 1;
+    pthread_cond_signal(&wb.wake);
+    pthread_mutex_unlock(&wb.lock);
+}
+
+//copy the cached copy of block into buf. Returns 0 if there is none.
+static int wb_read(long block, void *buf)
+{
+    struct wb_buf *b = wb_find(block);
+    if (b == NULL) {
+        return 0;
+    }
+    memcpy(buf, b->data, BLOCK_SIZE);
+    return 1;
+}
+
+//cache data as what goes into block, straight to disk if there is no cache
+static void wb_write(long block, const void *buf)
+{
+    if (wb.bufs == NULL) {
+        disk_write(buf, BLOCK_SIZE, block * BLOCK_SIZE);
+        return;
+    }
+    struct wb_buf *b = wb_find(block);
+    if (b != NULL) {
+        undo_cache(b, 1);
+    } else {
+        //what the running operation wrote stays, so it can still be undone,
+        //unless the cache holds nothing else
+        if (wb.free == -1) {
+            stats_add(&stats.writeback_stalls, 1);
+            wb_drain(1);
+        }
+        if (wb.free == -1) {
+            wb_drain(0);
+        }
+        long i = wb.free;
+        long *head = wb_head(block);
+        b = &wb.bufs[i];
+        wb.free = b->next;
+        b->block = block;
+        b->next = *head;
+        *head = i;
+        b->dirtied_ns = stats_now();
+        b->flushing = 0;
+        undo_cache(b, 0);
+        if (++wb.count == wb.max / 2) {
+            wb_kick();
+        }
+    }
+    memcpy(b->data, buf, BLOCK_SIZE);
+    b->gen = ++wb.gen;
+}
+
+/*
+ * The flusher's side: copy up to WB_DRAIN_BLOCKS of the blocks that want
+ * writing back into out and their numbers and gens into blocks and gens,
+ * sorted by block, and take wb.io. Called with fs_mutex held. Returns how
+ * many, and doesn't take wb.io if there are none.
+ */
+static long wb_pick(long *blocks, unsigned long *gens, char *out)
+{
+    struct wb_buf **list;
+    long i;
+
+    if (wb.count == 0) {
+        return 0;
+    }
+    long n = wb_dirty(wb.count >= wb.max / 2, &list);
+    if (n > WB_DRAIN_BLOCKS) {
+        n = WB_DRAIN_BLOCKS;
+    }
+    for (i = 0; i < n; i++) {
+        blocks[i] = list[i]->block;
+        gens[i] = list[i]->gen;
+        list[i]->flushing = list[i]->gen;
+        memcpy(out + i * BLOCK_SIZE, list[i]->data, BLOCK_SIZE);
+    }
+    free(list);
+    if (n != 0) {
+        pthread_mutex_lock(&wb.io);
+    }
+    return n;
+}
+
+//the n blocks wb_pick() gave are home: they are clean unless written again
+//since, or already taken care of by wb_flush(). Called with fs_mutex held.
+static void wb_picked(const long *blocks, const unsigned long *gens, const char *out, long n)
+{
+    long i;
+    for (i = 0; i < n; i++) {
+        struct wb_buf *b = wb_find(blocks[i]);
+        if (b == NULL || b->flushing != gens[i]) {
+            continue;
+        }
+        sums_written(out + i * BLOCK_SIZE, BLOCK_SIZE, blocks[i] * BLOCK_SIZE);
+        if (b->gen == gens[i]) {
+            wb_remove(b);
+        } else {
+            b->flushing = 0;
+            b->dirtied_ns = stats_now();
+        }
+    }
+}
+
+//sleep for ns unless kicked or asked to stop, returns 1 if asked to stop
+static int wb_sleep(unsigned long ns)
+{
+    struct timespec until;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ns / 1000000000UL;
+    until.tv_nsec += ns % 1000000000UL;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&wb.lock);
+    while (!wb.stop && !wb.kick && pthread_cond_timedwait(&wb.wake, &wb.lock, &until) == 0) {
+    }
+    wb.kick = 0;
+    stop = wb.stop;
+    pthread_mutex_unlock(&wb.lock);
+    return stop;
+}
+
+//the flusher: write back what is old enough, or all that is dirty once the
+//cache is half full, a WB_DRAIN_BLOCKS batch at a time
+static void * wb_thread(void *arg)
+{
+    long blocks[WB_DRAIN_BLOCKS];
+    unsigned long gens[WB_DRAIN_BLOCKS];
+    char *out = malloc(WB_DRAIN_BLOCKS * BLOCK_SIZE);
+    long n;
+    (void) arg;
+
+    while (!wb_sleep(wb.age_ns / 2)) {
+        do {
+            //not fs_enter(), fs_leave() may commit, which waits for wb.io
+            pthread_mutex_lock(&fs_mutex);
+            n = wb_pick(blocks, gens, out);
+            pthread_mutex_unlock(&fs_mutex);
+            if (n == 0) {
+                break;
+            }
+            wb_put(blocks, out, n, disk_put);
+            pthread_mutex_unlock(&wb.io);
+
+            //which, like any operation, commits a batch that has waited
+            //long enough
+            fs_enter();
+            wb_picked(blocks, gens, out, n);
+            fs_leave(0);
+        } while (n == WB_DRAIN_BLOCKS);
+    }
+    free(out);
+    return NULL;
+}
+
+//start the flusher, if there is a cache
+static void wb_start(void)
+{
+    if (wb.bufs != NULL && pthread_create(&wb.thread, NULL, wb_thread, NULL) == 0) {
+        wb.running = 1;
+    }
+}
+
+//and stop it, before the image is closed
+static void wb_stop(void)
+{
+    if (!wb.running) {
+        return;
+    }
+    pthread_mutex_lock(&wb.lock);
+    wb.stop = 1;
+    pthread_cond_signal(&wb.wake);
+    pthread_mutex_unlock(&wb.lock);
+    pthread_join(wb.thread, NULL);
+    wb.running = 0;
+}
+
+// ============================================================================
+// ================================= snapshots ================================
+// ============================================================================
+/*
+ * mkdir /.snapshot freezes the image as it is: the root directory is copied
+ * and every block in use is marked held in the snapshot's map, which costs
+ * a block per MAX_DATA_IN_BLOCK blocks of the image and nothing per file.
+ * From then on a held block is never written again. The first write to
+ * one, by any handler, goes to a new block instead and the remap table
+ * records where; reads of the held block are sent there too. Freeing a held
+ * block only marks it released in the map: the snapshot still uses it.
+ * Everything above block_read(), block_write(), meta_write() and
+ * bitmap_free() keeps using the held block's position and never knows.
+ *
+ * The snapshot is read through /.snapshot, with snap.view set: block 0 is
+ * then the snapshot's root and no block is remapped, so the handlers see
+ * the image as it was. Nothing under /.snapshot can be changed.
+ *
+ * rmdir /.snapshot drops it. The image's copy of every remapped block is
+ * copied back home, through the journal, before its entry goes, and the
+ * released blocks are freed; a crash in the middle leaves the superblock
+ * with a map but no root, and mount finishes the job.
+ *
+ * There is one snapshot at a time. fsck checks the image through the remap
+ * table and counts what the snapshot holds as used; repairing an image
+ * drops its snapshot first.
+ */
+#define SNAP_PATH "/.snapshot"
+
+static struct
+{
+    long root;                      //root directory of the snapshot, 0 if there is none
+    int view;                       //the handler is reading the snapshot
+    int finishing;                  //snap_finish() is dropping it, see snap_cow()
+    cs1550_disk_block *map;         //the map, block by block as on disk
+    long *map_pos;                  //where each of its blocks is
+    long nmap;
+    cs1550_disk_block *remap;       //the remap table, likewise
+    long *remap_pos;
+    long nremap;
+    int *by_block;                  //remap entry number + 1 of each held block remapped
+} snap;
+
+//the map byte of block
+static char * snap_state(long block)
+{
+    return &snap.map[block / MAX_DATA_IN_BLOCK].data[block % MAX_DATA_IN_BLOCK];
+}
+
+static struct cs1550_remap_entry *snap_remap_entry(int i)
+{
+    return &((struct cs1550_remap_entry *) snap.remap[i / REMAP_ENTRIES].data)[i % REMAP_ENTRIES];
+}
+
+//write the remap block holding entry i
+static void snap_remap_store(int i)
+{
+    meta_write(snap.remap_pos[i / REMAP_ENTRIES], &snap.remap[i / REMAP_ENTRIES]);
+}
+
+//and the map block holding block's byte
+static void snap_map_store(long block)
+{
+    meta_write(snap.map_pos[block / MAX_DATA_IN_BLOCK], &snap.map[block / MAX_DATA_IN_BLOCK]);
+}
+
+//read the chain at pos into *blocks and *where, -1 if it is damaged
+static long snap_chain_load(long pos, cs1550_disk_block **blocks, long **where)
+{
+    long n = 0;
+
+    *blocks = NULL;
+    *where = NULL;
+    while (pos != 0) {
+        if (!valid_block_pos(pos) || n == sb.nBlocks) {
+            return -1;
+        }
+        *blocks = realloc(*blocks, (n + 1) * sizeof(cs1550_disk_block));
+        *where = realloc(*where, (n + 1) * sizeof(long));
+        block_read(pos, &(*blocks)[n]);
+        (*where)[n] = pos;
+        pos = (*blocks)[n].nNextBlock;
+        n++;
+    }
+    return n;
+}
+
+static void snap_free(void)
+{
+    free(snap.map);
+    free(snap.map_pos);
+    free(snap.remap);
+    free(snap.remap_pos);
+    free(snap.by_block);
+    memset(&snap, 0, sizeof(snap));
+}
+
+//read the snapshot of the mounted image into memory, if it has one.
+//Returns -EINVAL if it is damaged.
+static int snap_load(void)
+{
+    int i;
+
+    memset(&snap, 0, sizeof(snap));
+    if (sb.nSnapMap == 0) {
+        return 0;
+    }
+    snap.nmap = snap_chain_load(sb.nSnapMap, &snap.map, &snap.map_pos);
+    snap.nremap = snap_chain_load(sb.nSnapRemap, &snap.remap, &snap.remap_pos);
+    snap.by_block = calloc(sb.nBlocks, sizeof(int));
+    int bad = snap.nmap * (long) MAX_DATA_IN_BLOCK < sb.nBlocks || snap.nremap == -1
+              || (sb.nSnapRoot != 0 && !valid_block_pos(sb.nSnapRoot));
+    for (i = 0; !bad && i < (int) (snap.nremap * REMAP_ENTRIES); i++) {
+        struct cs1550_remap_entry *e = snap_remap_entry(i);
+        if (e->nFrom == 0) {
+            continue;
+        }
+        bad = !valid_block_pos(e->nFrom) || !valid_block_pos(e->nTo)
+              || snap.by_block[e->nFrom / BLOCK_SIZE] != 0;
+        if (!bad) {
+            snap.by_block[e->nFrom / BLOCK_SIZE] = i + 1;
+        }
+    }
+    if (bad) {
+        LOG_ERROR("the snapshot of %s is damaged", disk_path);
+        snap_free();
+        return -EINVAL;
+    }
+    snap.root = sb.nSnapRoot;
+    return 0;
+}
+
+//where the block at pos is read from
+static long snap_pos(long pos)
+{
+    if (snap.view) {
+        return pos == 0 ? snap.root : pos;
+    }
+    if (snap.by_block != NULL && snap.by_block[pos / BLOCK_SIZE] != 0) {
+        return snap_remap_entry(snap.by_block[pos / BLOCK_SIZE] - 1)->nTo;
+    }
+    return pos;
+}
+
+//is block held by the snapshot and still the image's?
+static int snap_held(long block)
+{
+    return snap.map != NULL && !snap.finishing && block >= sb.nDataStart
+        && block < sb.nDataEnd && *snap_state(block) == SNAP_HELD;
+}
+
+//a free remap entry, adding a block to the table if it is full. -1 if the image is.
+static int snap_remap_new(void)
+{
+    int n = snap.nremap * REMAP_ENTRIES;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (snap_remap_entry(i)->nFrom == 0) {
+            return i;
+        }
+    }
+    long b = bitmap_alloc(0);
+    if (b == -1) {
+        return -1;
+    }
+    long last = snap.nremap++;
+    snap.remap = realloc(snap.remap, snap.nremap * sizeof(cs1550_disk_block));
+    snap.remap_pos = realloc(snap.remap_pos, snap.nremap * sizeof(long));
+    memset(&snap.remap[last], 0, sizeof(cs1550_disk_block));
+    snap.remap_pos[last] = b * BLOCK_SIZE;
+    meta_write(snap.remap_pos[last], &snap.remap[last]);
+    if (last == 0) {
+        sb.nSnapRemap = b * BLOCK_SIZE;
+        meta_write((long) SUPER_BLOCK * BLOCK_SIZE, &sb);
+    } else {
+        snap.remap[last - 1].nNextBlock = b * BLOCK_SIZE;
+        meta_write(snap.remap_pos[last - 1], &snap.remap[last - 1]);
+    }
+    return n;
+}
+
+/*
+ * Where a write to the block at pos goes: its copy if it was remapped, a
+ * new copy if it is held, pos itself otherwise. Returns -1 and fails the
+ * operation with ENOSPC if there is no room for the copy.
+ */
+static long snap_cow(long pos)
+{
+    long block = pos / BLOCK_SIZE;
+
+    if (snap.by_block != NULL && snap.by_block[block] != 0 && !snap.finishing) {
+        return snap_remap_entry(snap.by_block[block] - 1)->nTo;
+    }
+    if (!snap_held(block)) {
+        return pos;
+    }
+    int i = snap_remap_new();
+    long to = i == -1 ? -1 : bitmap_alloc(block);
+    if (to == -1) {
+        LOG_WARN("no room to copy block %ld of the snapshot", block);
+        fs_failed = ENOSPC;
+        return -1;
+    }
+    struct cs1550_remap_entry *e = snap_remap_entry(i);
+    e->nFrom = pos;
+    e->nTo = to * BLOCK_SIZE;
+    snap.by_block[block] = i + 1;
+    snap_remap_store(i);
+    stats_add(&stats.snapshot_copies, 1);
+    return e->nTo;
+}
+
+//free block for the image. Returns 1 if the snapshot holds it, which then
+//only marks it released and frees the image's copy of it.
+static int snap_release(long block)
+{
+    if (!snap_held(block)) {
+        return 0;
+    }
+    if (snap.by_block[block] != 0) {
+        int i = snap.by_block[block] - 1;
+        struct cs1550_remap_entry *e = snap_remap_entry(i);
+        long to = e->nTo / BLOCK_SIZE;
+        memset(e, 0, sizeof(*e));
+        snap.by_block[block] = 0;
+        snap_remap_store(i);
+        bitmap_free(to);
+    }
+    *snap_state(block) = SNAP_RELEASED;
+    snap_map_store(block);
+    return 1;
+}
+
+/*
+ * Take a snapshot of the mounted image. The sizes of open files must be in
+ * their entries already. Returns -EEXIST if there is one, -ENOSPC if there
+ * is no room for its root and map.
+ */
+static int snap_create(void)
+{
+    long nmap = (sb.nBlocks + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+    long *where = malloc((nmap + 1) * sizeof(long));
+    cs1550_disk_block root;
+    long i, b;
+
+    if (snap.map != NULL) {
+        free(where);
+        return -EEXIST;
+    }
+    for (i = 0; i <= nmap; i++) {
+        where[i] = bitmap_alloc(0);
+        if (where[i] == -1) {
+            while (i-- > 0) {
+                bitmap_free(where[i]);
+            }
+            free(where);
+            return -ENOSPC;
+        }
+    }
+
+    //every block in use is held, but the snapshot's own
+    snap.map = calloc(nmap, sizeof(cs1550_disk_block));
+    snap.map_pos = malloc(nmap * sizeof(long));
+    snap.nmap = nmap;
+    snap.by_block = calloc(sb.nBlocks, sizeof(int));
+    for (b = sb.nDataStart; b < sb.nDataEnd; b++) {
+        if (bitmap[b] == BITMAP_USED || bitmap[b] == BITMAP_NEW) {
+            *snap_state(b) = SNAP_HELD;
+        }
+    }
+    for (i = 0; i <= nmap; i++) {
+        *snap_state(where[i]) = 0;
+    }
+    for (i = 0; i < nmap; i++) {
+        snap.map_pos[i] = where[i + 1] * BLOCK_SIZE;
+        snap.map[i].nNextBlock = i + 1 < nmap ? where[i + 2] * BLOCK_SIZE : 0;
+        meta_write(snap.map_pos[i], &snap.map[i]);
+    }
+    block_read(0, &root);
+    snap.root = where[0] * BLOCK_SIZE;
+    meta_write(snap.root, &root);
+
+    sb.nSnapRoot = snap.root;
+    sb.nSnapMap = snap.map_pos[0];
+    sb.nSnapRemap = 0;
+    meta_write((long) SUPER_BLOCK * BLOCK_SIZE, &sb);
+    if (journal.max != 0) {
+        journal_commit();
+    }
+    LOG_INFO("snapshot taken, its root is block %ld", where[0]);
+    free(where);
+    return 0;
+}
+
+/*
+ * Finish dropping the snapshot once its root is gone: copy the remapped
+ * blocks home and free what only the snapshot used.
+ */
+static void snap_finish(void)
+{
+    cs1550_disk_block block;
+    int i;
+    long b;
+
+    snap.finishing = 1;
+    for (i = 0; i < (int) (snap.nremap * REMAP_ENTRIES); i++) {
+        struct cs1550_remap_entry *e = snap_remap_entry(i);
+        if (e->nFrom == 0) {
+            continue;
+        }
+        //home first, so the entry only goes once both copies match
+        long from = e->nFrom;
+        long to = e->nTo / BLOCK_SIZE;
+        block_read(from, &block);
+        meta_write(from, &block);
+        memset(e, 0, sizeof(*e));
+        snap.by_block[from / BLOCK_SIZE] = 0;
+        snap_remap_store(i);
+        bitmap_free(to);
+    }
+    for (b = sb.nDataStart; b < sb.nDataEnd; b++) {
+        if (*snap_state(b) == SNAP_RELEASED) {
+            bitmap_free(b);
+        }
+    }
+    for (i = 0; i < snap.nmap; i++) {
+        bitmap_free(snap.map_pos[i] / BLOCK_SIZE);
+    }
+    for (i = 0; i < snap.nremap; i++) {
+        bitmap_free(snap.remap_pos[i] / BLOCK_SIZE);
+    }
+    sb.nSnapMap = 0;
+    sb.nSnapRemap = 0;
+    meta_write((long) SUPER_BLOCK * BLOCK_SIZE, &sb);
+    snap_free();
+    LOG_INFO("snapshot dropped");
+}
+
+//drop the snapshot of the mounted image
+static int snap_delete(void)
+{
+    if (snap.root == 0) {
+        return -ENOENT;
+    }
+    long root = snap.root;
+    snap.root = 0;
+    sb.nSnapRoot = 0;
+    meta_write((long) SUPER_BLOCK * BLOCK_SIZE, &sb);
+    bitmap_free(root / BLOCK_SIZE);
+    snap_finish();
+    return 0;
+}
+
+/*
+ * Drop the snapshot of an image that isn't mounted yet, before fsck repairs
+ * it: only the remapped blocks are copied home, fsck frees the rest.
+ */
+static void snap_discard(void)
+{
+    cs1550_disk_block block;
+    int i;
+
+    LOG_WARN("dropping the snapshot of %s to repair it", disk_path);
+    for (i = 0; i < (int) (snap.nremap * REMAP_ENTRIES); i++) {
+        struct cs1550_remap_entry *e = snap_remap_entry(i);
+        if (e->nFrom != 0) {
+            disk_read(&block, sizeof(block), e->nTo);
+            disk_write(&block, sizeof(block), e->nFrom);
+        }
+    }
+    disk_sync();
+    sb.nSnapRoot = 0;
+    sb.nSnapMap = 0;
+    sb.nSnapRemap = 0;
+    disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+    disk_sync();
+    snap_free();
+}
+
+/*
+ * Is path under /.snapshot? Returns 1 and sets *rest to the path within the
+ * snapshot ("/" for /.snapshot itself), 0 if it isn't, or -ENOENT if there
+ * is no snapshot or the path names /.stats in it. The handlers call
+ * themselves again with *rest and snap.view set.
+ */
+static int snap_path(const char *path, const char **rest)
+{
+    size_t n = strlen(SNAP_PATH);
+
+    if (snap.view || strncmp(path, SNAP_PATH, n) != 0 || (path[n] != '\0' && path[n] != '/')) {
+        return 0;
+    }
+    if (snap.root == 0) {
+        return -ENOENT;
+    }
+    *rest = path[n] == '\0' ? "/" : path + n;
+    return strcmp(*rest, STATS_PATH) == 0 ? -ENOENT : 1;
+}
+
+//mark every block the snapshot uses seen, for fsck
+static void snap_fsck_seen(char *seen)
+{
+    long b;
+    int i;
+
+    if (snap.map == NULL) {
+        return;
+    }
+    for (b = sb.nDataStart; b < sb.nDataEnd; b++) {
+        if (*snap_state(b) != 0) {
+            seen[b] = 1;
+        }
+    }
+    for (i = 0; i < (int) (snap.nremap * REMAP_ENTRIES); i++) {
+        if (snap_remap_entry(i)->nFrom != 0) {
+            seen[snap_remap_entry(i)->nTo / BLOCK_SIZE] = 1;
+        }
+    }
+    for (i = 0; i < snap.nmap; i++) {
+        seen[snap.map_pos[i] / BLOCK_SIZE] = 1;
+    }
+    for (i = 0; i < snap.nremap; i++) {
+        seen[snap.remap_pos[i] / BLOCK_SIZE] = 1;
+    }
+    if (snap.root != 0) {
+        seen[snap.root / BLOCK_SIZE] = 1;
+    }
+}
+
+// ============================================================================
+// =================================== fsck ===================================
+// ============================================================================
+/*
+ * Consistency check of the mounted image (sb must be loaded). One sequential
+ * pass over the data area collects the nNextBlock of every block, then the
+ * root, every directory and every file chain are walked in memory, so the
+ * whole check is linear in the size of the image.
+ *
+ * It finds entries pointing outside the data area, blocks reachable twice
+ * (cross-linked chains or cycles), files whose fsize is longer than their
+ * chain, blocks marked used but unreachable (leaked), reachable blocks
+ * marked free, shared chunks whose ref count is wrong and blocks in use
+ * that don't match their checksum. With FSCK_REPAIR bad entries are
+ * dropped, bad chains are cut at the last good block, sizes and ref counts
+ * are fixed and the bitmap is rebuilt from what is reachable. What can't be
+ * fixed is kept: blocks that don't match their checksum get a new one.
+ */
+#define FSCK_REPAIR  1      //fix what is found
+#define FSCK_UPGRADE 2      //image has no superblock yet: make room for one
+
+struct cs1550_fsck_report
+{
+    long dirs;              //directories found
+    long files;             //files found
+    long blocks_used;       //blocks reachable from the root, reserved ones included
+    long bad_entries;       //directory or file entries with impossible contents
+    long bad_pointers;      //nNextBlock pointing outside the data area
+    long cross_linked;      //blocks reached a second time
+    long bad_sizes;         //fsize longer than what the chain can hold
+    long leaked;            //marked used in the bitmap, but unreachable
+    long missing;           //reachable, but marked free in the bitmap
+    long bad_refcounts;     //chunk table entries not counting the refs to them
+    long bad_checksums;     //blocks in use that don't match their checksum
+};
+
+//blocks read per request during the sequential scan
+#define FSCK_SCAN_BLOCKS 256
+
+//problems in r that make the image unsafe to use as it is
+static long fsck_problems(const struct cs1550_fsck_report *r)
+{
+    return r->bad_entries + r->bad_pointers + r->cross_linked + r->bad_sizes
+        + r->leaked + r->missing + r->bad_refcounts + r->bad_checksums;
+}
+
+#ifdef CS1550_NO_MAIN
+CS1550_API void fsck_print(FILE *out, const struct cs1550_fsck_report *r)
+{
+    fprintf(out, "%ld directories, %ld files, %ld of %ld blocks used\n",
+            r->dirs, r->files, r->blocks_used, sb.nBlocks);
+    if (r->bad_entries)  fprintf(out, "%ld bad directory entries\n", r->bad_entries);
+    if (r->bad_pointers) fprintf(out, "%ld block pointers out of range\n", r->bad_pointers);
+    if (r->cross_linked) fprintf(out, "%ld cross-linked blocks\n", r->cross_linked);
+    if (r->bad_sizes)    fprintf(out, "%ld files longer than their blocks\n", r->bad_sizes);
+    if (r->leaked)       fprintf(out, "%ld leaked blocks\n", r->leaked);
+    if (r->missing)      fprintf(out, "%ld used blocks marked free\n", r->missing);
+    if (r->bad_refcounts) fprintf(out, "%ld shared chunks with wrong ref counts\n", r->bad_refcounts);
+    if (r->bad_checksums) fprintf(out, "%ld blocks don't match their checksum\n", r->bad_checksums);
+}
+#endif
+
+//cut the chain after block b
+static void fsck_cut_chain(long *next, long b)
+{
+    cs1550_disk_block block;
+    disk_read(&block, sizeof(block), b * BLOCK_SIZE);
+    block.nNextBlock = 0;
+    disk_write(&block, sizeof(block), b * BLOCK_SIZE);
+    next[b] = 0;
+}
+
+/*
+ * Walk the name area starting at *head, marking its blocks seen, and read it
+ * into names, which holds NAMES_MAX_BLOCKS blocks of data. A bad link ends
+ * the area: it is cut there when repairing, or if the first block is bad
+ * *head is cleared and *dirty set. Returns how many bytes were read.
+ */
+static size_t fsck_names(long *head, long *next, char *seen, char *names, int repair,
+                         struct cs1550_fsck_report *r, int *dirty)
+{
+    cs1550_disk_block block;
+    long pos = *head;
+    long prev = -1;
+    int n = 0;
+
+    while (pos != 0) {
+        if (!valid_block_pos(pos) || n == (int) NAMES_MAX_BLOCKS) {
+            r->bad_pointers++;
+        } else if (seen[pos / BLOCK_SIZE]) {
+            r->cross_linked++;
+        } else {
+            seen[pos / BLOCK_SIZE] = 1;
+            disk_read(&block, sizeof(block), snap_pos(pos));
+            memcpy(names + n * MAX_DATA_IN_BLOCK, block.data, MAX_DATA_IN_BLOCK);
+            n++;
+            prev = pos / BLOCK_SIZE;
+            pos = next[prev];
+            continue;
+        }
+        if (prev == -1) {
+            *head = 0;
+            *dirty = 1;
+        } else if (repair) {
+            fsck_cut_chain(next, prev);
+        }
+        break;
+    }
+    return (size_t) n * MAX_DATA_IN_BLOCK;
+}
+
+//does e name something in names, a name area of size bytes read by fsck_names()?
+static int fsck_name_ok(const struct cs1550_name *e, const char *names, size_t size)
+{
+    return e->nLength != 0 && (size_t) e->nOffset + e->nLength <= size
+        && memchr(names + e->nOffset, '\0', e->nLength) == NULL
+        && memchr(names + e->nOffset, '/', e->nLength) == NULL
+        && name_hash(names + e->nOffset, e->nLength) == e->nHash;
+}
+
+//the chunk table as fsck sees it
+struct fsck_chunk_table
+{
+    cs1550_disk_block *blocks;  //its blocks
+    long *pos;                  //where they are
+    long nblocks;
+    int *by_block;              //entry number + 1 of the chunk starting at each block
+    unsigned int *refs;         //refs found to each entry
+    char *state;                //each entry's chunk: 0 = not checked yet, 1 = good, 2 = bad
+    int dirty;                  //an entry was changed
+};
+
+static struct cs1550_chunk_entry *fsck_chunk_entry(struct fsck_chunk_table *t, int i)
+{
+    return &((struct cs1550_chunk_entry *) t->blocks[i / CHUNK_ENTRIES].data)[i % CHUNK_ENTRIES];
+}
+
+//is nLength of a chunk possible?
+static int fsck_chunk_length_ok(unsigned int length)
+{
+    unsigned int len = length & ~CHUNK_RAW;
+    return len != 0 && len <= CHUNK_SIZE;
+}
+
+//walk the chain of a chunk of length bytes from pos, marking its blocks
+//seen. If it is bad they are unmarked again and -1 is returned.
+static int fsck_chunk_chain(long pos, unsigned int length, long *next, char *seen,
+                            struct cs1550_fsck_report *r)
+{
+    long blocks[CHUNK_MAX_BLOCKS];
+    int n;
+
+    for (n = 0; pos != 0; n++) {
+        if (!valid_block_pos(pos) || n == (int) CHUNK_MAX_BLOCKS) {
+            r->bad_pointers++;
+        } else if (seen[pos / BLOCK_SIZE]) {
+            r->cross_linked++;
+        } else {
+            blocks[n] = pos / BLOCK_SIZE;
+            seen[blocks[n]] = 1;
+            pos = next[blocks[n]];
+            continue;
+        }
+        break;
+    }
+    if (pos == 0 && (size_t) n * MAX_DATA_IN_BLOCK < (length & ~CHUNK_RAW)) {
+        r->bad_sizes++;
+        pos = -1;
+    }
+    if (pos != 0) {
+        while (n-- > 0) {
+            seen[blocks[n]] = 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the chunk table into t, marking its blocks seen and dropping entries
+ * that can't be right. A bad link ends the table: it is cut there when
+ * repairing.
+ */
+static void fsck_chunk_table(struct fsck_chunk_table *t, long *next, char *seen, int repair,
+                             struct cs1550_fsck_report *r)
+{
+    long pos = sb.nChunkTable;
+    long prev = -1;
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    t->by_block = calloc(sb.nBlocks, sizeof(int));
+    while (pos != 0) {
+        if (!valid_block_pos(pos)) {
+            r->bad_pointers++;
+        } else if (seen[pos / BLOCK_SIZE]) {
+            r->cross_linked++;
+        } else {
+            seen[pos / BLOCK_SIZE] = 1;
+            t->blocks = realloc(t->blocks, (t->nblocks + 1) * sizeof(cs1550_disk_block));
+            t->pos = realloc(t->pos, (t->nblocks + 1) * sizeof(long));
+            disk_read(&t->blocks[t->nblocks], sizeof(cs1550_disk_block), snap_pos(pos));
+            t->pos[t->nblocks++] = pos;
+            prev = pos / BLOCK_SIZE;
+            pos = next[prev];
+            continue;
+        }
+        if (prev == -1) {
+            sb.nChunkTable = 0;
+            if (repair) {
+                disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+            }
+        } else {
+            if (repair) {
+                fsck_cut_chain(next, prev);
+            }
+            t->blocks[t->nblocks - 1].nNextBlock = 0;
+        }
+        break;
+    }
+
+    int n = t->nblocks * CHUNK_ENTRIES;
+    t->refs = calloc(n + 1, sizeof(unsigned int));
+    t->state = calloc(n + 1, 1);
+    for (i = 0; i < n; i++) {
+        struct cs1550_chunk_entry *e = fsck_chunk_entry(t, i);
+        if (e->nStart == 0) {
+            continue;
+        }
+        if (!valid_block_pos(e->nStart) || !fsck_chunk_length_ok(e->nLength)
+            || t->by_block[e->nStart / BLOCK_SIZE] != 0) {
+            LOG_INFO("dropping chunk table entry %d", i);
+            r->bad_entries++;
+            memset(e, 0, sizeof(*e));
+            t->dirty = 1;
+            continue;
+        }
+        t->by_block[e->nStart / BLOCK_SIZE] = i + 1;
+    }
+}
+
+//check the refs counted against the entries of t and write it back
+static void fsck_chunk_table_done(struct fsck_chunk_table *t, int repair,
+                                  struct cs1550_fsck_report *r)
+{
+    int n = t->nblocks * CHUNK_ENTRIES;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct cs1550_chunk_entry *e = fsck_chunk_entry(t, i);
+        if (e->nStart == 0 || t->refs[i] == e->nRefs) {
+            continue;
+        }
+        //with no refs left its blocks show up as leaked
+        r->bad_refcounts++;
+        if (t->refs[i] == 0) {
+            memset(e, 0, sizeof(*e));
+        } else {
+            e->nRefs = t->refs[i];
+        }
+        t->dirty = 1;
+    }
+    if (repair && t->dirty) {
+        for (i = 0; i < t->nblocks; i++) {
+            disk_write(&t->blocks[i], sizeof(cs1550_disk_block), t->pos[i]);
+        }
+    }
+    free(t->blocks);
+    free(t->pos);
+    free(t->by_block);
+    free(t->refs);
+    free(t->state);
+}
+
+/*
+ * Check the chunk refs in index block b of a chunked file, marking the
+ * chunks' blocks seen. Refs of a deduplicated file (t is not NULL) are
+ * counted against the chunk table, and a chunk's blocks are only walked
+ * the first time. A ref that is bad or to a bad chunk is cleared when
+ * repairing. Returns how many refs from the start of the block are in use.
+ */
+static int fsck_chunks(long b, long *next, char *seen, int repair, struct fsck_chunk_table *t,
+                       struct cs1550_fsck_report *r)
+{
+    cs1550_disk_block index;
+    struct cs1550_chunk_ref *refs = (struct cs1550_chunk_ref *) index.data;
+    int used = 0, in_use = 1, dirty = 0;
+    unsigned int i;
+
+    disk_read(&index, sizeof(index), snap_pos(b * BLOCK_SIZE));
+    for (i = 0; i < CHUNK_REFS; i++) {
+        struct cs1550_chunk_ref *ref = &refs[i];
+        if (ref->nStart == 0 && ref->nLength == 0) {
+            in_use = 0;
+            continue;
+        }
+
+        int bad = 0;
+        if (!fsck_chunk_length_ok(ref->nLength)) {
+            r->bad_entries++;
+            bad = 1;
+        } else if (t == NULL) {
+            bad = fsck_chunk_chain(ref->nStart, ref->nLength, next, seen, r) != 0;
+        } else {
+            int e = valid_block_pos(ref->nStart) ? t->by_block[ref->nStart / BLOCK_SIZE] - 1 : -1;
+            if (e == -1 || fsck_chunk_entry(t, e)->nLength != ref->nLength) {
+                r->bad_entries++;
+                bad = 1;
+            } else {
+                if (t->state[e] == 0) {
+                    t->state[e] = fsck_chunk_chain(ref->nStart, ref->nLength, next, seen, r) == 0 ? 1 : 2;
+                }
+                bad = t->state[e] == 2;
+                if (!bad) {
+                    t->refs[e]++;
+                }
+            }
+        }
+        if (bad) {
+            LOG_INFO("dropping chunk ref %u of block %ld", i, b);
+            memset(ref, 0, sizeof(*ref));
+            dirty = 1;
+            in_use = 0;
+        } else if (in_use) {
+            used++;
+        }
+    }
+    if (repair && dirty) {
+        disk_write(&index, sizeof(index), b * BLOCK_SIZE);
+    }
+    return used;
+}
+
+static int fsck_run(int flags, struct cs1550_fsck_report *r)
+{
+    long *next = calloc(sb.nBlocks, sizeof(long));
+    char *seen = calloc(sb.nBlocks, 1);
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+    cs1550_disk_block *chunk = malloc(FSCK_SCAN_BLOCKS * sizeof(cs1550_disk_block));
+    char *root_names = malloc(NAMES_MAX_BLOCKS * MAX_DATA_IN_BLOCK);
+    char *names = malloc(NAMES_MAX_BLOCKS * MAX_DATA_IN_BLOCK);
+    struct fsck_chunk_table table;
+    size_t root_size, size;
+    int repair = flags & FSCK_REPAIR;
+    long b, i;
+    int d, f;
+
+    //where SUPER_BLOCK is referenced from, when upgrading
+    enum { REF_NONE, REF_DIR, REF_FILE, REF_CHAIN } super_ref = REF_NONE;
+    int super_dir = 0, super_file = 0;
+    long super_prev = 0;
+
+    memset(r, 0, sizeof(*r));
+
+    //one sequential pass collecting the link out of every data block, and
+    //which blocks don't match their checksum
+    char *bad_sum = calloc(sb.nBlocks, 1);
+    for (b = 0; b < sb.nBlocks; b += FSCK_SCAN_BLOCKS) {
+        long n = sb.nBlocks - b < FSCK_SCAN_BLOCKS ? sb.nBlocks - b : FSCK_SCAN_BLOCKS;
+        if (b + n <= sb.nDataStart || (b >= sb.nDataEnd && sums.sums == NULL)) {
+            continue;
+        }
+        disk_read(chunk, n * sizeof(cs1550_disk_block), b * BLOCK_SIZE);
+        for (i = 0; i < n; i++) {
+            if (b + i >= sb.nDataStart && b + i < sb.nDataEnd) {
+                next[b + i] = chunk[i].nNextBlock;
+            }
+            if (sums.sums != NULL && sum_covers(&sb, b + i)
+                && crc32c(&chunk[i], BLOCK_SIZE) != sums.sums[b + i]) {
+                bad_sum[b + i] = 1;
+            }
+        }
+    }
+    if (sums.sums != NULL) {
+        disk_read(chunk, BLOCK_SIZE, 0);
+        bad_sum[0] = crc32c(chunk, BLOCK_SIZE) != sums.sums[0];
+    }
+    free(chunk);
+
+    //the image links to the blocks the snapshot holds, but goes on from
+    //its own copies of them
+    for (i = 0; i < (long) (snap.nremap * REMAP_ENTRIES); i++) {
+        struct cs1550_remap_entry *e = snap_remap_entry(i);
+        if (e->nFrom != 0) {
+            next[e->nFrom / BLOCK_SIZE] = next[e->nTo / BLOCK_SIZE];
+        }
+    }
+
+    for (b = 0; b < sb.nBlocks; b++) {
+        if (b < sb.nDataStart || b >= sb.nDataEnd) {
+            seen[b] = 1;
+        }
+    }
+
+    disk_read(&root, sizeof(root), 0);
+    int root_dirty = 0;
+    if (root.nDirectories < 0 || root.nDirectories > (int) MAX_DIRS_IN_ROOT) {
+        r->bad_entries++;
+        root.nDirectories = root.nDirectories < 0 ? 0 : MAX_DIRS_IN_ROOT;
+        root_dirty = 1;
+    }
+    root_size = fsck_names(&root.nNames, next, seen, root_names, repair, r, &root_dirty);
+    fsck_chunk_table(&table, next, seen, repair, r);
+
+    for (d = 0; d < root.nDirectories; d++) {
+        struct cs1550_directory *de = &root.directories[d];
+        long dir_block = de->nStartBlock / BLOCK_SIZE;
+        int upgrade_ref = (flags & FSCK_UPGRADE) && de->nStartBlock == (long) SUPER_BLOCK * BLOCK_SIZE;
+
+        if (!fsck_name_ok(&de->name, root_names, root_size)
+            || (!valid_block_pos(de->nStartBlock) && !upgrade_ref) || seen[dir_block]) {
+            //drop the entry, the blocks under it show up as leaked
+            LOG_INFO("dropping directory entry %d", d);
+            r->bad_entries++;
+            memmove(de, de + 1, (root.nDirectories - d - 1) * sizeof(*de));
+            root.nDirectories--;
+            root_dirty = 1;
+            d--;
+            continue;
+        }
+        if (upgrade_ref) {
+            super_ref = REF_DIR;
+            super_dir = d;
+        }
+        seen[dir_block] = 1;
+        r->dirs++;
+
+        disk_read(&dir, sizeof(dir), snap_pos(de->nStartBlock));
+        int dir_dirty = 0;
+        if (dir.nFiles < 0 || dir.nFiles > (int) MAX_FILES_IN_DIR) {
+            r->bad_entries++;
+            dir.nFiles = dir.nFiles < 0 ? 0 : MAX_FILES_IN_DIR;
+            dir_dirty = 1;
+        }
+        size = fsck_names(&dir.nNames, next, seen, names, repair, r, &dir_dirty);
+
+        for (f = 0; f < dir.nFiles; f++) {
+            struct cs1550_file_directory *fe = &dir.files[f];
+            long start_pos = fe->nStartBlock & ~FILE_FLAGS;
+            long start = start_pos / BLOCK_SIZE;
+            int file_flags = fe->nStartBlock & FILE_FLAGS;
+            upgrade_ref = (flags & FSCK_UPGRADE) && fe->nStartBlock == (long) SUPER_BLOCK * BLOCK_SIZE;
+
+            int is_inline = (file_flags & FILE_INLINE) != 0;
+
+            if (!fsck_name_ok(&fe->name, names, size)
+                || (file_flags & ~(FILE_CHUNKED | FILE_INLINE)) != 0
+                || (is_inline && start_pos != 0)
+                || (!is_inline && ((!valid_block_pos(start_pos) && !upgrade_ref) || seen[start]))) {
+                LOG_INFO("dropping file entry %d of directory %d", f, d);
+                r->bad_entries++;
+                memmove(fe, fe + 1, (dir.nFiles - f - 1) * sizeof(*fe));
+                dir.nFiles--;
+                dir_dirty = 1;
+                f--;
+                continue;
+            }
+            if (upgrade_ref) {
+                super_ref = REF_FILE;
+                super_dir = d;
+                super_file = f;
+            }
+            r->files++;
+
+            //an inline file's data has to be in the name area
+            if (is_inline) {
+                size_t room = size - fe->name.nOffset - fe->name.nLength;
+                size_t max_size = room < INLINE_MAX ? room : INLINE_MAX;
+                if (fe->fsize > max_size) {
+                    r->bad_sizes++;
+                    fe->fsize = max_size;
+                    dir_dirty = 1;
+                }
+                continue;
+            }
+
+            //walk the chain, and the chunks of each index block of a
+            //chunked file
+            long nblocks = 0;
+            long nchunks = 0;
+            int chunks_end = 0;
+            b = start;
+            for (;;) {
+                seen[b] = 1;
+                nblocks++;
+                if (file_flags & FILE_CHUNKED) {
+                    int used = fsck_chunks(b, next, seen, repair,
+                                           (file_flags & FILE_DEDUP) ? &table : NULL, r);
+                    if (!chunks_end) {
+                        nchunks += used;
+                    }
+                    chunks_end |= used < (int) CHUNK_REFS;
+                }
+                long pos = next[b];
+                if (pos == 0) {
+                    break;
+                }
+                if ((flags & FSCK_UPGRADE) && pos == (long) SUPER_BLOCK * BLOCK_SIZE
+                    && !seen[SUPER_BLOCK]) {
+                    super_ref = REF_CHAIN;
+                    super_prev = b;
+                } else if (!valid_block_pos(pos)) {
+                    r->bad_pointers++;
+                    if (repair) {
+                        fsck_cut_chain(next, b);
+                    }
+                    break;
+                } else if (seen[pos / BLOCK_SIZE]) {
+                    r->cross_linked++;
+                    if (repair) {
+                        fsck_cut_chain(next, b);
+                    }
+                    break;
+                }
+                b = pos / BLOCK_SIZE;
+            }
+
+            size_t max_size = (file_flags & FILE_CHUNKED) ? (size_t) nchunks * CHUNK_SIZE
+                                         : (size_t) nblocks * MAX_DATA_IN_BLOCK;
+            if (fe->fsize > max_size) {
+                r->bad_sizes++;
+                fe->fsize = max_size;
+                dir_dirty = 1;
+            }
+        }
+
+        if (repair && dir_dirty) {
+            disk_write(&dir, sizeof(dir), de->nStartBlock);
+        }
+    }
+    fsck_chunk_table_done(&table, repair, r);
+    if (repair && root_dirty) {
+        disk_write(&root, sizeof(root), 0);
+    }
+
+    //move whatever uses block 1 out of the way of the superblock
+    if ((flags & FSCK_UPGRADE) && super_ref != REF_NONE) {
+        cs1550_disk_block block;
+        long to = -1;
+        for (b = SUPER_BLOCK + 1; b < sb.nDataEnd; b++) {
+            if (!seen[b]) {
+                to = b;
+                break;
+            }
+        }
+        if (to == -1) {
+            free(next);
+            free(seen);
+            free(root_names);
+            free(names);
+            free(bad_sum);
+            return -ENOSPC;
+        }
+        LOG_INFO("moving block %d to block %ld to make room for the superblock", SUPER_BLOCK, to);
+        disk_read(&block, sizeof(block), (long) SUPER_BLOCK * BLOCK_SIZE);
+        disk_write(&block, sizeof(block), to * BLOCK_SIZE);
+        seen[to] = 1;
+
+        if (super_ref == REF_DIR) {
+            root.directories[super_dir].nStartBlock = to * BLOCK_SIZE;
+            disk_write(&root, sizeof(root), 0);
+        } else if (super_ref == REF_FILE) {
+            long dir_pos = root.directories[super_dir].nStartBlock;
+            disk_read(&dir, sizeof(dir), dir_pos);
+            dir.files[super_file].nStartBlock = to * BLOCK_SIZE;
+            disk_write(&dir, sizeof(dir), dir_pos);
+        } else {
+            disk_read(&block, sizeof(block), super_prev * BLOCK_SIZE);
+            block.nNextBlock = to * BLOCK_SIZE;
+            disk_write(&block, sizeof(block), super_prev * BLOCK_SIZE);
+        }
+    }
+
+    //compare what is reachable, and what the snapshot holds, with the bitmap
+    snap_fsck_seen(seen);
+    char *map = bitmap_load();
+    for (b = 0; b < sb.nBlocks; b++) {
+        if (seen[b]) {
+            r->blocks_used++;
+        }
+        if (bad_sum[b] && seen[b]) {
+            LOG_INFO("block %ld doesn't match its checksum", b);
+            r->bad_checksums++;
+        }
+        if (b < sb.nDataStart || b >= sb.nDataEnd) {
+            //images without a superblock never marked these
+            if (!map[b] && !(flags & FSCK_UPGRADE)) {
+                r->missing++;
+            }
+        } else if (map[b] && !seen[b]) {
+            r->leaked++;
+        } else if (!map[b] && seen[b]) {
+            r->missing++;
+        }
+    }
+    if (repair) {
+        for (b = 0; b < sb.nBlocks; b++) {
+            map[b] = seen[b];
+        }
+        bitmap_store(map);
+        if (r->bad_checksums != 0) {
+            sums_rebuild();
+            sums_flush();
+        }
+    }
+
+    free(map);
+    free(bad_sum);
+    free(next);
+    free(seen);
+    free(root_names);
+    free(names);
+    return 0;
+}
+
+// ============================================================================
+// ================================ chunk table ===============================
+// ============================================================================
+/*
+ * The chunk table of deduplicated files (see cs1550_chunk_entry) is kept in
+ * memory while mounted, block by block as it is on disk so a changed entry
+ * is written back with its block. Entries are found by the hash of the
+ * chunk's contents and by the block the chunk starts at.
+ */
+static struct
+{
+    cs1550_disk_block *blocks;  //the table
+    long *pos;                  //where each of its blocks is
+    long nblocks;
+    int *buckets;               //entry number + 1 of the first entry in each hash bucket
+    int *next;                  //entry number + 1 of the next entry in the same bucket
+    int nbuckets;               //a power of 2
+    int *by_block;              //entry number + 1 of the chunk starting at each block
+} chunk_table;
+
+static struct cs1550_chunk_entry *chunk_entry(int i)
+{
+    return &((struct cs1550_chunk_entry *) chunk_table.blocks[i / CHUNK_ENTRIES].data)[i % CHUNK_ENTRIES];
+}
+
+//hash of the len bytes at data, 8 at a time
+static unsigned long chunk_hash(const unsigned char *data, int len)
+{
+    unsigned long hash = 0xcbf29ce484222325UL ^ (unsigned long) len;
+    unsigned long word;
+    int i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15UL;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3UL;
+    }
+    return hash;
+}
+
+static void chunk_table_link(int i)
+{
+    struct cs1550_chunk_entry *e = chunk_entry(i);
+    int b = e->nHash & (chunk_table.nbuckets - 1);
+    chunk_table.next[i] = chunk_table.buckets[b];
+    chunk_table.buckets[b] = i + 1;
+    chunk_table.by_block[e->nStart / BLOCK_SIZE] = i + 1;
+}
+
+static void chunk_table_unlink(int i)
+{
+    struct cs1550_chunk_entry *e = chunk_entry(i);
+    int *p = &chunk_table.buckets[e->nHash & (chunk_table.nbuckets - 1)];
+    while (*p != 0 && *p != i + 1) {
+        p = &chunk_table.next[*p - 1];
+    }
+    if (*p != 0) {
+        *p = chunk_table.next[i];
+    }
+    chunk_table.by_block[e->nStart / BLOCK_SIZE] = 0;
+}
+
+//size the hash buckets for every entry the table can hold and fill them
+static void chunk_table_index(void)
+{
+    int n = chunk_table.nblocks * CHUNK_ENTRIES;
+    int i;
+
+    chunk_table.nbuckets = 64;
+    while (chunk_table.nbuckets < n) {
+        chunk_table.nbuckets *= 2;
+    }
+    free(chunk_table.buckets);
+    chunk_table.buckets = calloc(chunk_table.nbuckets, sizeof(int));
+    chunk_table.next = realloc(chunk_table.next, (n + 1) * sizeof(int));
+    memset(chunk_table.by_block, 0, sb.nBlocks * sizeof(int));
+    for (i = 0; i < n; i++) {
+        if (chunk_entry(i)->nStart != 0) {
+            chunk_table_link(i);
+        }
+    }
+}
+
+//read the chunk table of the mounted image into memory. fsck has made sure
+//it is sound, unless it was turned off: entries pointing nowhere are ignored.
+static void chunk_table_load(void)
+{
+    long pos = sb.nChunkTable;
+    int i;
+
+    memset(&chunk_table, 0, sizeof(chunk_table));
+    chunk_table.by_block = calloc(sb.nBlocks, sizeof(int));
+    while (pos != 0 && valid_block_pos(pos) && chunk_table.nblocks < sb.nBlocks) {
+        long n = chunk_table.nblocks++;
+        chunk_table.blocks = realloc(chunk_table.blocks, chunk_table.nblocks * sizeof(cs1550_disk_block));
+        chunk_table.pos = realloc(chunk_table.pos, chunk_table.nblocks * sizeof(long));
+        block_read(pos, &chunk_table.blocks[n]);
+        chunk_table.pos[n] = pos;
+        pos = chunk_table.blocks[n].nNextBlock;
+    }
+    for (i = 0; i < (int) (chunk_table.nblocks * CHUNK_ENTRIES); i++) {
+        struct cs1550_chunk_entry *e = chunk_entry(i);
+        if (e->nStart != 0 && !valid_block_pos(e->nStart)) {
+            LOG_ERROR("chunk table entry %d points to block %ld", i, e->nStart / BLOCK_SIZE);
+            memset(e, 0, sizeof(*e));
+        }
+    }
+    chunk_table_index();
+}
+
+static void chunk_table_free(void)
+{
+    free(chunk_table.blocks);
+    free(chunk_table.pos);
+    free(chunk_table.buckets);
+    free(chunk_table.next);
+    free(chunk_table.by_block);
+    memset(&chunk_table, 0, sizeof(chunk_table));
+}
+
+//write the table block holding entry i
+static void chunk_table_store(int i)
+{
+    meta_write(chunk_table.pos[i / CHUNK_ENTRIES], &chunk_table.blocks[i / CHUNK_ENTRIES]);
+}
+
+//a free entry, adding a block to the table if it is full. -1 if the image is.
+static int chunk_table_new(void)
+{
+    int n = chunk_table.nblocks * CHUNK_ENTRIES;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (chunk_entry(i)->nStart == 0) {
+            return i;
+        }
+    }
+    long b = bitmap_alloc(0);
+    if (b == -1) {
+        return -1;
+    }
+    long last = chunk_table.nblocks++;
+    chunk_table.blocks = realloc(chunk_table.blocks, chunk_table.nblocks * sizeof(cs1550_disk_block));
+    chunk_table.pos = realloc(chunk_table.pos, chunk_table.nblocks * sizeof(long));
+    memset(&chunk_table.blocks[last], 0, sizeof(cs1550_disk_block));
+    chunk_table.pos[last] = b * BLOCK_SIZE;
+    meta_write(chunk_table.pos[last], &chunk_table.blocks[last]);
+    if (last == 0) {
+        sb.nChunkTable = b * BLOCK_SIZE;
+        meta_write((long) SUPER_BLOCK * BLOCK_SIZE, &sb);
+    } else {
+        chunk_table.blocks[last - 1].nNextBlock = b * BLOCK_SIZE;
+        meta_write(chunk_table.pos[last - 1], &chunk_table.blocks[last - 1]);
+    }
+    chunk_table_index();
+    return n;
+}
+
+// ============================================================================
+// ================================== mount ===================================
+// ============================================================================
+#define FSCK_OFF   0        //trust the image
+#define FSCK_CHECK 1        //check it, refuse to mount it if it is damaged
+#define FSCK_FIX   2        //check it and repair what is found
+
+/*
+ * Images before version 3 kept 8.3 names in the entries themselves, in the
+ * layout below. They are converted when mounted, before fsck looks at them:
+ * the root and every directory block are rewritten in the current layout
+ * with a name area of one block each, which any 8.3 names fit in. Those
+ * blocks must be free in the bitmap and unreachable from the root, so a
+ * damaged bitmap can't get them to overwrite anything. Like the superblock
+ * upgrade this isn't crash safe, it runs once, before anything else.
+ */
+#define MAX_FILENAME_83 8
+#define MAX_EXTENSION_83 3
+#define MAX_FILES_IN_DIR_83 ((BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME_83 + 1) + (MAX_EXTENSION_83 + 1) + sizeof(size_t) + sizeof(long)))
+#define MAX_DIRS_IN_ROOT_83 ((BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME_83 + 1) + sizeof(long)))
+
+struct cs1550_directory_entry_83
+{
+    int nFiles;
+    struct
+    {
+        char fname[MAX_FILENAME_83 + 1];
+        char fext[MAX_EXTENSION_83 + 1];
+        size_t fsize;
+        long nStartBlock;
+    } __attribute__((packed)) files[MAX_FILES_IN_DIR_83];
+};
+
+struct cs1550_root_directory_83
+{
+    int nDirectories;
+    struct
+    {
+        char dname[MAX_FILENAME_83 + 1];
+        long nStartBlock;
+    } __attribute__((packed)) directories[MAX_DIRS_IN_ROOT_83];
+};
+
+//append the 8.3 name made of name and ext (if it isn't empty) to the name
+//area in block, filling in e. A name without its nul gets length 0, which
+//fsck drops.
+static void upgrade_name(struct cs1550_name *e, cs1550_disk_block *block, size_t *size,
+                         const char *name, size_t name_max, const char *ext, size_t ext_max)
+{
+    size_t n = strnlen(name, name_max);
+    size_t x = strnlen(ext, ext_max);
+    char *out = block->data + *size;
+
+    if (n == name_max || x == ext_max) {
+        n = x = 0;
+    }
+    memcpy(out, name, n);
+    if (x != 0) {
+        out[n++] = '.';
+        memcpy(out + n, ext, x);
+        n += x;
+    }
+    e->nHash = name_hash(out, n);
+    e->nOffset = *size;
+    e->nLength = n;
+    *size += n;
+}
+
+//first block that is free in map and not in used, which then is in both,
+//-1 if there is none
+static long upgrade_alloc(char *map, char *used)
+{
+    long b;
+    for (b = sb.nDataStart; b < sb.nDataEnd; b++) {
+        if (!map[b] && !used[b] && b != SUPER_BLOCK) {
+            map[b] = used[b] = 1;
+            return b;
+        }
+    }
+    return -1;
+}
+
+static int names_upgrade(void)
+{
+    struct cs1550_root_directory_83 old_root;
+    struct cs1550_directory_entry_83 old_dir;
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+    cs1550_disk_block names;
+    long name_block[MAX_DIRS_IN_ROOT_83];
+    long root_block = 0;
+    char *map = bitmap_load();
+    char *used = calloc(sb.nBlocks, 1);
+    int d, f, res = 0;
+    long b;
+
+    disk_read(&old_root, sizeof(old_root), 0);
+    if (old_root.nDirectories < 0 || old_root.nDirectories > (int) MAX_DIRS_IN_ROOT_83) {
+        old_root.nDirectories = old_root.nDirectories < 0 ? 0 : MAX_DIRS_IN_ROOT_83;
+    }
+
+    //mark what is reachable, and find a name block for every directory
+    //that has files. Directories that are listed twice are converted once.
+    for (d = 0; d < old_root.nDirectories; d++) {
+        long pos = old_root.directories[d].nStartBlock;
+        name_block[d] = -1;
+        if (!valid_block_pos(pos) || used[pos / BLOCK_SIZE]) {
+            continue;
+        }
+        used[pos / BLOCK_SIZE] = 1;
+        name_block[d] = 0;
+        disk_read(&old_dir, sizeof(old_dir), pos);
+        if (old_dir.nFiles < 0 || old_dir.nFiles > (int) MAX_FILES_IN_DIR_83) {
+            old_dir.nFiles = old_dir.nFiles < 0 ? 0 : MAX_FILES_IN_DIR_83;
+        }
+        for (f = 0; f < old_dir.nFiles; f++) {
+            b = old_dir.files[f].nStartBlock;
+            while (valid_block_pos(b) && !used[b / BLOCK_SIZE]) {
+                used[b / BLOCK_SIZE] = 1;
+                disk_read(&b, sizeof(b), b);
+            }
+        }
+    }
+    for (d = 0; d < old_root.nDirectories; d++) {
+        if (name_block[d] == 0) {
+            disk_read(&old_dir, sizeof(old_dir), old_root.directories[d].nStartBlock);
+            if (old_dir.nFiles != 0 && (name_block[d] = upgrade_alloc(map, used)) == -1) {
+                res = -ENOSPC;
+                goto out;
+            }
+        }
+    }
+    if (old_root.nDirectories != 0 && (root_block = upgrade_alloc(map, used)) == -1) {
+        res = -ENOSPC;
+        goto out;
+    }
+
+    //nothing has been written yet, now convert
+    for (d = 0; d < old_root.nDirectories; d++) {
+        long pos = old_root.directories[d].nStartBlock;
+        size_t size = 0;
+        if (name_block[d] == -1) {
+            continue;
+        }
+        disk_read(&old_dir, sizeof(old_dir), pos);
+        if (old_dir.nFiles < 0 || old_dir.nFiles > (int) MAX_FILES_IN_DIR_83) {
+            old_dir.nFiles = old_dir.nFiles < 0 ? 0 : MAX_FILES_IN_DIR_83;
+        }
+        memset(&dir, 0, sizeof(dir));
+        memset(&names, 0, sizeof(names));
+        dir.nFiles = old_dir.nFiles;
+        for (f = 0; f < old_dir.nFiles; f++) {
+            upgrade_name(&dir.files[f].name, &names, &size,
+                         old_dir.files[f].fname, sizeof(old_dir.files[f].fname),
+                         old_dir.files[f].fext, sizeof(old_dir.files[f].fext));
+            dir.files[f].fsize = old_dir.files[f].fsize;
+            dir.files[f].nStartBlock = old_dir.files[f].nStartBlock;
+        }
+        if (name_block[d] != 0) {
+            dir.nNames = name_block[d] * BLOCK_SIZE;
+            disk_write(&names, sizeof(names), dir.nNames);
+        }
+        disk_write(&dir, sizeof(dir), pos);
+    }
+
+    memset(&root, 0, sizeof(root));
+    memset(&names, 0, sizeof(names));
+    size_t size = 0;
+    root.nDirectories = old_root.nDirectories;
+    for (d = 0; d < old_root.nDirectories; d++) {
+        upgrade_name(&root.directories[d].name, &names, &size,
+                     old_root.directories[d].dname, sizeof(old_root.directories[d].dname), "", 1);
+        root.directories[d].nStartBlock = old_root.directories[d].nStartBlock;
+    }
+    if (root_block != 0) {
+        root.nNames = root_block * BLOCK_SIZE;
+        disk_write(&names, sizeof(names), root.nNames);
+    }
+    disk_write(&root, sizeof(root), 0);
+    bitmap_store(map);
+
+out:
+    free(map);
+    free(used);
+    return res;
+}
+
+/*
+ * statfs answers from the counts of free blocks, directories and files kept
+ * in the superblock, which bitmap_alloc(), bitmap_free() and the handlers
+ * that make and remove entries keep up to date. They are written with it
+ * on unmount. An image that wasn't unmounted cleanly, comes from before
+ * there were counts or was just repaired has them counted again at mount:
+ * the bitmap, which is in memory by then, and the root and its directories.
+ */
+static void counts_load(int trusted)
+{
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+    long b;
+    int d;
+
+    if (trusted) {
+        return;
+    }
+    sb.nFreeBlocks = 0;
+    for (b = sb.nDataStart; b < sb.nDataEnd; b++) {
+        sb.nFreeBlocks += bitmap[b] == BITMAP_FREE;
+    }
+    block_read(0, &root);
+    sb.nDirs = root.nDirectories;
+    sb.nFiles = 0;
+    for (d = 0; d < root.nDirectories; d++) {
+        block_read(root.directories[d].nStartBlock, &dir);
+        sb.nFiles += dir.nFiles;
+    }
+    LOG_INFO("%s: %ld free blocks, %ld directories, %ld files", disk_path,
+             sb.nFreeBlocks, sb.nDirs, sb.nFiles);
+}
+
+/*
+ * Open the image at disk_path, load its layout, replay its journal and check
+ * it according to fsck_mode. Images without a superblock get one here, and
+ * images with 8.3 names are converted, so everything after this can rely on
+ * sb and the current layout. Returns 0 with the image open, or
+ * -errno with it closed again.
+ */
+CS1550_API int cs1550_mount(int fsck_mode, struct cs1550_fsck_report *report)
+{
+    struct cs1550_fsck_report r;
+    int flags = 0;
+    int upgrade_names = 0;
+    int counted = 0;
+    int res = 0;
+
+    memset(&r, 0, sizeof(r));
+    disk_fd = open(disk_path, O_RDWR);
+    if (disk_fd == -1) {
+        res = -errno;
+        LOG_ERROR("can't open %s: %s", disk_path, strerror(errno));
+        return res;
+    }
+    long nblocks = lseek(disk_fd, 0, SEEK_END) / BLOCK_SIZE;
+
+    if (disk_read(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE) != 1) {
+        memset(&sb, 0, sizeof(sb));
+    }
+
+    upgrade_names = sb.nMagic != CS1550_MAGIC || sb.nVersion < 3;
+    counted = sb.nMagic == CS1550_MAGIC && sb.nVersion >= 9 && !sb.nMounted;
+    if (sb.nMagic != CS1550_MAGIC) {
+        //an image from before there was a superblock: its bitmap is the
+        //last nblocks bytes and everything from block 1 up could be data
+        if (nblocks < SUPER_BLOCK + 2 + BITMAP_BLOCKS(nblocks)) {
+            LOG_ERROR("%s is too small to hold a filesystem", disk_path);
+            res = -EINVAL;
+            goto fail;
+        }
+        LOG_WARN("%s has no superblock, upgrading it", disk_path);
+        layout_init(&sb, nblocks, 0, 0);
+        sb.nDataStart = SUPER_BLOCK;
+        flags = FSCK_REPAIR | FSCK_UPGRADE;
+    } else if (sb.nVersion < 1 || sb.nVersion > CS1550_VERSION || sb.nBlocks > nblocks
+               || sb.nBitmapBlock != sb.nBlocks - BITMAP_BLOCKS(sb.nBlocks)
+               || sb.nDataStart <= SUPER_BLOCK || sb.nDataEnd > sb.nBitmapBlock
+               || sb.nDataStart >= sb.nDataEnd
+               || (sb.nJournalBlocks != 0
+                   && (sb.nVersion < 2 || sb.nJournalStart != SUPER_BLOCK + 1
+                       || sb.nJournalBlocks < (long) JOURNAL_MIN_BLOCKS
+                       || sb.nDataStart != sb.nJournalStart + sb.nJournalBlocks))
+               || (sb.nSumBlocks != 0
+                   && (sb.nVersion < 6 || sb.nSumBlocks != (long) SUM_BLOCKS(sb.nBlocks)
+                       || sb.nSumStart + sb.nSumBlocks != sb.nBitmapBlock
+                       || sb.nDataEnd > sb.nSumStart))) {
+        LOG_ERROR("%s: unsupported or damaged superblock", disk_path);
+        res = -EINVAL;
+        goto fail;
+    } else if (fsck_mode == FSCK_FIX) {
+        flags = FSCK_REPAIR;
+    }
+
+    //the journal first, the rest of the image is only consistent after it
+    if ((res = journal_open()) != 0) {
+        goto fail;
+    }
+    sums_load();
+    if ((res = snap_load()) != 0) {
+        goto fail;
+    }
+
+    //then the names, and have fsck drop any that didn't survive that
+    if (upgrade_names) {
+        LOG_WARN("%s has 8.3 names, upgrading it to version %d", disk_path, CS1550_VERSION);
+        if ((res = names_upgrade()) != 0) {
+            LOG_ERROR("upgrading %s failed: %s", disk_path, strerror(-res));
+            goto fail;
+        }
+        disk_sync();
+        if (!(flags & FSCK_UPGRADE)) {
+            sb.nVersion = CS1550_VERSION;
+            disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+            disk_sync();
+        }
+        flags |= FSCK_REPAIR;
+    } else if (sb.nVersion < CS1550_VERSION) {
+        //later versions only add to version 3, there is nothing to convert
+        sb.nVersion = CS1550_VERSION;
+        disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+        disk_sync();
+    }
+
+    if (fsck_mode != FSCK_OFF || (flags & FSCK_UPGRADE) || upgrade_names) {
+        //nothing is repaired around a snapshot: check first, and drop it
+        //if there is anything to repair
+        if ((flags & FSCK_REPAIR) && snap.map != NULL) {
+            res = fsck_run(flags & ~FSCK_REPAIR, &r);
+            if (res == 0 && fsck_problems(&r) != 0) {
+                snap_discard();
+                res = fsck_run(flags, &r);
+            }
+        } else {
+            res = fsck_run(flags, &r);
+        }
+        if (res == 0 && (flags & FSCK_UPGRADE)) {
+            sb.nDataStart = SUPER_BLOCK + 1;
+            disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+            disk_sync();
+        }
+        if (res != 0) {
+            LOG_ERROR("checking %s failed: %s", disk_path, strerror(-res));
+            goto fail;
+        }
+        if (fsck_problems(&r) != 0) {
+            counted = 0;
+            if (flags & FSCK_REPAIR) {
+                LOG_WARN("%s: repaired %ld problems", disk_path, fsck_problems(&r));
+                disk_sync();
+            } else {
+                LOG_ERROR("%s is damaged, run cs1550_fsck -r on it or mount with -o fsck=repair",
+                          disk_path);
+                res = -EUCLEAN;
+            }
+        }
+    }
+    if (report != NULL) {
+        *report = r;
+    }
+    if (res != 0) {
+        goto fail;
+    }
+
+    bitmap = bitmap_load();
+    chunk_table_load();
+    wb_open();
+    counts_load(counted);
+    groups_load();
+    //a snapshot was being dropped when the image went down
+    if (snap.map != NULL && snap.root == 0) {
+        snap_finish();
+        if (journal.max != 0) {
+            journal_commit();
+        }
+    }
+    sb.nMounted = 1;
+    disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+    disk_sync();
+    return 0;
+
+fail:
+    journal_close();
+    sums_free();
+    snap_free();
+    close(disk_fd);
+    disk_fd = -1;
+    return res;
+}
+
+/*
+ * Write back the cache, commit whatever is still in the running batch and
+ * close the image. Called when the filesystem is unmounted.
+ */
+CS1550_API void cs1550_unmount(void)
+{
+    if (disk_fd == -1) {
+        return;
+    }
+    wb_flush();
+    journal_close();
+    wb_close();
+    snap_free();
+    sums_flush();
+    disk_sync();
+    sb.nMounted = 0;
+    disk_write(&sb, sizeof(sb), (long) SUPER_BLOCK * BLOCK_SIZE);
+    disk_sync();
+    sums_free();
+    close(disk_fd);
+    disk_fd = -1;
+    free(bitmap);
+    bitmap = NULL;
+    groups_free();
+    chunk_table_free();
+}
+
+
+// ============================================================================
+// =================================== paths ==================================
+// ============================================================================
+/*
+ * Every handler starts by splitting its path with path_parse(), which copies
+ * the parts into fixed buffers, checking their length, and hashes them on
+ * the way. Lookups only read the name of an entry whose length and hash
+ * match, and they try the lookup hint for the hash before scanning the
+ * directory: a hint remembers which slot a name was last found in and is
+ * always checked against the block itself, so one that went stale (after an
+ * unlink moved the entries, say) only costs the scan it would have saved.
+ */
+#define LOOKUP_HINTS 1024   //a power of 2
+
+struct lookup_hint
+{
+    long dir_pos;           //block the name was found in, 0 for the root
+    int slot;               //index of its entry there
+};
+
+static struct lookup_hint lookup_hints[LOOKUP_HINTS];
+
+/*
+ * Copy the part of a path starting at *s into out, which holds MAX_NAME + 1
+ * bytes, hashing it on the way. The part ends at a '/' or at the end of the
+ * path, and *s is left on the character that ended it. Returns its length,
+ * or -ENAMETOOLONG.
+ */
+static int path_take(const char **s, char *out, unsigned int *hash)
+{
+    const char *c = *s;
+    unsigned int h = NAME_HASH_INIT;
+    int n = 0;
+
+    while (*c != '\0' && *c != '/') {
+        if (n == MAX_NAME) {
+            return -ENAMETOOLONG;
+        }
+        h = (h ^ (unsigned char) *c) * NAME_HASH_PRIME;
+        out[n++] = *c++;
+    }
+    out[n] = '\0';
+    *s = c;
+    *hash = h;
+    return n;
+}
+
+/*
+ * Split path into /dir/name. Returns 0, -ENOENT for paths that can't exist
+ * here (more than two levels) or -ENAMETOOLONG.
+ */
+static int path_parse(const char *path, struct cs1550_path *p)
+{
+    const char *s = path;
+
+    p->depth = 0;
+    p->dir[0] = p->name[0] = '\0';
+    p->dir_len = p->name_len = 0;
+
+    if (*s++ != '/') {
+        return -ENOENT;
+    }
+    if (*s == '\0') {
+        return 0;
+    }
+
+    if ((p->dir_len = path_take(&s, p->dir, &p->dir_hash)) <= 0) {
+        return p->dir_len == 0 ? -ENOENT : p->dir_len;
+    }
+    p->depth = 1;
+    if (*s == '\0' || s[1] == '\0') {
+        return 0;
+    }
+
+    s++;
+    if ((p->name_len = path_take(&s, p->name, &p->name_hash)) < 0) {
+        return p->name_len;
+    }
+    if (*s == '/' && s[1] != '\0') {
+        return -ENOENT;
+    }
+    p->depth = 2;
+    return 0;
+}
+
+//copy len bytes from offset off of the name area starting at head into out
+static void names_read(long head, unsigned int off, char *out, size_t len)
+{
+    cs1550_disk_block block;
+    long pos = head;
+
+    //skip to the block holding off
+    while (off >= MAX_DATA_IN_BLOCK && pos != 0) {
+        block_read(pos, &block);
+        pos = block.nNextBlock;
+        off -= MAX_DATA_IN_BLOCK;
+    }
+    while (len > 0 && pos != 0) {
+        block_read(pos, &block);
+        size_t n = MAX_DATA_IN_BLOCK - off < len ? MAX_DATA_IN_BLOCK - off : len;
+        memcpy(out, block.data + off, n);
+        out += n;
+        len -= n;
+        off = 0;
+        pos = block.nNextBlock;
+    }
+    //a chain cut short by fsck
+    memset(out, 0, len);
+}
+
+//is e, an entry of the directory whose name area starts at head, named by
+//the len bytes at name with hash hash?
+static int name_equal(long head, const struct cs1550_name *e, const char *name, int len,
+                      unsigned int hash)
+{
+    char buf[MAX_NAME];
+
+    if (e->nHash != hash || e->nLength != len) {
+        return 0;
+    }
+    names_read(head, e->nOffset, buf, len);
+    return memcmp(buf, name, len) == 0;
+}
+
+//read the name area starting at head into names, which holds
+//NAMES_MAX_BLOCKS blocks of data, and the position of each of its blocks
+//into blocks. Returns how many blocks it has.
+static int names_load(long head, char *names, long *blocks)
+{
+    cs1550_disk_block block;
+    int n = 0;
+
+    while (head != 0 && n < (int) NAMES_MAX_BLOCKS) {
+        block_read(head, &block);
+        memcpy(names + n * MAX_DATA_IN_BLOCK, block.data, MAX_DATA_IN_BLOCK);
+        blocks[n++] = head;
+        head = block.nNextBlock;
+    }
+    return n;
+}
+
+//copy the name of e out of names, a name area of nblocks blocks read by
+//names_load(), into out, which holds MAX_NAME + 1 bytes
+static void names_get(char *out, const char *names, int nblocks, const struct cs1550_name *e)
+{
+    size_t len = e->nLength;
+    if ((size_t) e->nOffset + len > (size_t) nblocks * MAX_DATA_IN_BLOCK) {
+        len = 0;
+    }
+    memcpy(out, names + e->nOffset, len);
+    out[len] = '\0';
+}
+
+//bytes e, an entry of a table stride bytes apart, takes in its name area:
+//its name, and for an inline file the data after it
+static size_t name_span(const struct cs1550_name *e, size_t stride)
+{
+    const struct cs1550_file_directory *fe = (const struct cs1550_file_directory *) e;
+    if (stride == sizeof(*fe) && (fe->nStartBlock & FILE_INLINE)) {
+        return e->nLength + fe->fsize;
+    }
+    return e->nLength;
+}
+
+/*
+ * Repack the name area starting at *head for the n entries at entries,
+ * stride bytes apart and each starting with its struct cs1550_name, so the
+ * names (and inline data) lie one after the other in entry order and the
+ * space of removed ones is given back. Unless which is -1, bytes is what
+ * entry which holds from now on; its nLength, and its fsize if it is an
+ * inline file, must already be set.
+ *
+ * Only the blocks from the first byte that changed on are written, through
+ * the journal, and the chain grows or shrinks to fit. *head is updated, the
+ * caller writes the directory block, whose number near is, the new blocks
+ * go after it. Returns 0, or -ENOSPC with nothing changed.
+ */
+static int names_store(long *head, void *entries, size_t stride, int n, int which,
+                       const char *bytes, long near)
+{
+    char *old = calloc(NAMES_MAX_BLOCKS, MAX_DATA_IN_BLOCK);
+    char *packed = calloc(NAMES_MAX_BLOCKS, MAX_DATA_IN_BLOCK);
+    long blocks[NAMES_MAX_BLOCKS];
+    int nold = names_load(*head, old, blocks);
+    size_t old_size = (size_t) nold * MAX_DATA_IN_BLOCK;
+    size_t size = 0;
+    int i, res = 0;
+
+    for (i = 0; i < n; i++) {
+        size += name_span((struct cs1550_name *) ((char *) entries + i * stride), stride);
+    }
+    int nnew = (size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+
+    //get the blocks first, so running out of them changes nothing
+    for (i = nold; i < nnew; i++) {
+        long b = bitmap_alloc(i > 0 ? blocks[i - 1] / BLOCK_SIZE : near);
+        if (b == -1) {
+            while (--i >= nold) {
+                bitmap_free(blocks[i] / BLOCK_SIZE);
+            }
+            res = -ENOSPC;
+            goto out;
+        }
+        blocks[i] = b * BLOCK_SIZE;
+    }
+
+    size = 0;
+    for (i = 0; i < n; i++) {
+        struct cs1550_name *e = (struct cs1550_name *) ((char *) entries + i * stride);
+        size_t span = name_span(e, stride);
+        if (i == which) {
+            memcpy(packed + size, bytes, span);
+        } else if ((size_t) e->nOffset + span <= old_size) {
+            memcpy(packed + size, old + e->nOffset, span);
+        }
+        e->nOffset = size;
+        size += span;
+    }
+
+    //the first block that changed, and the last old one if the chain's
+    //length changed, since its link did
+    size_t from = 0;
+    while (from < size && from < old_size && old[from] == packed[from]) {
+        from++;
+    }
+    int first = from / MAX_DATA_IN_BLOCK;
+    if (nnew != nold) {
+        int last = (nnew < nold ? nnew : nold) - 1;
+        if (last >= 0 && last < first) {
+            first = last;
+        }
+    } else if (from == size) {
+        first = nnew;
+    }
+
+    for (i = first; i < nnew; i++) {
+        cs1550_disk_block block;
+        block.nNextBlock = i + 1 < nnew ? blocks[i + 1] : 0;
+        memcpy(block.data, packed + i * MAX_DATA_IN_BLOCK, MAX_DATA_IN_BLOCK);
+        meta_write(blocks[i], &block);
+    }
+    for (i = nnew; i < nold; i++) {
+        bitmap_free(blocks[i] / BLOCK_SIZE);
+    }
+    *head = nnew != 0 ? blocks[0] : 0;
+
+out:
+    free(old);
+    free(packed);
+    return res;
+}
+
+//names_store() for a new last entry called name if it isn't NULL, or just
+//to give back the space of removed ones
+static int names_rewrite(long *head, void *entries, size_t stride, int n, const char *name,
+                         long near)
+{
+    return names_store(head, entries, stride, n, name != NULL ? n - 1 : -1, name, near);
+}
+
+//index in root of the directory p names, -1 if there is none
+static int lookup_dir(const cs1550_root_directory *root, const struct cs1550_path *p)
+{
+    struct lookup_hint *h = &lookup_hints[p->dir_hash & (LOOKUP_HINTS - 1)];
+    int i;
+
+    if (h->dir_pos == 0 && h->slot < root->nDirectories
+        && name_equal(root->nNames, &root->directories[h->slot].name, p->dir, p->dir_len, p->dir_hash)) {
+        return h->slot;
+    }
+    for (i = 0; i < root->nDirectories; i++) {
+        if (name_equal(root->nNames, &root->directories[i].name, p->dir, p->dir_len, p->dir_hash)) {
+            h->dir_pos = 0;
+            h->slot = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+//index in dir, the directory block at dir_pos, of the file p names, -1 if
+//there is none
+static int lookup_file(const cs1550_directory_entry *dir, long dir_pos, const struct cs1550_path *p)
+{
+    unsigned int hash = p->name_hash ^ (unsigned int) (dir_pos / BLOCK_SIZE) * 0x9e3779b1u;
+    struct lookup_hint *h = &lookup_hints[hash & (LOOKUP_HINTS - 1)];
+    int i;
+
+    if (h->dir_pos == dir_pos && h->slot < dir->nFiles
+        && name_equal(dir->nNames, &dir->files[h->slot].name, p->name, p->name_len, p->name_hash)) {
+        return h->slot;
+    }
+    for (i = 0; i < dir->nFiles; i++) {
+        if (name_equal(dir->nNames, &dir->files[i].name, p->name, p->name_len, p->name_hash)) {
+            h->dir_pos = dir_pos;
+            h->slot = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// ============================================================================
+// ================================ open files ================================
+// ============================================================================
+/*
+ * open() resolves the path once and hands the kernel the number of a handle
+ * in fi->fh, so reads and writes on an open file skip the path and
+ * directory lookups. All
+ * opens of the same file share one handle, which holds
+ *
+ *   - where the file's entry is, which unlink keeps up to date
+ *   - its size. Writes through the handle only change it in memory, the
+ *     entry is updated on flush, fsync, release and unmount, and getattr
+ *     asks the handle.
+ *   - a cursor on its chain, the last block read or written, so sequential
+ *     I/O carries on from there instead of walking from the first block.
+ *     Only the defragmenter moves the blocks of a file while it exists,
+ *     and it drops the cursor when it does.
+ *
+ * Handles are only used between fs_enter() and fs_leave(). Calls without a
+ * handle (fi NULL, as from cs1550_bench) resolve the path into a temporary
+ * one, or use the shared one if the file is open.
+ *
+ * Under the low-level API (see "low-level interface" below) the handle is
+ * also the file's inode: it is made by the lookup that finds the file and
+ * kept until the kernel forgets it, so it is freed once neither an open
+ * nor a lookup holds it. Its inode number comes from inodes, see below.
+ */
+struct cs1550_handle
+{
+    long dir_pos;                   //directory block holding the file's entry
+    int slot;                       //index of the entry there
+    long start;                     //first block of the file, 0 while it is inline
+    int flags;                      //the FILE_* flags in its nStartBlock
+    size_t size;                    //size of the file
+    char data[INLINE_MAX];          //the data of an inline file
+    int unlinked;                   //its entry is gone, and its blocks with it
+    int dirty;                      //size is newer than the entry's fsize
+    long cursor_index;              //which block of the file cursor_pos is
+    long cursor_pos;                //byte position of a block of the file, 0 for none
+    int refs;                       //opens sharing the handle
+    unsigned long lookups;          //lookups the kernel hasn't forgotten, low-level API only
+    size_t inode;                   //index + 1 of its entry in inodes, 0 if it has none
+    int snapshot;                   //the file is the snapshot's, opened through /.snapshot
+    unsigned long undo_op;          //undo has it as it was, see undo_handle()
+    struct cs1550_handle *next;
+};
+
+static struct cs1550_handle *handles;   //every open file
+
+//undo keeps the open files an operation changes, see "undo" below
+static void undo_handle(struct cs1550_handle *h);
+static void undo_forget(struct cs1550_handle *h);
+
+//fill in h for the file in slot of dir_entry, the directory block at dir_pos
+static void handle_load(struct cs1550_handle *h, const cs1550_directory_entry *dir_entry,
+                        long dir_pos, int slot)
+{
+    memset(h, 0, sizeof(*h));
+    h->dir_pos = dir_pos;
+    h->slot = slot;
+    h->start = dir_entry->files[slot].nStartBlock & ~FILE_FLAGS;
+    h->flags = dir_entry->files[slot].nStartBlock & FILE_FLAGS;
+    h->size = dir_entry->files[slot].fsize;
+    h->snapshot = snap.view;
+    if (h->flags & FILE_INLINE) {
+        const struct cs1550_name *e = &dir_entry->files[slot].name;
+        h->size = h->size < INLINE_MAX ? h->size : INLINE_MAX;
+        names_read(dir_entry->nNames, e->nOffset + e->nLength, h->data, h->size);
+    }
+}
+
+//look up the file path names and fill in h for it
+static int handle_resolve(const char *path, struct cs1550_handle *h)
+{
+    struct cs1550_path p;
+    int res = path_parse(path, &p);
+    if (res != 0) {
+        return res;
+    }
+    if (p.depth == 0) {
+        return -EISDIR;
+    }
+
+    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));
+    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+
+    block_read(0, root_dir);
+    int i = lookup_dir(root_dir, &p);
+    if (i == -1) {
+        res = -ENOENT;
+    } else if (p.depth == 1) {
+        res = -EISDIR;
+    } else {
+        long dir_pos = root_dir->directories[i].nStartBlock;
+        block_read(dir_pos, dir_entry);
+        int j = lookup_file(dir_entry, dir_pos, &p);
+        if (j == -1) {
+            res = -ENOENT;
+        } else {
+            handle_load(h, dir_entry, dir_pos, j);
+        }
+    }
+    free(root_dir);
+    free(dir_entry);
+    return res;
+}
+
+//the handle of the open file in slot of the directory at dir_pos, NULL if
+//it isn't open. Files in the snapshot have handles of their own, found in
+//its view.
+static struct cs1550_handle * handle_find(long dir_pos, int slot)
+{
+    struct cs1550_handle *h;
+    for (h = handles; h != NULL; h = h->next) {
+        if (h->dir_pos == dir_pos && h->slot == slot && !h->unlinked && h->snapshot == snap.view) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+//the shared handle of the file tmp was resolved into, made if it has none
+static struct cs1550_handle * handle_share(const struct cs1550_handle *tmp)
+{
+    struct cs1550_handle *h = handle_find(tmp->dir_pos, tmp->slot);
+    if (h == NULL) {
+        h = malloc(sizeof(struct cs1550_handle));
+        *h = *tmp;
+        h->next = handles;
+        handles = h;
+    }
+    return h;
+}
+
+/*
+ * Under the low-level API the inode number of a file comes from its entry in
+ * inodes, which the first lookup that finds the file takes and which is given
+ * back when its handle is freed. An entry given back is reused for the next
+ * file with its generation raised, so the kernel never takes the new file for
+ * the old one, and a number the kernel sends is checked against the table
+ * before its handle is used.
+ *
+ * Under either API an open takes an entry too, and fi->fh holds its index
+ * and generation rather than the handle's address (see handle_fh()), so a
+ * call with a stale or made up fi->fh gets EBADF instead of following it
+ * into freed memory.
+ */
+struct cs1550_inode
+{
+    struct cs1550_handle *h;        //the file, NULL while the entry is free
+    unsigned long generation;       //raised each time the entry is given back
+    size_t next_free;               //while it is free, index + 1 of the next free entry
+};
+
+static struct cs1550_inode *inodes;
+static size_t inodes_len;           //entries in inodes
+static size_t inodes_free;          //index + 1 of the first free entry, 0 if none is
+
+//give back h's entry in inodes, if it has one
+static void inode_give(struct cs1550_handle *h)
+{
+    if (h->inode == 0) {
+        return;
+    }
+    struct cs1550_inode *in = &inodes[h->inode - 1];
+    in->h = NULL;
+    in->generation++;
+    in->next_free = inodes_free;
+    inodes_free = h->inode;
+    h->inode = 0;
+}
+
+//give h an entry in inodes, if it has none
+static void inode_take(struct cs1550_handle *h)
+{
+    if (h->inode != 0) {
+        return;
+    }
+    if (inodes_free == 0) {
+        size_t len = inodes_len != 0 ? 2 * inodes_len : 64;
+        size_t i;
+        inodes = realloc(inodes, len * sizeof(*inodes));
+        for (i = inodes_len; i < len; i++) {
+            inodes[i].h = NULL;
+            inodes[i].generation = 0;
+            inodes[i].next_free = i + 1 < len ? i + 2 : 0;
+        }
+        inodes_free = inodes_len + 1;
+        inodes_len = len;
+    }
+    size_t i = inodes_free - 1;
+    inodes_free = inodes[i].next_free;
+    inodes[i].h = h;
+    h->inode = i + 1;
+}
+
+//what fi->fh holds for an open of h: the index + 1 of its entry in inodes,
+//with the low half of the entry's generation above it
+static uint64_t handle_fh(struct cs1550_handle *h)
+{
+    inode_take(h);
+    return (uint64_t) (inodes[h->inode - 1].generation & 0xffffffff) << 32 | h->inode;
+}
+
+//the open file fi->fh names, NULL if it names none: its entry is out of
+//range or free, or was given back and taken again since
+static struct cs1550_handle * handle_open(const struct fuse_file_info *fi)
+{
+    size_t i = (size_t) (fi->fh & 0xffffffff);
+    if (i == 0 || i > inodes_len || inodes[i - 1].h == NULL
+        || (fi->fh >> 32) != (inodes[i - 1].generation & 0xffffffff)
+        || inodes[i - 1].h->refs == 0) {
+        return NULL;
+    }
+    return inodes[i - 1].h;
+}
+
+//free h if neither an open nor a lookup holds it anymore
+static void handle_drop(struct cs1550_handle *h)
+{
+    if (h->refs != 0 || h->lookups != 0) {
+        return;
+    }
+    inode_give(h);
+    undo_forget(h);
+    struct cs1550_handle **link = &handles;
+    while (*link != h) {
+        link = &(*link)->next;
+    }
+    *link = h->next;
+    free(h);
+}
+
+//the handle for a call on path with fi, resolving into tmp if there is none
+static int handle_get(const char *path, struct fuse_file_info *fi, struct cs1550_handle *tmp,
+                      struct cs1550_handle **h)
+{
+    if (fi != NULL && fi->fh != 0) {
+        if ((*h = handle_open(fi)) == NULL) {
+            return -EBADF;
+        }
+        //unlinked while open, its blocks are gone
+        return (*h)->unlinked ? -ENOENT : 0;
+    }
+    int res = handle_resolve(path, tmp);
+    if (res == 0) {
+        *h = handle_find(tmp->dir_pos, tmp->slot);
+        if (*h == NULL) {
+            *h = tmp;
+        }
+    }
+    return res;
+}
+
+//write h's size to the file's entry, if it changed
+static void handle_sync(struct cs1550_handle *h)
+{
+    if (h->dirty) {
+        undo_handle(h);
+    }
+    if (h->dirty && !h->unlinked) {
+        cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+        block_read(h->dir_pos, dir_entry);
+        dir_entry->files[h->slot].fsize = h->size;
+        meta_write(h->dir_pos, dir_entry);
+        free(dir_entry);
+    }
+    h->dirty = 0;
+}
+
+//write the sizes of all open files to their entries
+static void handles_sync(void)
+{
+    struct cs1550_handle *h;
+    for (h = handles; h != NULL; h = h->next) {
+        handle_sync(h);
+    }
+}
+
+//the entry in slot of the directory at dir_pos was removed and the ones
+//after it moved down
+static void handles_unlinked(long dir_pos, int slot)
+{
+    struct cs1550_handle *h;
+    for (h = handles; h != NULL; h = h->next) {
+        if (h->dir_pos != dir_pos || h->unlinked || h->snapshot || h->slot < slot) {
+            continue;
+        }
+        undo_handle(h);
+        if (h->slot == slot) {
+            h->unlinked = 1;
+            h->dirty = 0;
+        } else if (h->slot > slot) {
+            h->slot--;
+        }
+    }
+}
+
+//drop the snapshot, unless one of its files is open. The handles left of
+//its files are lookups the kernel hasn't forgotten yet; they go stale like
+//those of unlinked files.
+static int snap_remove(void)
+{
+    struct cs1550_handle *h;
+    for (h = handles; h != NULL; h = h->next) {
+        if (h->snapshot && h->refs != 0) {
+            return -EBUSY;
+        }
+    }
+    int res = snap_delete();
+    for (h = handles; res == 0 && h != NULL; h = h->next) {
+        if (h->snapshot) {
+            undo_handle(h);
+            h->unlinked = 1;
+        }
+    }
+    return res;
+}
+
+/*
+ * Read block number index of h's file into block, or its last block if the
+ * file has fewer, starting from the cursor unless it is past index. Returns
+ * the number of the block read and sets *pos to where it is. For chunked
+ * files this walks the chunk index.
+ */
+static long handle_seek(struct cs1550_handle *h, long index, cs1550_disk_block *block, long *pos)
+{
+    long cur = 0;
+    long cur_pos = h->start;
+
+    if (h->cursor_pos != 0 && h->cursor_index <= index) {
+        cur = h->cursor_index;
+        cur_pos = h->cursor_pos;
+    }
+    block_read(cur_pos, block);
+    while (cur != index && block->nNextBlock != 0) {
+        stats_add(&stats.chain_hops, 1);
+        cur_pos = block->nNextBlock;
+        block_read(cur_pos, block);
+        cur++;
+    }
+    h->cursor_index = cur;
+    h->cursor_pos = cur_pos;
+    *pos = cur_pos;
+    return cur;
+}
+
+// ============================================================================
+// =================================== undo ===================================
+// ============================================================================
+/*
+ * An operation that fails underneath, with fs_failed set by a block that
+ * doesn't match its checksum or by a block of the snapshot there is no room
+ * to copy, is undone as a whole: fs_leave() puts everything back the way it
+ * was before the operation and only then commits, so none of it ever is.
+ * From fs_enter() on undo keeps
+ *
+ *   - the blocks of the running batch the operation writes, as they were
+ *     the first time; those it adds to the batch are just dropped again
+ *   - the cached blocks it writes, as they were the first time, or that
+ *     they weren't cached. A stalled write only writes back what it
+ *     wrote once nothing else is left, see wb_write().
+ *   - the bitmap entries it sets
+ *   - the superblock's counts and groups.next_dir
+ *   - the open files it changes, but for their refs and lookups: open and
+ *     lookup take those last, after anything that can fail
+ *
+ * and the snapshot and the chunk table are loaded again once the blocks
+ * they come from are back. A commit in the middle of an operation (a full
+ * batch, fsync, taking a snapshot) makes what it did so far permanent, and
+ * undo starts over from there. Blocks written straight to disk with
+ * -o dirty=0 can't be taken back either.
+ */
+struct undo_block
+{
+    long block;
+    int cached;                     //the cache had it: this is what it was
+    unsigned long gen;
+    unsigned long dirtied_ns;
+    unsigned long flushing;
+    char data[BLOCK_SIZE];
+};
+
+struct undo_entry
+{
+    long block;
+    char value;
+};
+
+struct undo_handle
+{
+    struct cs1550_handle *h;        //NULL once it is freed
+    struct cs1550_handle was;
+};
+
+static struct
+{
+    int active;                     //an operation is running
+    int split;                      //a commit in the middle of it made part of it permanent
+    int undone;                     //it failed and was undone, and goes on until it leaves
+    unsigned long op;               //changes with every start over
+    long nbufs;                     //journal.nbufs at the start
+    cs1550_superblock sb;           //sb at the start
+    long next_dir;                  //groups.next_dir at the start
+    struct undo_block *journal;     //blocks of the running batch it wrote
+    long njournal, maxjournal;
+    struct undo_block *cache;       //cached blocks it wrote
+    long ncache, maxcache;
+    struct undo_entry *bitmap;      //bitmap entries it set
+    long nbitmap, maxbitmap;
+    struct undo_handle *handles;    //open files it changed
+    long nhandles, maxhandles;
+} undo;
+
+//array, of *max elements of size, with room for element n
+static void * undo_grow(void *array, long n, long *max, size_t size)
+{
+    if (n == *max) {
+        *max = *max != 0 ? 2 * *max : 16;
+        array = realloc(array, *max * size);
+    }
+    return array;
+}
+
+//start keeping what the running operation changes. split starts over in
+//the middle of it, after a commit, and only if it is running.
+static void undo_begin(int split)
+{
+    if (split && !undo.active) {
+        return;
+    }
+    undo.active = 1;
+    undo.split = split;
+    undo.op++;
+    undo.nbufs = journal.nbufs;
+    undo.sb = sb;
+    undo.next_dir = groups.next_dir;
+    undo.njournal = 0;
+    undo.ncache = 0;
+    undo.nbitmap = 0;
+    undo.nhandles = 0;
+}
+
+//it finished
+static void undo_end(void)
+{
+    undo.active = 0;
+    undo.undone = 0;
+}
+
+//jb of the running batch is about to be written
+static void undo_journal(struct journal_buf *jb)
+{
+    if (!undo.active || jb - journal.bufs >= undo.nbufs || jb->undo_op == undo.op) {
+        return;
+    }
+    jb->undo_op = undo.op;
+    undo.journal = undo_grow(undo.journal, undo.njournal, &undo.maxjournal,
+                             sizeof(struct undo_block));
+    struct undo_block *u = &undo.journal[undo.njournal++];
+    u->block = jb->block;
+    memcpy(u->data, jb->data, BLOCK_SIZE);
+}
+
+//b of the cache is about to be written, cached unless it was just taken
+static void undo_cache(struct wb_buf *b, int cached)
+{
+    if (!undo.active || (cached && b->undo_op == undo.op)) {
+        return;
+    }
+    b->undo_op = undo.op;
+    undo.cache = undo_grow(undo.cache, undo.ncache, &undo.maxcache, sizeof(struct undo_block));
+    struct undo_block *u = &undo.cache[undo.ncache++];
+    u->block = b->block;
+    u->cached = cached;
+    if (cached) {
+        u->gen = b->gen;
+        u->dirtied_ns = b->dirtied_ns;
+        u->flushing = b->flushing;
+        memcpy(u->data, b->data, BLOCK_SIZE);
+    }
+}
+
+//is b something the running operation wrote?
+static int undo_keeps(const struct wb_buf *b)
+{
+    return undo.active && b->undo_op == undo.op;
+}
+
+//block's bitmap entry is about to be set
+static void undo_bitmap(long block)
+{
+    if (!undo.active) {
+        return;
+    }
+    undo.bitmap = undo_grow(undo.bitmap, undo.nbitmap, &undo.maxbitmap,
+                            sizeof(struct undo_entry));
+    undo.bitmap[undo.nbitmap].block = block;
+    undo.bitmap[undo.nbitmap].value = bitmap[block];
+    undo.nbitmap++;
+}
+
+//h is about to change, if it is one of handles
+static void undo_handle(struct cs1550_handle *h)
+{
+    struct cs1550_handle *o;
+    if (!undo.active || h->undo_op == undo.op) {
+        return;
+    }
+    h->undo_op = undo.op;
+    for (o = handles; o != NULL && o != h; o = o->next) {
+    }
+    if (o == NULL) {
+        return;
+    }
+    undo.handles = undo_grow(undo.handles, undo.nhandles, &undo.maxhandles,
+                             sizeof(struct undo_handle));
+    undo.handles[undo.nhandles].h = h;
+    undo.handles[undo.nhandles].was = *h;
+    undo.nhandles++;
+}
+
+//h is about to be freed
+static void undo_forget(struct cs1550_handle *h)
+{
+    long i;
+    for (i = 0; i < undo.nhandles; i++) {
+        if (undo.handles[i].h == h) {
+            undo.handles[i].h = NULL;
+        }
+    }
+}
+
+static int undo_counts_free(char value)
+{
+    return value == BITMAP_FREE || value == BITMAP_FREED;
+}
+
+//put back what the running operation changed, as it failed with fs_failed
+static void undo_abort(void)
+{
+    long i, lost = 0;
+
+    if (!undo.active) {
+        return;
+    }
+    if (!undo.undone) {
+        LOG_WARN("operation failed: %s, undoing it%s", strerror(fs_failed),
+                 undo.split ? " back to the commit in the middle of it" : "");
+        stats_add(&stats.ops_undone, 1);
+    }
+    undo.active = 0;
+
+    //the running batch
+    for (i = undo.njournal - 1; i >= 0; i--) {
+        memcpy(journal_find(undo.journal[i].block)->data, undo.journal[i].data, BLOCK_SIZE);
+    }
+    journal_truncate(undo.nbufs);
+
+    //the bitmap and what counts it
+    for (i = undo.nbitmap - 1; i >= 0; i--) {
+        long block = undo.bitmap[i].block;
+        char was = undo.bitmap[i].value;
+        if (groups.free != NULL) {
+            groups.free[group_of(block)] += undo_counts_free(was) - undo_counts_free(bitmap[block]);
+        }
+        bitmap[block] = was;
+        if (journal.max == 0) {
+            long bblock = sb.nBitmapBlock + block / BLOCK_SIZE;
+            disk_write(bitmap + (bblock - sb.nBitmapBlock) * BLOCK_SIZE, BLOCK_SIZE,
+                       bblock * BLOCK_SIZE);
+        }
+    }
+    sb = undo.sb;
+    groups.next_dir = undo.next_dir;
+
+    //the cache: a block written back since goes in again as it was, one
+    //that wasn't cached is dropped, unless it is on disk already
+    for (i = undo.ncache - 1; i >= 0; i--) {
+        struct undo_block *u = &undo.cache[i];
+        struct wb_buf *b = wb_find(u->block);
+        if (!u->cached) {
+            if (b != NULL) {
+                wb_remove(b);
+            } else if (bitmap[u->block] != BITMAP_FREE) {
+                lost++;
+            }
+        } else if (b == NULL) {
+            wb_write(u->block, u->data);
+        } else {
+            memcpy(b->data, u->data, BLOCK_SIZE);
+            b->gen = u->gen;
+            b->dirtied_ns = u->dirtied_ns;
+            b->flushing = u->flushing;
+        }
+    }
+
+    //open files, but for what ties them to the kernel
+    for (i = undo.nhandles - 1; i >= 0; i--) {
+        struct cs1550_handle *h = undo.handles[i].h;
+        if (h == NULL) {
+            continue;
+        }
+        struct cs1550_handle now = *h;
+        *h = undo.handles[i].was;
+        h->refs = now.refs;
+        h->lookups = now.lookups;
+        h->inode = now.inode;
+        h->next = now.next;
+    }
+
+    //and what is loaded from the blocks put back
+    if (snap.map != NULL || sb.nSnapMap != 0) {
+        int view = snap.view;
+        snap_free();
+        snap_load();
+        snap.view = view;
+    }
+    if (chunk_table.by_block != NULL) {
+        chunk_table_free();
+        chunk_table_load();
+    }
+    if (lost != 0) {
+        LOG_WARN("%ld blocks it wrote were written back already", lost);
+    }
+    undo_begin(0);
+    undo.undone = 1;
+}
+
+// ============================================================================
+// ============================== compressed files ============================
+// ============================================================================
+/*
+ * Files created while mounted with -o compress are kept in CHUNK_SIZE
+ * chunks compressed with lz_compress(), a byte-oriented LZ77 in the style of
+ * LZ4: a sequence is a token byte (literal count in the high nibble, match
+ * length - LZ_MIN_MATCH in the low one, 15 meaning more length bytes
+ * follow, each adding up to 255), the literals, then a 2 byte little-endian
+ * offset back into the output. The last sequence has literals only. It
+ * trades ratio for speed, which is what logs and CSVs need. Chunks that
+ * don't get smaller are stored as they are.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+//files made from now on are compressed, set with -o compress
+static int compress_files;
+
+//files made from now on are deduplicated, set with -o dedup
+static int dedup_files;
+
+//append a sequence of nlit literals and a match of mlen bytes offset back
+//(no match if mlen is 0) to dst, which holds cap bytes. -1 if it won't fit.
+static int lz_emit(unsigned char *dst, int cap, int *op, const unsigned char *lit, int nlit,
+                   int offset, int mlen)
+{
+    int o = *op;
+    int m = mlen != 0 ? mlen - LZ_MIN_MATCH : 0;
+    int r;
+
+    if (o + 1 + nlit / 255 + 1 + nlit + 2 + m / 255 + 1 > cap) {
+        return -1;
+    }
+    dst[o++] = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15) {
+        for (r = nlit - 15; r >= 255; r -= 255) {
+            dst[o++] = 255;
+        }
+        dst[o++] = r;
+    }
+    memcpy(dst + o, lit, nlit);
+    o += nlit;
+    if (mlen != 0) {
+        dst[o++] = offset & 0xff;
+        dst[o++] = offset >> 8;
+        if (m >= 15) {
+            for (r = m - 15; r >= 255; r -= 255) {
+                dst[o++] = 255;
+            }
+            dst[o++] = r;
+        }
+    }
+    *op = o;
+    return 0;
+}
+
+static unsigned int lz_load32(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+//compress the n bytes at src (at most 65535) into dst, which holds cap
+//bytes. Returns the compressed size, or -1 if it doesn't fit.
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+    unsigned short table[1 << LZ_HASH_BITS];    //position + 1 of the last sequence per hash
+    int ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= n) {
+        unsigned int seq = lz_load32(src + ip);
+        unsigned int hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[hash] - 1;
+        table[hash] = ip + 1;
+        if (ref < 0 || lz_load32(src + ref) != seq) {
+            //skip faster through data that doesn't compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        int len = LZ_MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len]) {
+            len++;
+        }
+        if (lz_emit(dst, cap, &op, src + anchor, ip - anchor, ip - ref, len) != 0) {
+            return -1;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    if (lz_emit(dst, cap, &op, src + anchor, n - anchor, 0, 0) != 0) {
+        return -1;
+    }
+    return op;
+}
+
+//decompress the n bytes at src into dst, which holds cap bytes. Returns the
+//decompressed size, or -1 if src is damaged.
+static int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+    int ip = 0, op = 0;
+    int c;
+
+    while (ip < n) {
+        int token = src[ip++];
+        int nlit = token >> 4;
+        if (nlit == 15) {
+            do {
+                if (ip >= n) {
+                    return -1;
+                }
+                c = src[ip++];
+                nlit += c;
+            } while (c == 255);
+        }
+        if (nlit > n - ip || nlit > cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) {
+            break;
+        }
+
+        if (n - ip < 2) {
+            return -1;
+        }
+        int offset = src[ip] | src[ip + 1] << 8;
+        int mlen = (token & 15) + LZ_MIN_MATCH;
+        ip += 2;
+        if ((token & 15) == 15) {
+            do {
+                if (ip >= n) {
+                    return -1;
+                }
+                c = src[ip++];
+                mlen += c;
+            } while (c == 255);
+        }
+        if (offset == 0 || offset > op || mlen > cap - op) {
+            return -1;
+        }
+        //the match may overlap what it produces
+        if (offset >= mlen) {
+            memcpy(dst + op, dst + op - offset, mlen);
+            op += mlen;
+        } else {
+            while (mlen-- > 0) {
+                dst[op] = dst[op - offset];
+                op++;
+            }
+        }
+    }
+    return op;
+}
+
+/*
+ * Read the index block holding the ref of chunk c of h's file into index.
+ * Returns its byte position, or 0 if the index doesn't reach that far, in
+ * which case index holds its last block and the cursor is on it.
+ */
+static long chunk_index(struct cs1550_handle *h, long c, cs1550_disk_block *index)
+{
+    long pos;
+    if (handle_seek(h, c / CHUNK_REFS, index, &pos) != (long) (c / CHUNK_REFS)) {
+        return 0;
+    }
+    return pos;
+}
+
+//load the chunk ref points to into out, which holds CHUNK_SIZE bytes.
+//Returns its length, or -EIO if it is damaged.
+static int chunk_load(const struct cs1550_chunk_ref *ref, unsigned char *out, unsigned char *tmp)
+{
+    cs1550_disk_block block;
+    unsigned int len = ref->nLength & ~CHUNK_RAW;
+    unsigned char *dst = (ref->nLength & CHUNK_RAW) ? out : tmp;
+    unsigned int done = 0;
+    long pos = ref->nStart;
+
+    if (len > CHUNK_SIZE) {
+        return -EIO;
+    }
+    while (done < len && pos != 0) {
+        block_read(pos, &block);
+        unsigned int n = len - done < MAX_DATA_IN_BLOCK ? len - done : MAX_DATA_IN_BLOCK;
+        memcpy(dst + done, block.data, n);
+        done += n;
+        pos = block.nNextBlock;
+    }
+    stats_add(&stats.chunks_read, 1);
+    if (done < len) {
+        return -EIO;
+    }
+    if (ref->nLength & CHUNK_RAW) {
+        return len;
+    }
+    int res = lz_decompress(tmp, len, out, CHUNK_SIZE);
+    return res < 0 ? -EIO : res;
+}
+
+/*
+ * Store the len bytes at data as the chunk ref points to, compressing them
+ * into tmp (CHUNK_SIZE bytes) if compress is set and that makes them
+ * smaller, new blocks close after block near. Returns 0, or -ENOSPC with
+ * nothing changed.
+ *
+ * A compressed chunk only reads back with its length, which is in the ref
+ * and goes through the journal, so after a crash new bytes under the old
+ * length are garbage. Only a chunk stored as it is before and after keeps
+ * its chain, growing or shrinking it to fit, with the blocks whose link
+ * changes going through the journal; any other gets a new chain, which
+ * nothing committed points to, and the old one is freed.
+ */
+static int chunk_store(struct cs1550_chunk_ref *ref, const unsigned char *data, int len,
+                       unsigned char *tmp, int compress, long near)
+{
+    cs1550_disk_block block;
+    long old[CHUNK_MAX_BLOCKS];
+    long blocks[CHUNK_MAX_BLOCKS];
+    int nold = 0;
+    int i;
+
+    int clen = compress ? lz_compress(data, len, tmp, len - 1) : -1;
+    unsigned int flags = 0;
+    if (clen < 0) {
+        memcpy(tmp, data, len);
+        clen = len;
+        flags = CHUNK_RAW;
+    }
+    int nnew = (clen + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+
+    //the blocks it has, those it keeps, then the ones it needs
+    long pos = ref->nStart;
+    while (pos != 0 && nold < (int) CHUNK_MAX_BLOCKS) {
+        old[nold++] = pos;
+        block_read(pos, &block);
+        pos = block.nNextBlock;
+    }
+    int keep = (ref->nLength & CHUNK_RAW) && flags == CHUNK_RAW ? (nold < nnew ? nold : nnew) : 0;
+    for (i = 0; i < keep; i++) {
+        blocks[i] = old[i];
+    }
+    for (i = keep; i < nnew; i++) {
+        long b = bitmap_alloc(i > 0 ? blocks[i - 1] / BLOCK_SIZE : near);
+        if (b == -1) {
+            while (--i >= keep) {
+                bitmap_free(blocks[i] / BLOCK_SIZE);
+            }
+            return -ENOSPC;
+        }
+        blocks[i] = b * BLOCK_SIZE;
+    }
+
+    for (i = 0; i < nnew; i++) {
+        int n = clen - i * MAX_DATA_IN_BLOCK;
+        memset(&block, 0, sizeof(block));
+        block.nNextBlock = i + 1 < nnew ? blocks[i + 1] : 0;
+        memcpy(block.data, tmp + i * MAX_DATA_IN_BLOCK, n < (int) MAX_DATA_IN_BLOCK ? n : (int) MAX_DATA_IN_BLOCK);
+        if (i >= keep || (i == keep - 1 && nnew != nold)) {
+            meta_write(blocks[i], &block);
+        } else {
+            block_write(blocks[i], &block);
+        }
+    }
+    for (i = keep; i < nold; i++) {
+        bitmap_free(old[i] / BLOCK_SIZE);
+    }
+    ref->nStart = nnew != 0 ? blocks[0] : 0;
+    ref->nLength = clen | flags;
+
+    stats_add(&stats.chunks_written, 1);
+    stats_add(&stats.chunk_bytes_in, len);
+    stats_add(&stats.chunk_bytes_out, clen);
+    return 0;
+}
+
+//free the blocks of the chunk ref points to
+static void chunk_drop(const struct cs1550_chunk_ref *ref)
+{
+    cs1550_disk_block block;
+    long pos = ref->nStart;
+    while (pos != 0) {
+        block_read(pos, &block);
+        bitmap_free(pos / BLOCK_SIZE);
+        pos = block.nNextBlock;
+    }
+}
+
+// ============================================================================
+// ============================== shared chunks ===============================
+// ============================================================================
+/*
+ * Deduplicated files share their chunks: before a chunk is stored, the
+ * chunk table is searched for one with the same contents, and if there is
+ * one it just gets another ref. Data blocks hold the link to the next one,
+ * so a block can't be in two chains; whole chunks, which are reached from
+ * refs, can. A shared chunk is never written: a write to it stores a new
+ * chunk (or finds another one to share) and drops a ref to the old one. A
+ * chunk only one ref points to is rewritten in place, like any other.
+ */
+//the entry of a chunk holding the len bytes at data, or -1. tmp is scratch.
+static int chunk_find(unsigned long hash, const unsigned char *data, int len, unsigned char *tmp)
+{
+    unsigned char *cmp = NULL;
+    int i;
+
+    if (chunk_table.nbuckets == 0) {
+        return -1;
+    }
+    for (i = chunk_table.buckets[hash & (chunk_table.nbuckets - 1)] - 1; i >= 0;
+         i = chunk_table.next[i] - 1) {
+        struct cs1550_chunk_entry *e = chunk_entry(i);
+        if (e->nHash != hash) {
+            continue;
+        }
+        struct cs1550_chunk_ref ref = { e->nStart, e->nLength };
+        if (cmp == NULL) {
+            cmp = malloc(CHUNK_SIZE);
+        }
+        if (chunk_load(&ref, cmp, tmp) == len && memcmp(cmp, data, len) == 0) {
+            break;
+        }
+    }
+    free(cmp);
+    return i;
+}
+
+//drop a ref to the shared chunk ref points to, freeing it with the last one
+static void chunk_put(const struct cs1550_chunk_ref *ref)
+{
+    if (ref->nStart == 0) {
+        return;
+    }
+    int i = chunk_table.by_block[ref->nStart / BLOCK_SIZE] - 1;
+    if (i < 0) {
+        LOG_ERROR("the chunk at block %ld is not in the chunk table", ref->nStart / BLOCK_SIZE);
+        return;
+    }
+    struct cs1550_chunk_entry *e = chunk_entry(i);
+    if (--e->nRefs == 0) {
+        chunk_drop(ref);
+        chunk_table_unlink(i);
+        memset(e, 0, sizeof(*e));
+    }
+    chunk_table_store(i);
+}
+
+/*
+ * chunk_store() for deduplicated files: make ref point to a chunk holding
+ * the len bytes at data, sharing one that does if there is one. Returns 0,
+ * or -ENOSPC with nothing changed.
+ */
+static int chunk_share(struct cs1550_chunk_ref *ref, const unsigned char *data, int len,
+                       unsigned char *tmp, int compress, long near)
+{
+    unsigned long hash = chunk_hash(data, len);
+    int old = ref->nStart != 0 ? chunk_table.by_block[ref->nStart / BLOCK_SIZE] - 1 : -1;
+    int i = chunk_find(hash, data, len, tmp);
+    struct cs1550_chunk_entry *e;
+    int res;
+
+    if (i != -1) {
+        if (i != old) {
+            e = chunk_entry(i);
+            e->nRefs++;
+            chunk_table_store(i);
+            chunk_put(ref);
+            ref->nStart = e->nStart;
+            ref->nLength = e->nLength;
+            stats_add(&stats.dedup_hits, 1);
+        }
+        return 0;
+    }
+
+    if (old != -1 && chunk_entry(old)->nRefs == 1) {
+        //nobody else sees it, rewrite it where it is
+        if ((res = chunk_store(ref, data, len, tmp, compress, near)) != 0) {
+            return res;
+        }
+        chunk_table_unlink(old);
+        e = chunk_entry(old);
+        e->nHash = hash;
+        e->nStart = ref->nStart;
+        e->nLength = ref->nLength;
+        chunk_table_link(old);
+        chunk_table_store(old);
+        return 0;
+    }
+
+    //a new chunk, the old one (if any) stays as it is for its other refs
+    struct cs1550_chunk_ref new_ref = { 0, 0 };
+    if ((i = chunk_table_new()) == -1
+        || (res = chunk_store(&new_ref, data, len, tmp, compress, near)) != 0) {
+        return -ENOSPC;
+    }
+    e = chunk_entry(i);
+    e->nHash = hash;
+    e->nStart = new_ref.nStart;
+    e->nLength = new_ref.nLength;
+    e->nRefs = 1;
+    chunk_table_link(i);
+    chunk_table_store(i);
+    if (old != -1) {
+        stats_add(&stats.dedup_copies, 1);
+    }
+    chunk_put(ref);
+    *ref = new_ref;
+    return 0;
+}
+
+// ============================================================================
+// ============================== chunked files ===============================
+// ============================================================================
+/*
+ * Reads and writes of compressed and deduplicated files. Reads load only the
+ * chunks they touch. A write loads the chunk it lands in unless it covers
+ * all of it, and stores it again.
+ */
+//read size bytes at offset of h's chunked file into buf; the range is in the file
+static int chunked_read(struct cs1550_handle *h, char *buf, size_t size, off_t offset)
+{
+    cs1550_disk_block * index = malloc(sizeof(cs1550_disk_block));
+    unsigned char * chunk = malloc(CHUNK_SIZE);
+    unsigned char * tmp = malloc(CHUNK_SIZE);
+    size_t done = 0;
+    int res = 0;
+
+    while (done < size) {
+        long c = (offset + done) / CHUNK_SIZE;              //chunk holding the next byte
+        size_t in = (offset + done) % CHUNK_SIZE;           //where it is in the chunk
+        if (chunk_index(h, c, index) == 0) {
+            res = -EIO;
+            break;
+        }
+        struct cs1550_chunk_ref *ref = &((struct cs1550_chunk_ref *) index->data)[c % CHUNK_REFS];
+        int len = chunk_load(ref, chunk, tmp);
+        if (len < 0 || (size_t) len <= in) {
+            res = -EIO;
+            break;
+        }
+        size_t n = len - in < size - done ? len - in : size - done;
+        memcpy(buf + done, chunk + in, n);
+        done += n;
+    }
+    if (res != 0) {
+        LOG_ERROR("chunk %ld of the file at block %ld is damaged",
+                  (long) ((offset + done) / CHUNK_SIZE), h->start / BLOCK_SIZE);
+    }
+
+    free(index);
+    free(chunk);
+    free(tmp);
+    return done != 0 ? (int) done : res;
+}
+
+/*
+ * Write size bytes from buf at offset of h's chunked file, one chunk at a
+ * time, adding index blocks as the file grows. Returns the bytes written,
+ * which is less than size if the image fills up.
+ */
+static int chunked_write(struct cs1550_handle *h, const char *buf, size_t size, off_t offset)
+{
+    cs1550_disk_block * index = malloc(sizeof(cs1550_disk_block));
+    unsigned char * chunk = malloc(CHUNK_SIZE);
+    unsigned char * tmp = malloc(CHUNK_SIZE);
+    size_t done = 0;
+    int res = 0;
+
+    while (done < size) {
+        long c = (offset + done) / CHUNK_SIZE;
+        size_t in = (offset + done) % CHUNK_SIZE;
+        size_t n = CHUNK_SIZE - in < size - done ? CHUNK_SIZE - in : size - done;
+        size_t end = offset + done + n;
+
+        long index_pos = chunk_index(h, c, index);
+        if (index_pos == 0) {
+            //the first chunk past the last index block, link in a new one
+            long b = bitmap_alloc(h->start / BLOCK_SIZE);
+            if (b == -1) {
+                res = -ENOSPC;
+                break;
+            }
+            index_pos = b * BLOCK_SIZE;
+            index->nNextBlock = index_pos;
+            meta_write(h->cursor_pos, index);
+            memset(index, 0, sizeof(cs1550_disk_block));
+            meta_write(index_pos, index);
+            h->cursor_index++;
+            h->cursor_pos = index_pos;
+        }
+        struct cs1550_chunk_ref *ref = &((struct cs1550_chunk_ref *) index->data)[c % CHUNK_REFS];
+
+        //what the chunk holds now, unless all of it is being replaced. Files
+        //only grow at the end, so every chunk but the last is full.
+        size_t len = 0;
+        if ((size_t) c * CHUNK_SIZE < h->size) {
+            len = h->size - (size_t) c * CHUNK_SIZE;
+            if (len > CHUNK_SIZE) {
+                len = CHUNK_SIZE;
+            }
+        }
+        if (in != 0 || len > in + n) {
+            int got = chunk_load(ref, chunk, tmp);
+            if (got < 0) {
+                res = got;
+                break;
+            }
+        }
+        memcpy(chunk + in, buf + done, n);
+        if (len < in + n) {
+            len = in + n;
+        }
+
+        if (h->flags & FILE_DEDUP) {
+            res = chunk_share(ref, chunk, len, tmp, h->flags & FILE_COMPRESSED,
+                              index_pos / BLOCK_SIZE);
+        } else {
+            res = chunk_store(ref, chunk, len, tmp, h->flags & FILE_COMPRESSED,
+                              index_pos / BLOCK_SIZE);
+        }
+        if (res != 0) {
+            break;
+        }
+        meta_write(index_pos, index);
+        done += n;
+        if (end > h->size) {
+            h->size = end;
+            h->dirty = 1;
+        }
+    }
+
+    free(index);
+    free(chunk);
+    free(tmp);
+    return done != 0 ? (int) done : res;
+}
+
+//free every block of the chunked file with these flags whose index starts
+//at start, and drop its refs to shared chunks
+static void chunked_free(long start, int flags)
+{
+    cs1550_disk_block index;
+    long pos = start;
+    unsigned int i;
+
+    while (pos != 0) {
+        block_read(pos, &index);
+        struct cs1550_chunk_ref *refs = (struct cs1550_chunk_ref *) index.data;
+        for (i = 0; i < CHUNK_REFS; i++) {
+            if (flags & FILE_DEDUP) {
+                chunk_put(&refs[i]);
+            } else {
+                chunk_drop(&refs[i]);
+            }
+        }
+        bitmap_free(pos / BLOCK_SIZE);
+        pos = index.nNextBlock;
+    }
+}
+
+// ============================================================================
+// ================================ defragmenter ==============================
+// ============================================================================
+/*
+ * bitmap_alloc() hands out the first free block after the one before it,
+ * so a file written a bit at a time between others in its group still ends
+ * up spread over the group and reading it in order jumps back and forth.
+ * The defragmenter moves the chain of such a file into a run of free
+ * blocks, in order, one file at a time:
+ *
+ *   - the run is marked used and the blocks are copied into it, relinked
+ *     to follow each other. Nothing committed points there yet, so this
+ *     goes straight to disk.
+ *   - the file's entry gets the new nStartBlock, through the journal
+ *   - the old blocks are freed, which keeps them from being reused until
+ *     the batch commits
+ *
+ * so after a crash the file is either all in its old blocks or all in its
+ * new ones. Every file is moved within one batch: if the running one
+ * doesn't have room for it, it is committed first. Without a journal a
+ * crash can only leak the blocks of one of the chains, which fsck gets
+ * back.
+ *
+ * Chunked files are left alone; their chunks can be shared and are read
+ * a whole chunk at a time anyway.
+ *
+ * Mounted with -o defrag=N, a background thread moves at most N blocks a
+ * second, taking the same lock as the handlers for one file at a time.
+ * It goes over every file, logs how fragmented the image was before and
+ * after, and looks again DEFRAG_IDLE_SEC later. cs1550_fsck -d does a
+ * whole pass on an unmounted image.
+ */
+#define DEFRAG_IDLE_SEC 60
+
+//how fragmented the plain files are, see frag_measure()
+struct cs1550_frag
+{
+    long files;                     //plain files with at least one block
+    long fragmented;                //files whose blocks aren't all in order
+    long blocks;                    //blocks those files have
+    long extents;                   //runs of blocks in order they are in
+};
+
+static struct
+{
+    int rate;                       //blocks moved per second, 0 = no thread
+    int running;                    //the thread was started
+    int stop;                       //asks the thread to finish
+    pthread_t thread;
+    pthread_mutex_t lock;           //guards stop
+    pthread_cond_t wake;
+} defrag = { 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/*
+ * Collect the byte positions of the blocks in the chain at start into
+ * *chain. Returns how many there are, or -1 if the chain leaves the data
+ * area or is longer than it (a damaged image).
+ */
+static long defrag_chain(long start, long **chain)
+{
+    cs1550_disk_block block;
+    long max = sb.nDataEnd - sb.nDataStart;
+    long size = 16, n = 0;
+    long pos = start;
+
+    *chain = malloc(size * sizeof(long));
+    while (pos != 0) {
+        if (!valid_block_pos(pos) || n == max) {
+            return -1;
+        }
+        if (n == size) {
+            size *= 2;
+            *chain = realloc(*chain, size * sizeof(long));
+        }
+        (*chain)[n++] = pos;
+        block_read(pos, &block);
+        pos = block.nNextBlock;
+    }
+    return n;
+}
+
+//number of runs of blocks in order in chain
+static long defrag_extents(const long *chain, long n)
+{
+    long extents = n != 0;
+    long i;
+    for (i = 1; i < n; i++) {
+        if (chain[i] != chain[i - 1] + BLOCK_SIZE) {
+            extents++;
+        }
+    }
+    return extents;
+}
+
+//walk every plain file of the image into f
+static void frag_measure(struct cs1550_frag *f)
+{
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+    int d, j;
+
+    memset(f, 0, sizeof(*f));
+    block_read(0, &root);
+    for (d = 0; d < root.nDirectories; d++) {
+        block_read(root.directories[d].nStartBlock, &dir);
+        for (j = 0; j < dir.nFiles; j++) {
+            long *chain;
+            long n;
+            if (dir.files[j].nStartBlock & (FILE_CHUNKED | FILE_INLINE)) {
+                continue;
+            }
+            n = defrag_chain(dir.files[j].nStartBlock & ~FILE_FLAGS, &chain);
+            if (n > 0) {
+                long extents = defrag_extents(chain, n);
+                f->files++;
+                f->fragmented += extents > 1;
+                f->blocks += n;
+                f->extents += extents;
+            }
+            free(chain);
+        }
+    }
+}
+
+#ifdef CS1550_NO_MAIN
+CS1550_API void frag_print(FILE *out, const char *when, const struct cs1550_frag *f)
+{
+    fprintf(out, "%s: %ld of %ld files fragmented (%.1f%%), %ld blocks in %ld extents\n",
+            when, f->fragmented, f->files, f->files ? 100.0 * f->fragmented / f->files : 0.0,
+            f->blocks, f->extents);
+}
+#endif
+
+//first run of n free blocks, -1 if there is none
+static long bitmap_find_run(long n)
+{
+    long i, run = 0;
+    stats_add(&stats.bitmap_scans, 1);
+    for (i = sb.nDataStart; i < sb.nDataEnd; i++) {
+        run = bitmap[i] == BITMAP_FREE ? run + 1 : 0;
+        if (run == n) {
+            return i - n + 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Move the file in slot of the directory at dir_pos into a run of free
+ * blocks if it is fragmented and at most max blocks long. Returns the
+ * number of blocks moved, 0 if it was left where it is, or minus the
+ * number of blocks it has if that is more than max.
+ */
+static long defrag_file(long dir_pos, int slot, long max)
+{
+    cs1550_directory_entry dir;
+    cs1550_disk_block block;
+    long *chain;
+    long i;
+
+    block_read(dir_pos, &dir);
+    if (slot >= dir.nFiles || (dir.files[slot].nStartBlock & (FILE_CHUNKED | FILE_INLINE))) {
+        return 0;
+    }
+    long start = dir.files[slot].nStartBlock & ~FILE_FLAGS;
+    long n = defrag_chain(start, &chain);
+    if (n <= 1 || defrag_extents(chain, n) == 1) {
+        free(chain);
+        return 0;
+    }
+    if (n > max) {
+        free(chain);
+        return -n;
+    }
+
+    //the entry, and the bitmap blocks of both chains, all in one batch
+    long bitmap_blocks = BITMAP_BLOCKS(sb.nBlocks);
+    long need = 1 + (n / BLOCK_SIZE + 2) + (n < bitmap_blocks ? n : bitmap_blocks);
+    long run = need <= journal.max || journal.max == 0 ? bitmap_find_run(n) : -1;
+    if (run == -1) {
+        free(chain);
+        return 0;
+    }
+    if (journal.max != 0 && journal.nbufs + need > journal.max) {
+        journal_commit();
+    }
+
+    for (i = 0; i < n; i++) {
+        bitmap_set(run + i, journal.max != 0 ? BITMAP_NEW : BITMAP_USED);
+    }
+    for (i = 0; i < n; i++) {
+        block_read(chain[i], &block);
+        block.nNextBlock = i + 1 < n ? (run + i + 1) * BLOCK_SIZE : 0;
+        block_write((run + i) * BLOCK_SIZE, &block);
+    }
+    //a block that failed its checksum, leave the file as it is
+    if (fs_failed) {
+        for (i = 0; i < n; i++) {
+            bitmap_set(run + i, BITMAP_FREE);
+        }
+        free(chain);
+        return 0;
+    }
+
+    dir.files[slot].nStartBlock = run * BLOCK_SIZE | (dir.files[slot].nStartBlock & FILE_FLAGS);
+    meta_write(dir_pos, &dir);
+    for (i = 0; i < n; i++) {
+        bitmap_free(chain[i] / BLOCK_SIZE);
+    }
+
+    //an open file's handle has to follow it
+    struct cs1550_handle *h = handle_find(dir_pos, slot);
+    if (h != NULL) {
+        undo_handle(h);
+        h->start = run * BLOCK_SIZE;
+        h->cursor_pos = 0;
+    }
+    LOG_DEBUG("moved %ld blocks from block %ld to %ld", n, start / BLOCK_SIZE, run);
+    stats_add(&stats.defrag_files, 1);
+    stats_add(&stats.defrag_blocks, n);
+    free(chain);
+    return n;
+}
+
+/*
+ * Go on with the pass from directory *d, file *f, moving files while that
+ * stays within *credit blocks, which it takes what it moved from. Returns 1
+ * once the pass is over, 0 if it stopped for lack of credit.
+ */
+static int defrag_step(int *d, int *f, long *credit)
+{
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+
+    //moving held blocks would only copy them
+    if (snap.map != NULL) {
+        return 1;
+    }
+
+    block_read(0, &root);
+    for (; *d < root.nDirectories; (*d)++, *f = 0) {
+        long dir_pos = root.directories[*d].nStartBlock;
+        block_read(dir_pos, &dir);
+        for (; *f < dir.nFiles; (*f)++) {
+            long moved = defrag_file(dir_pos, *f, *credit);
+            if (moved < 0) {
+                return 0;
+            }
+            *credit -= moved;
+        }
+    }
+    return 1;
+}
+
+#ifdef CS1550_NO_MAIN
+//defragment the whole image at once, for cs1550_fsck -d
+CS1550_API void defrag_all(void)
+{
+    int d = 0, f = 0;
+    long credit = LONG_MAX;
+    defrag_step(&d, &f, &credit);
+    journal_commit();
+}
+#endif
+
+//sleep for ns unless asked to stop, returns 1 if asked
+static int defrag_sleep(unsigned long ns)
+{
+    struct timespec until;
+    int stop;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ns / 1000000000UL;
+    until.tv_nsec += ns % 1000000000UL;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&defrag.lock);
+    while (!defrag.stop && pthread_cond_timedwait(&defrag.wake, &defrag.lock, &until) == 0) {
+    }
+    stop = defrag.stop;
+    pthread_mutex_unlock(&defrag.lock);
+    return stop;
+}
+
+//the background thread: a pass over every file, then a rest
+static void * defrag_thread(void *arg)
+{
+    struct cs1550_frag before, after;
+    (void) arg;
+
+    while (!defrag_sleep(DEFRAG_IDLE_SEC * 1000000000UL)) {
+        int d = 0, f = 0;
+        long credit = 0;
+        int done = 0;
+
+        fs_enter();
+        frag_measure(&before);
+        fs_leave(0);
+        if (before.fragmented == 0) {
+            continue;
+        }
+        //a second's worth of blocks at a time, saved up for a file that
+        //needs more than that
+        while (!done && !defrag_sleep(1000000000UL)) {
+            credit += defrag.rate;
+            fs_enter();
+            done = defrag_step(&d, &f, &credit);
+            fs_leave(0);
+        }
+        if (!done) {
+            break;
+        }
+
+        fs_enter();
+        frag_measure(&after);
+        fs_leave(0);
+        //for /.stats, whatever the log level
+        stats.frag_before = before.fragmented;
+        stats.extents_before = before.extents;
+        stats.frag_after = after.fragmented;
+        stats.extents_after = after.extents;
+        stats_add(&stats.defrag_passes, 1);
+        LOG_INFO("%ld of %ld files were fragmented, %ld extents; now %ld files, %ld extents",
+                 before.fragmented, before.files, before.extents,
+                 after.fragmented, after.extents);
+    }
+    return NULL;
+}
+
+//start the thread, if -o defrag asked for one
+static void defrag_start(void)
+{
+    if (defrag.rate > 0 && pthread_create(&defrag.thread, NULL, defrag_thread, NULL) == 0) {
+        defrag.running = 1;
+    }
+}
+
+//and stop it, before the image is closed
+static void defrag_stop(void)
+{
+    if (!defrag.running) {
+        return;
+    }
+    pthread_mutex_lock(&defrag.lock);
+    defrag.stop = 1;
+    pthread_cond_signal(&defrag.wake);
+    pthread_mutex_unlock(&defrag.lock);
+    pthread_join(defrag.thread, NULL);
+    defrag.running = 0;
+}
+
+// ============================================================================
+// ============================= cs1550_getattr() =============================
+// ============================================================================
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not.
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+    LOG_DEBUG("%s", path);
+
+    int res = -ENOENT;
+    struct cs1550_path p;
+    const char *rest;
+    
+    memset(stbuf, 0, sizeof(struct stat));
+
+    //the snapshot is the image as it was, read-only
+    if ((res = snap_path(path, &rest)) != 0) {
+        if (res > 0) {
+            snap.view = 1;
+            res = cs1550_getattr(rest, stbuf);
+            snap.view = 0;
+            stbuf->st_mode &= ~0222;
+        }
+        return res;
+    }
+    
+    /******************
+     * If path is root
+     ******************/
+    if (strcmp(path, "/") == 0) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        res=0;
+    }
+    //If path is the virtual stats file
+    else if (strcmp(path, STATS_PATH) == 0) {
+        res = stats_getattr(stbuf);
+    }
+    //If path isn't the root
+    else if ((res = path_parse(path, &p)) == 0) {
+        LOG_TRACE("directory_name: %s filename: %s", p.dir, p.name);
+        
+        cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));
+        cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+        
+        //Read the root directory into memory
+        block_read(0, root_dir);
+        
+        //Look in root for the directory
+        res = -ENOENT;
+        int i = lookup_dir(root_dir, &p);
+        if (i != -1) {
+            long cur = root_dir->directories[i].nStartBlock; //byte position of cur subdirectory
+            /************************
+             * If path is a directory
+             ************************/
+            if(p.depth == 1){
+                //Might want to return a structure with these fields
+                stbuf->st_mode = S_IFDIR | 0755;
+                stbuf->st_nlink = 2;
+                res = 0;
+            }
+            /*******************
+             * If path is a file
+             *******************/
+            else {
+                block_read(cur, dir_entry);                 // read the subdirectory
+                int j = lookup_file(dir_entry, cur, &p);
+                //if file exist, return permission and size; else return -ENOENT
+                if(j != -1){
+                    //an open file may have grown since its entry was written
+                    struct cs1550_handle *h = handle_find(cur, j);
+                    stbuf->st_mode = S_IFREG | 0666;
+                    stbuf->st_nlink = 1;                                //file links
+                    stbuf->st_size = h != NULL ? h->size : dir_entry->files[j].fsize;  //file size
+                    res = 0;
+                }
+            }
+        }
+        //free up mem space allocated for structs
+        free(root_dir);
+        free(dir_entry);
+    }
+    return res;
+}
+
+// ============================================================================
+// ============================= cs1550_readdir() =============================
+// ============================================================================
+/*
+ * opendir() takes a snapshot of the directory into a cursor kept in fi->fh:
+ * every name with the mode and size getattr would give for it. readdir()
+ * then hands the kernel entries from the snapshot starting at offset, with
+ * their attributes, until its buffer is full, and the kernel asks for the
+ * next page with the offset of the last entry it got. A large directory is
+ * read from disk once per opendir instead of once per page, and entries
+ * that are neither added nor removed meanwhile are listed exactly once
+ * even if unlink moves them to another slot. Seeking back to offset 0
+ * (rewinddir) takes a new snapshot.
+ *
+ * Calls without a cursor (fi NULL, as from cs1550_bench) take a temporary
+ * snapshot for the call.
+ */
+struct cs1550_dirent
+{
+    char name[MAX_NAME + 1];
+    mode_t mode;
+    off_t size;
+};
+
+struct cs1550_dir_cursor
+{
+    int count;                      //entries in the snapshot
+    int read;                       //readdir has been called since it was taken
+    struct cs1550_dirent entries[]; //., .. and then the directory's entries
+};
+
+//fill in ., .. and the count of c, which has n entries in all
+static struct cs1550_dir_cursor * dir_cursor_done(struct cs1550_dir_cursor *c, int n)
+{
+    strcpy(c->entries[0].name, ".");
+    strcpy(c->entries[1].name, "..");
+    c->entries[0].mode = c->entries[1].mode = S_IFDIR | 0755;
+    c->entries[0].size = c->entries[1].size = 0;
+    c->count = n;
+    c->read = 0;
+    return c;
+}
+
+//take a snapshot of the directory whose block is at dir_pos into a new cursor
+static struct cs1550_dir_cursor * dir_list(long dir_pos)
+{
+    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+    char * names = malloc(NAMES_MAX_BLOCKS * MAX_DATA_IN_BLOCK);
+    long name_blocks[NAMES_MAX_BLOCKS];
+
+    block_read(dir_pos, dir_entry);                 //read the subdirectory
+    int nblocks = names_load(dir_entry->nNames, names, name_blocks);
+    struct cs1550_dir_cursor *c = malloc(sizeof(*c) + (2 + dir_entry->nFiles) * sizeof(struct cs1550_dirent));
+    int n = 2;
+    //loop through all files in subdirectory
+    int j = 0;
+    for(j=0; j<dir_entry->nFiles; j++){
+        //an open file may have grown since its entry was written
+        struct cs1550_handle *h = handle_find(dir_pos, j);
+        names_get(c->entries[n].name, names, nblocks, &dir_entry->files[j].name);
+        c->entries[n].mode = S_IFREG | 0666;
+        c->entries[n].size = h != NULL ? h->size : dir_entry->files[j].fsize;
+        n++;
+    }
+
+    free(dir_entry);
+    free(names);
+    return dir_cursor_done(c, n);
+}
+
+//take a snapshot of the root into a new cursor
+static struct cs1550_dir_cursor * root_list(void)
+{
+    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));
+    char * names = malloc(NAMES_MAX_BLOCKS * MAX_DATA_IN_BLOCK);
+    long name_blocks[NAMES_MAX_BLOCKS];
+    struct stat st;
+
+    block_read(0, root_dir);
+    struct cs1550_dir_cursor *c = malloc(sizeof(*c) + (4 + root_dir->nDirectories) * sizeof(struct cs1550_dirent));
+    int n = 2;
+    if (!snap.view) {
+        memset(&st, 0, sizeof(st));
+        stats_getattr(&st);
+        strcpy(c->entries[n].name, STATS_PATH + 1);
+        c->entries[n].mode = st.st_mode;
+        c->entries[n].size = st.st_size;
+        n++;
+    }
+    if (!snap.view && snap.root != 0) {
+        strcpy(c->entries[n].name, SNAP_PATH + 1);
+        c->entries[n].mode = S_IFDIR | 0555;
+        c->entries[n].size = 0;
+        n++;
+    }
+
+    //all directories in root directory
+    int nblocks = names_load(root_dir->nNames, names, name_blocks);
+    int i=0;
+    for(i=0; i<root_dir->nDirectories; i++){
+        names_get(c->entries[n].name, names, nblocks, &root_dir->directories[i].name);
+        c->entries[n].mode = S_IFDIR | 0755;
+        c->entries[n].size = 0;
+        n++;
+    }
+
+    free(root_dir);
+    free(names);
+    return dir_cursor_done(c, n);
+}
+
+//take a snapshot of the directory path into a new cursor
+static int dir_snapshot(const char *path, struct cs1550_dir_cursor **cursor)
+{
+    struct cs1550_path p;
+    int res = path_parse(path, &p);
+    if (res != 0) {
+        return res;
+    } else if (p.depth == 2) {
+        return -ENOTDIR;
+    } else if (p.depth == 0) {
+        *cursor = root_list();
+        return 0;
+    }
+
+    //Look in root for the directory
+    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));
+    block_read(0, root_dir);
+    int i = lookup_dir(root_dir, &p);
+    if (i != -1) {
+        *cursor = dir_list(root_dir->directories[i].nStartBlock);
+    } else {
+        res = -ENOENT;
+    }
+    free(root_dir);
+    return res;
+}
+
+/*
+ * Called when a directory is opened, before it is read. Takes the snapshot
+ * readdir pages through.
+ */
+static int cs1550_opendir(const char *path, struct fuse_file_info *fi)
+{
+    LOG_DEBUG("%s", path);
+
+    struct cs1550_dir_cursor *c;
+    const char *rest;
+    int res = snap_path(path, &rest);
+    if (res != 0) {
+        if (res > 0) {
+            snap.view = 1;
+            res = cs1550_opendir(rest, fi);
+            snap.view = 0;
+        }
+        return res;
+    }
+
+    res = dir_snapshot(path, &c);
+    //a block that failed its checksum fails the whole call, see fs_leave()
+    if (res == 0 && fs_failed) {
+        free(c);
+        res = -EIO;
+    }
+    fi->fh = res == 0 ? (unsigned long) c : 0;
+    return res;
+}
+
+/*
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi)
+{
+    LOG_DEBUG("%s offset %ld", path, (long) offset);
+
+    struct cs1550_dir_cursor *c = NULL;
+    const char *rest;
+    int res = snap_path(path, &rest);
+
+    if (res != 0) {
+        if (res > 0) {
+            snap.view = 1;
+            res = cs1550_readdir(rest, buf, filler, offset, fi);
+            snap.view = 0;
+        }
+        return res;
+    }
+    if (fi != NULL && fi->fh != 0) {
+        c = (struct cs1550_dir_cursor *) (unsigned long) fi->fh;
+        //rewinddir, start again from what is there now
+        if (offset == 0 && c->read) {
+            struct cs1550_dir_cursor *fresh;
+            if ((res = dir_snapshot(path, &fresh)) != 0) {
+                return res;
+            }
+            free(c);
+            c = fresh;
+            fi->fh = (unsigned long) c;
+        }
+    } else if ((res = dir_snapshot(path, &c)) != 0) {
+        return res;
+    }
+    c->read = 1;
+
+    //the offset of an entry is its index + 1, the kernel passes back the
+    //offset of the last one it took and filler says when its buffer is full
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    off_t i;
+    for (i = offset; i >= 0 && i < c->count; i++) {
+        st.st_mode = c->entries[i].mode;
+        st.st_size = c->entries[i].size;
+        st.st_nlink = S_ISDIR(st.st_mode) ? 2 : 1;
+        if (filler(buf, c->entries[i].name, &st, i + 1) != 0) {
+            break;
+        }
+    }
+
+    if (fi == NULL || fi->fh == 0) {
+        free(c);
+    }
+    return 0;
+}
+
+/*
+ * Called when a directory opened with opendir is closed.
+ */
+static int cs1550_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    free((struct cs1550_dir_cursor *) (unsigned long) fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+// ============================================================================
+// ============================== cs1550_mkdir() ==============================
+// ============================================================================
+/*
+ * Make the directory p names in the root. Returns its index there, or
+ * -EEXIST or -ENOSPC.
+ */
+static int dir_create(const struct cs1550_path *p)
+{
+    int res;
+    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory));	
+    block_read(0, root_dir);
+    {
+        //path's directory name already exists, -EEXIST
+        if(lookup_dir(root_dir, p) != -1){
+            free(root_dir);
+            return -EEXIST;
+        }
+        //no room left in the root for another directory
+        else if(root_dir->nDirectories >= (int) MAX_DIRS_IN_ROOT){
+            free(root_dir);
+            return -ENOSPC;
+        }
+        //path's directory name doesn't exist
+        else {
+            //look for free block for new directory, the bitmap change goes
+            //into the journal first so a crash can at worst leak the block
+            long newdir_pos = bitmap_alloc(dir_group()); 	//block position for new directory
+            if(newdir_pos == -1){
+                free(root_dir);
+                return -ENOSPC;
+            }
+
+            //add the name to the root's name area
+            struct cs1550_directory *de = &root_dir->directories[root_dir->nDirectories];
+            de->name.nHash = p->dir_hash;
+            de->name.nLength = p->dir_len;
+            if(names_rewrite(&root_dir->nNames, root_dir->directories, sizeof(*de),
+                             root_dir->nDirectories + 1, p->dir, 0) != 0){
+                bitmap_free(newdir_pos);
+                free(root_dir);
+                return -ENOSPC;
+            }
+            
+            /*-------------------------
+             * Initialize new directory
+             ------------------------*/
+            cs1550_directory_entry * new_dir = malloc(sizeof(cs1550_directory_entry));
+            memset(new_dir, 0, sizeof(cs1550_directory_entry)); 	//initialize new_dir to contain all 0s
+            new_dir->nFiles = 0; 						//initialize new directory's nFiles to 0
+            meta_write(newdir_pos*512, new_dir);       //write new_dir to disk
+            free(new_dir);
+            
+            /*------------
+             * Update root
+             -------------*/
+            //set byte position of new directory
+            LOG_DEBUG("new directory \"%s\" written to block %ld", p->dir, newdir_pos);
+            de->nStartBlock = newdir_pos*512;
+            
+            //increment number of directories in root
+            res = root_dir->nDirectories;
+            root_dir->nDirectories = (root_dir->nDirectories) + 1;
+            meta_write(0, root_dir);
+            sb.nDirs++;
+        }
+    }
+    //free up mem space allocated for root
+   	free(root_dir);
+    return res;
+}
+
+/*
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+    LOG_DEBUG("%s", path);
+    (void) path;
+    (void) mode;
+    struct cs1550_path p;
+    int res = path_parse(path, &p);
+    
+    LOG_TRACE("directory_name: %s filename: %s", p.dir, p.name);
+    
+    //making /.snapshot takes a snapshot
+    const char *rest;
+    if(strcmp(path, SNAP_PATH) == 0){
+        handles_sync();
+        return snap_create();
+    } else if(snap_path(path, &rest) != 0){
+        return snap.root != 0 ? -EROFS : -ENOENT;
+    }
+
+    //check for errors
+    if(strcmp(path, "/") == 0 || strcmp(path, STATS_PATH) == 0){
+        return -EEXIST;
+    } else if(res == -ENAMETOOLONG){
+        return res;
+    } else if (res != 0 || p.depth != 1){
+        //directories can only be made in the root
+        return -EPERM;
+    }
+
+    res = dir_create(&p);
+    return res < 0 ? res : 0;
+}
+
+/*
+ * Removes a directory.
+ */
+static int cs1550_rmdir(const char *path)
+{
+    const char *rest;
+
+    //removing /.snapshot drops the snapshot, once none of its files are open
+    if (strcmp(path, SNAP_PATH) == 0) {
+        return snap_remove();
+    } else if (snap_path(path, &rest) != 0) {
+        return snap.root != 0 ? -EROFS : -ENOENT;
+    }
+    return 0;
+}
+
+/******************************************************************************
+ *
+ *                                   PART 2
+ *
+ *****************************************************************************/
+
+// ============================================================================
+// ============================== cs1550_mknod() ==============================
+// ============================================================================
+/*
+ * Make the file p names in the directory whose block is at dir_pos. It
+ * starts out inline, so only the directory and its name area are written.
+ * Returns its index there, or -EEXIST or -ENOSPC.
+ */
+static int file_create(long dir_pos, const struct cs1550_path *p)
+{
+    int res;
+    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
+   
+    block_read(dir_pos, dir_entry);
+
+    //search all files under directory to check if file already exist
+    if(lookup_file(dir_entry, dir_pos, p) != -1){
+        LOG_DEBUG("%s/%s: EEXIST", p->dir, p->name);
+        res = -EEXIST;
+        goto out;
+    }
+    if(dir_entry->nFiles >= (int) MAX_FILES_IN_DIR){
+        LOG_DEBUG("%s/%s: directory full", p->dir, p->name);
+        res = -ENOSPC;
+        goto out;
+    }
+
+    // -----------------------
+    // * no errors, create file
+    // -----------------------
+    //an empty inline file, which remembers how to lay out its blocks later
+    struct cs1550_file_directory *fe = &dir_entry->files[dir_entry->nFiles];
+    fe->name.nHash = p->name_hash;
+    fe->name.nLength = p->name_len;
+    fe->fsize = 0;
+    fe->nStartBlock = FILE_INLINE | (compress_files ? FILE_COMPRESSED : 0)
+                      | (dedup_files ? FILE_DEDUP : 0);
+
+    //add the name to the directory's name area
+    if(names_rewrite(&dir_entry->nNames, dir_entry->files, sizeof(*fe), dir_entry->nFiles + 1,
+                     p->name, dir_pos / BLOCK_SIZE) != 0){
+        res = -ENOSPC;
+        goto out;
+    }
+
+    /*--------------------
+     * Update subdirectory
+     --------------------*/
+    LOG_DEBUG("new file %s made inline", p->name);
+    //increment number of file in subdirectory
+    res = dir_entry->nFiles;
+    dir_entry->nFiles = (dir_entry->nFiles) + 1;
+
+    meta_write(dir_pos, dir_entry);
+    sb.nFiles++;
+
+    if (LOG_ENABLED(LOG_LEVEL_TRACE)) {
+        LOG_TRACE("%i files under directory %s", dir_entry->nFiles, p->dir);
+        int m;
+        for (m = 0; m < dir_entry->nFiles; m++) {
+            LOG_TRACE("file %i: %u byte name has size %zu and is at block %ld", m,
+                      dir_entry->files[m].name.nLength, dir_entry->files[m].fsize,
+                      (dir_entry->files[m].nStartBlock & ~FILE_FLAGS)/512);
+        }
+    }
+
+out:
+    free(dir_entry);
+    return res;
+}
+
+/*
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    LOG_DEBUG("%s", path);
+    (void) mode;
+    (void) dev;
+
+    struct cs1550_path p;
+    const char *rest;
+    if (snap_path(path, &rest) != 0) {
+        return snap.root != 0 ? -EROFS : -ENOENT;
+    }
+    int res = path_parse(path, &p);
+
+    LOG_TRACE("directory_name: %s filename: %s", p.dir, p.name);
+    
+    /* ----------------
+     * check for errors
+       ----------------*/
+    if(res == -ENAMETOOLONG){
+        LOG_DEBUG("%s: ENAMETOOLONG", path);
+        return res;
+    } else if (res != 0 || p.depth != 2){
+        //files can only be made in a subdirectory
+        LOG_DEBUG("%s: EPERM", path);
+        return -EPERM;
+    }
+
+    //search root to find directory entry position
+    cs1550_root_directory * root_dir = malloc(sizeof(cs1550_root_directory)); 
+    block_read(0, root_dir);
+    int i = lookup_dir(root_dir, &p);
+    if(i == -1){
+        res = -ENOENT;
+    } else {
+        res = file_create(root_dir->directories[i].nStartBlock, &p);
+    }
+    free(root_dir);
+    return res < 0 ? res : 0;
+}
+
+// ============================================================================
+// ============================== cs1550_unlink() =============================
+// ============================================================================
+/*
+ * Free the blocks of a file that starts at file_pos and is laid out as flags
+ * say. An inline file has none.
+ */
+static void file_free(long file_pos, int flags)
+{
+    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block));  
+
+    //walk the file's chain and mark every block in it free (0). The blocks
+    //themselves are left as they are; write() clears a block when it reuses it.
+    long block_pos = (flags & (FILE_CHUNKED | FILE_INLINE)) ? 0 : file_pos;
+    if ((flags & FILE_CHUNKED) && !(flags & FILE_INLINE)) {
+        chunked_free(file_pos, flags);
+    }
+    while(block_pos != 0){
+        block_read(block_pos, file_block);
+        bitmap_free(block_pos/512);
+        LOG_TRACE("freed block %ld", block_pos/512);
+
+        block_pos = file_block->nNextBlock;     //position of next block to free
+        if(block_pos != 0){
+            stats_add(&stats.chain_hops, 1);
+        }
+    }
+    free(file_block);
+}
+
+/*
+ * Remove the file resolved into file from its directory and free its blocks
+ */
+static void file_remove(const struct cs1550_handle *file)
+{
+    long dir_pos = file->dir_pos;    //directory byte position on disk
+
+    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));  
+
+    /*-----------------------
+     * Update Directory Entry
+     -----------------------*/
+    block_read(dir_pos, dir_entry);
+
+    //Shift all file positions under directory over the file's entry
+    int i = file->slot;
+    int j;
+    for (j = i; j < dir_entry->nFiles-1; j++) {
+        dir_entry->files[j] = dir_entry->files[j+1];
+    }       
+    memset(&dir_entry->files[dir_entry->nFiles-1], 0, sizeof(struct cs1550_file_directory));
+    dir_entry->nFiles -= 1;
+    sb.nFiles--;
+    handles_unlinked(dir_pos, i);
+
+    //give the name's space back, which never needs new blocks
+    names_rewrite(&dir_entry->nNames, dir_entry->files, sizeof(dir_entry->files[0]),
+                  dir_entry->nFiles, NULL, 0);
+
+    LOG_TRACE("%i files left in directory", dir_entry->nFiles);
+    //update directory entry, before the blocks are freed so a crash in
+    //between can only leak them
+    meta_write(dir_pos, dir_entry);
+
+    /*--------------
+     * Update Bitmap
+     --------------*/
+    file_free(file->start, file->flags);
+    free(dir_entry);
+}
+
+/*
+ * Deletes a file
+ */
+static int cs1550_unlink(const char *path)
+{
+    (void) path;
+    LOG_DEBUG("%s", path);
+
+    const char *rest;
+    if (strcmp(path, STATS_PATH) == 0) {
+        return -EACCES;
+    } else if (snap_path(path, &rest) != 0) {
+        return snap.root != 0 ? -EROFS : -ENOENT;
+    }
+
+    struct cs1550_handle file;
+    int res = handle_resolve(path, &file);
+    if (res != 0) {
+        return res;
+    }
+    file_remove(&file);
+    return 0;
+}
+
+// ============================================================================
+// ============================== cs1550_read() ===============================
+// ============================================================================
+static int file_read(struct cs1550_handle *h, char *buf, size_t size, off_t offset);
+
+/*
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    LOG_DEBUG("%s size %zu offset %ld", path, size, (long) offset);
+
+    const char *rest;
+    int res;
+    if (strcmp(path, STATS_PATH) == 0) {
+        return stats_read(buf, size, offset);
+    } else if ((res = snap_path(path, &rest)) != 0) {
+        if (res > 0) {
+            snap.view = 1;
+            res = cs1550_read(rest, buf, size, offset, fi);
+            snap.view = 0;
+        }
+        return res;
+    }
+
+    //find the file, through its handle if it is open
+    struct cs1550_handle tmp;
+    struct cs1550_handle *h;
+    res = handle_get(path, fi, &tmp, &h);
+    if (res != 0) {
+        LOG_DEBUG("%s: %s", path, strerror(-res));
+        return res;
+    }
+    return file_read(h, buf, size, offset);
+}
+
+//read size bytes at offset of h's file into buf
+static int file_read(struct cs1550_handle *h, char *buf, size_t size, off_t offset)
+{
+    size_t file_size = h->size;    //size of file
+
+    //nothing to read at or past the end of the file
+    if (size == 0 || offset >= (off_t) file_size){
+        return 0;
+    }
+    if (size > file_size - offset){
+        size = file_size - offset;
+    }
+    if (h->flags & FILE_INLINE) {
+        memcpy(buf, h->data + offset, size);
+        return size;
+    }
+    if (h->flags & FILE_CHUNKED) {
+        return chunked_read(h, buf, size, offset);
+    }
+
+    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block));
+
+    //find the block where the first byte to read resides, from the cursor
+    //if it is on the way
+    long start_block = offset/MAX_DATA_IN_BLOCK;    //the # of the block holding offset. Start from block 0
+    int pos_in_block = offset%MAX_DATA_IN_BLOCK;    //byte position in that block
+    long block_pos;                                 //byte position of the current block
+    long cur = handle_seek(h, start_block, file_block, &block_pos);  //number of current block
+    LOG_TRACE("start block is %ld", start_block);
+
+    //copy out of each block in turn until size bytes have been read
+    size_t new_data = 0;
+    while (cur == start_block && new_data < size){
+        size_t n = MAX_DATA_IN_BLOCK - pos_in_block;
+        if (n > size - new_data) {
+            n = size - new_data;
+        }
+        memcpy(buf + new_data, file_block->data + pos_in_block, n);
+        new_data += n;
+        pos_in_block = 0;
+
+        //continue to next file block to read
+        if (new_data < size){
+            if (file_block->nNextBlock == 0){
+                break;
+            }
+            stats_add(&stats.chain_hops, 1);
+            block_pos = file_block->nNextBlock;
+            block_read(block_pos, file_block);
+            cur++;
+            start_block++;
+        }
+    }
+    if (new_data < size){
+        LOG_ERROR("file at block %ld: chain ends after %zu of %zu bytes", h->start / BLOCK_SIZE,
+                  offset + new_data, file_size);
+    }
+    h->cursor_index = cur;
+    h->cursor_pos = block_pos;
+
+    free(file_block);
+    return new_data;
+}
+
+
+
+// ============================================================================
+// ============================== cs1550_write() ==============================
+// ============================================================================
+static int file_write(struct cs1550_handle *h, const char *buf, size_t size, off_t offset);
+
+//make the size bytes at data all of h's inline file, in its entry and in h.
+//Returns 0, or -ENOSPC if the name area can't hold them.
+static int inline_store(struct cs1550_handle *h, const char *data, size_t size)
+{
+    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+    char bytes[MAX_NAME + INLINE_MAX];
+
+    block_read(h->dir_pos, dir_entry);
+    struct cs1550_file_directory *fe = &dir_entry->files[h->slot];
+    names_read(dir_entry->nNames, fe->name.nOffset, bytes, fe->name.nLength);
+    memcpy(bytes + fe->name.nLength, data, size);
+    fe->fsize = size;
+    int res = names_store(&dir_entry->nNames, dir_entry->files, sizeof(*fe), dir_entry->nFiles,
+                          h->slot, bytes, h->dir_pos / BLOCK_SIZE);
+    if (res == 0) {
+        meta_write(h->dir_pos, dir_entry);
+        memmove(h->data, data, size);
+        h->size = size;
+    }
+    free(dir_entry);
+    return res;
+}
+
+//move h's inline file into blocks laid out as its other flags say, before a
+//write takes it past INLINE_MAX. Returns 0 or -ENOSPC.
+static int inline_promote(struct cs1550_handle *h)
+{
+    cs1550_disk_block block;
+    size_t size = h->size;
+    long b = bitmap_alloc(h->dir_pos / BLOCK_SIZE);
+    if (b == -1) {
+        return -ENOSPC;
+    }
+    memset(&block, 0, sizeof(block));
+    block_write(b * BLOCK_SIZE, &block);
+
+    //write the data as to a new file of that layout
+    h->start = b * BLOCK_SIZE;
+    h->flags &= ~FILE_INLINE;
+    h->size = 0;
+    h->cursor_pos = 0;
+    if (size != 0 && file_write(h, h->data, size, 0) != (int) size) {
+        file_free(h->start, h->flags);
+        h->start = 0;
+        h->flags |= FILE_INLINE;
+        h->size = size;
+        h->cursor_pos = 0;
+        return -ENOSPC;
+    }
+
+    //then point the entry at it, and give the data's room back
+    cs1550_directory_entry * dir_entry = malloc(sizeof(cs1550_directory_entry));
+    block_read(h->dir_pos, dir_entry);
+    struct cs1550_file_directory *fe = &dir_entry->files[h->slot];
+    fe->nStartBlock = h->start | h->flags;
+    fe->fsize = h->size;
+    names_rewrite(&dir_entry->nNames, dir_entry->files, sizeof(*fe), dir_entry->nFiles, NULL,
+                  h->dir_pos / BLOCK_SIZE);
+    meta_write(h->dir_pos, dir_entry);
+    free(dir_entry);
+    h->dirty = 0;
+    LOG_DEBUG("inline file of %zu bytes moved to block %ld", size, b);
+    stats_add(&stats.inline_promoted, 1);
+    return 0;
+}
+
+//write size bytes from buf at offset of h's inline file, which they fit in
+static int inline_write(struct cs1550_handle *h, const char *buf, size_t size, off_t offset)
+{
+    char data[INLINE_MAX];
+    size_t new_size = (size_t) offset + size > h->size ? (size_t) offset + size : h->size;
+
+    memcpy(data, h->data, h->size);
+    memcpy(data + offset, buf, size);
+    int res = inline_store(h, data, new_size);
+    return res != 0 ? res : (int) size;
+}
+
+/* 
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+                        off_t offset, struct fuse_file_info *fi)
+{
+    LOG_DEBUG("%s size %zu offset %ld", path, size, (long) offset);
+
+    const char *rest;
+    if (strcmp(path, STATS_PATH) == 0) {
+        return -EACCES;
+    } else if (snap_path(path, &rest) != 0) {
+        return snap.root != 0 ? -EROFS : -ENOENT;
+    }
+
+    //find the file, through its handle if it is open
+    struct cs1550_handle tmp;
+    struct cs1550_handle *h;
+    int res = handle_get(path, fi, &tmp, &h);
+    if (res != 0) {
+        LOG_DEBUG("%s: %s", path, strerror(-res));
+        return res;
+    }
+
+    //if the file grew, an open file's entry is updated when it is flushed,
+    //anything else right away
+    res = file_write(h, buf, size, offset);
+    if (h == &tmp){
+        handle_sync(h);
+    }
+    return res;
+}
+
+//write size bytes from buf at offset of h's file
+static int file_write(struct cs1550_handle *h, const char *buf, size_t size, off_t offset)
+{
+    //check that size is > 0
+    if (size == 0){
+        LOG_DEBUG("file at block %ld: zero size", h->start / BLOCK_SIZE);
+        return 0;
+    }
+    //check that offset is <= to the file size
+    else if(offset > (off_t) h->size){
+        LOG_DEBUG("file at block %ld: offset beyond file size", h->start / BLOCK_SIZE);
+        return -EFBIG;
+    }
+    undo_handle(h);
+    if (h->flags & FILE_INLINE) {
+        if ((size_t) offset + size <= INLINE_MAX) {
+            return inline_write(h, buf, size, offset);
+        }
+        int res = inline_promote(h);
+        if (res != 0) {
+            return res;
+        }
+    }
+    if (h->flags & FILE_CHUNKED) {
+        return chunked_write(h, buf, size, offset);
+    }
+
+    cs1550_disk_block * file_block = malloc(sizeof(cs1550_disk_block));
+
+    //find the block where the first byte resides, from the cursor if it is
+    //on the way. When offset is the end of a full last block, that block
+    //doesn't exist yet; the write loop below links it in.
+    long start_block = offset/MAX_DATA_IN_BLOCK;    //the # of the block where we should write to. Start from block 0
+    int pos_in_block = offset%MAX_DATA_IN_BLOCK;    //byte position in the block of where we should write
+    long cur_block_pos;                             //byte position of the block in file_block
+    long cur = handle_seek(h, start_block, file_block, &cur_block_pos);   //number of current block
+    if (cur != start_block){
+        pos_in_block = MAX_DATA_IN_BLOCK;
+    }
+
+    size_t new_data = 0;  //total amount of new data being written
+    while (new_data < size){
+        //if current block is full, move on to the next one, creating it if needed
+        if (pos_in_block >= (int) MAX_DATA_IN_BLOCK){
+            long next_pos = file_block->nNextBlock;
+            int fresh = 0;                      //1 if next_pos was just allocated
+            if (next_pos == 0){
+                LOG_TRACE("creating new block");
+                //look for free block for new file
+                long newblock = bitmap_alloc(cur_block_pos / BLOCK_SIZE);
+                if (newblock == -1){
+                    LOG_WARN("file at block %ld: no free blocks", h->start / BLOCK_SIZE);
+                    break;
+                }
+                //link current block to newly allocated block
+                next_pos = newblock*512;
+                file_block->nNextBlock = next_pos;
+                fresh = 1;
+            }
+            //write full block to disk. A new link is metadata and goes
+            //through the journal.
+            if (fresh){
+                meta_write(cur_block_pos, file_block);
+            } else {
+                block_write(cur_block_pos, file_block);
+            }
+
+            //a new block may hold stale data from a deleted file, so start it empty
+            cur_block_pos = next_pos;
+            cur++;
+            if (fresh){
+                memset(file_block, 0, sizeof(cs1550_disk_block));
+            } else {
+                stats_add(&stats.chain_hops, 1);
+                block_read(cur_block_pos, file_block);
+            }
+            pos_in_block = 0;
+        }
+        //copy as much of buf as fits in the current block
+        size_t n = MAX_DATA_IN_BLOCK - pos_in_block;
+        if (n > size - new_data){
+            n = size - new_data;
+        }
+        memcpy(file_block->data + pos_in_block, buf + new_data, n);
+        LOG_TRACE("buf[%zu..%zu] -> block %ld data[%i]", new_data, new_data + n,
+                  cur_block_pos/512, pos_in_block);
+        new_data += n;
+        pos_in_block += n;
+    }
+    //write the last block touched
+    block_write(cur_block_pos, file_block);
+    h->cursor_index = cur;
+    h->cursor_pos = cur_block_pos;
+
+    //the file grew, its entry is updated when the handle is synced
+    if ((size_t) offset + new_data > h->size){
+        h->size = offset + new_data;
+        h->dirty = 1;
+    }
+    LOG_TRACE("file size %zu", h->size);
+
+    free(file_block);
+    if (new_data == 0){
+        return -ENOSPC;
+    }
+    return new_data;
+}
+
+/*
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is made shorter. We're not handling deleting files or 
+ * truncating existing ones, so all we need to do here is to initialize
+ * the appropriate directory entry.
+ *
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+    (void) path;
+    (void) size;
+    
+    return 0;
+}
+
+
+/* 
+ * Called when we open a file
+ *
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
+    LOG_DEBUG("%s", path);
+
+    //the stats file has no handle, reads of it go by path. It changes on
+    //its own, so it must bypass the page cache and its cached size
+    fi->fh = 0;
+    if (strcmp(path, STATS_PATH) == 0) {
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    //files in the snapshot can only be read
+    const char *rest;
+    int res = snap_path(path, &rest);
+    if (res != 0) {
+        if (res > 0 && (fi->flags & O_ACCMODE) != O_RDONLY) {
+            res = -EROFS;
+        } else if (res > 0) {
+            snap.view = 1;
+            res = cs1550_open(rest, fi);
+            snap.view = 0;
+        }
+        return res;
+    }
+
+    //if we can't find the desired file, return an error. One of the
+    //blocks on the way may have been bad, and the kernel won't see this
+    //open to release it.
+    struct cs1550_handle tmp;
+    res = handle_resolve(path, &tmp);
+    if (res != 0) {
+        return res;
+    } else if (fs_failed) {
+        return -fs_failed;
+    }
+
+    //share the handle of an open file, or make one
+    struct cs1550_handle *h = handle_share(&tmp);
+    h->refs++;
+    fi->fh = handle_fh(h);
+    
+    /* We're not going to worry about permissions for this project, but 
+     if we were and we don't have them to the file we should return an error
+     
+     return -EACCES;
+     */
+    
+    return 0; //success!
+}
+
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file 
+ * again. The file's size and the cached blocks are written back, the
+ * handle stays until release.
+ */
+static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+{
+    (void) path;
+
+    //write the size of an open file back to its entry
+    if (fi->fh != 0) {
+        struct cs1550_handle *h = handle_open(fi);
+        if (h == NULL) {
+            return -EBADF;
+        }
+        handle_sync(h);
+    }
+    wb_flush();
+    return 0; //success!
+}
+
+/*
+ * Called when the last file descriptor of an open is closed. Drop the open's
+ * reference to the handle.
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
+
+    if (fi->fh == 0) {
+        return 0;
+    }
+    struct cs1550_handle *h = handle_open(fi);
+    if (h == NULL) {
+        return -EBADF;
+    }
+    handle_sync(h);
+    h->refs--;
+    handle_drop(h);
+    fi->fh = 0;
+    return 0;
+}
+
+/*
+ * Called when fsync is called on a file. Write back the cache and commit
+ * the running batch, which syncs the data written so far along with it.
+ * The whole cache goes, not just the file's blocks: the commit needs all
+ * of them home first anyway.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) path;
+    (void) datasync;
+
+    //the size of an open file is part of what must be on disk
+    if (fi != NULL && fi->fh != 0) {
+        struct cs1550_handle *h = handle_open(fi);
+        if (h == NULL) {
+            return -EBADF;
+        }
+        handle_sync(h);
+    } else {
+        handles_sync();
+    }
+    wb_flush();
+    if (journal.nbufs != 0) {
+        journal_commit();
+    } else {
+        disk_sync();
+    }
+    return 0;
+}
+
+/*
+ * Called by statfs, e.g. for df. Everything comes from the counts in the
+ * superblock (see counts_load()), so it costs nothing but the lock. Entries
+ * are what inodes are: the most the root and its directories could hold,
+ * of which those not used yet are free, although a file can only be made
+ * in a directory that has room.
+ */
+static int cs1550_statfs(const char *path, struct statvfs *st)
+{
+    (void) path;
+    long entries = (long) MAX_DIRS_IN_ROOT * (1 + MAX_FILES_IN_DIR);
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = sb.nDataEnd - sb.nDataStart;
+    st->f_bfree = sb.nFreeBlocks;
+    st->f_bavail = sb.nFreeBlocks;
+    st->f_files = entries;
+    st->f_ffree = entries - sb.nDirs - sb.nFiles;
+    st->f_favail = st->f_ffree;
+    st->f_namemax = MAX_NAME;
+    return 0;
+}
+
+/*
+ * Called once the filesystem is mounted, after the process has gone to the
+ * background, so threads started here survive. Starts the flusher and the
+ * defragmenter.
+ */
+static void * cs1550_init(struct fuse_conn_info *conn)
+{
+    (void) conn;
+    wb_start();
+    defrag_start();
+    return NULL;
+}
+
+/*
+ * Called when the filesystem is unmounted. Stop the threads, commit what is
+ * left, close the image and the trace and save the statistics gathered
+ * during this mount.
+ */
+static void cs1550_destroy(void *private_data)
+{
+    (void) private_data;
+    defrag_stop();
+    wb_stop();
+    fs_enter();
+    handles_sync();
+    cs1550_unmount();
+    fs_leave(0);
+    trace_close();
+    stats_dump();
+}
+
+// ============================================================================
+// ============================ timed operations ==============================
+// ============================================================================
+/*
+ * Every entry in hello_oper goes through one of these so that its latency
+ * and result are recorded in the statistics, and in the trace if there is
+ * one. They also run the handlers one at a time, between fs_enter() and
+ * fs_leave().
+ */
+static int timed_getattr(const char *path, struct stat *stbuf)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_getattr(path, stbuf);
+    trace_record(OP_GETATTR, start, path, 0, 0, NULL);
+    res = fs_leave(res);
+    stats_record(OP_GETATTR, start, res);
+    return res;
+}
+
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_readdir(path, buf, filler, offset, fi);
+    trace_record(OP_READDIR, start, path, 0, offset, fi);
+    res = fs_leave(res);
+    stats_record(OP_READDIR, start, res);
+    return res;
+}
+
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_opendir(path, fi);
+    trace_record(OP_OPENDIR, start, path, 0, 0, fi);
+    res = fs_leave(res);
+    stats_record(OP_OPENDIR, start, res);
+    return res;
+}
+
+static int timed_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct fuse_file_info was = *fi;    //for the trace, fh is gone after
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_releasedir(path, fi);
+    trace_record(OP_RELEASEDIR, start, path, 0, 0, &was);
+    res = fs_leave(res);
+    stats_record(OP_RELEASEDIR, start, res);
+    return res;
+}
+
+static int timed_mkdir(const char *path, mode_t mode)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_mkdir(path, mode);
+    trace_record(OP_MKDIR, start, path, 0, 0, NULL);
+    res = fs_leave(res);
+    stats_record(OP_MKDIR, start, res);
+    return res;
+}
+
+static int timed_rmdir(const char *path)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_rmdir(path);
+    trace_record(OP_RMDIR, start, path, 0, 0, NULL);
+    res = fs_leave(res);
+    stats_record(OP_RMDIR, start, res);
+    return res;
+}
+
+static int timed_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_mknod(path, mode, dev);
+    trace_record(OP_MKNOD, start, path, 0, 0, NULL);
+    res = fs_leave(res);
+    stats_record(OP_MKNOD, start, res);
+    return res;
+}
+
+static int timed_unlink(const char *path)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_unlink(path);
+    trace_record(OP_UNLINK, start, path, 0, 0, NULL);
+    res = fs_leave(res);
+    stats_record(OP_UNLINK, start, res);
+    return res;
+}
+
+static int timed_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_read(path, buf, size, offset, fi);
+    trace_record(OP_READ, start, path, size, offset, fi);
+    res = fs_leave(res);
+    stats_record(OP_READ, start, res);
+    return res;
+}
+
+static int timed_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_write(path, buf, size, offset, fi);
+    trace_record(OP_WRITE, start, path, size, offset, fi);
+    res = fs_leave(res);
+    stats_record(OP_WRITE, start, res);
+    return res;
+}
+
+static int timed_truncate(const char *path, off_t size)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_truncate(path, size);
+    trace_record(OP_TRUNCATE, start, path, 0, size, NULL);
+    res = fs_leave(res);
+    stats_record(OP_TRUNCATE, start, res);
+    return res;
+}
+
+static int timed_open(const char *path, struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_open(path, fi);
+    trace_record(OP_OPEN, start, path, 0, 0, fi);
+    res = fs_leave(res);
+    stats_record(OP_OPEN, start, res);
+    return res;
+}
+
+static int timed_flush(const char *path, struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_flush(path, fi);
+    trace_record(OP_FLUSH, start, path, 0, 0, fi);
+    res = fs_leave(res);
+    stats_record(OP_FLUSH, start, res);
+    return res;
+}
+
+static int timed_release(const char *path, struct fuse_file_info *fi)
+{
+    struct fuse_file_info was = *fi;    //for the trace, fh is gone after
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_release(path, fi);
+    trace_record(OP_RELEASE, start, path, 0, 0, &was);
+    res = fs_leave(res);
+    stats_record(OP_RELEASE, start, res);
+    return res;
+}
+
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_fsync(path, datasync, fi);
+    trace_record(OP_FSYNC, start, path, datasync, 0, fi);
+    res = fs_leave(res);
+    stats_record(OP_FSYNC, start, res);
+    return res;
+}
+
+static int timed_statfs(const char *path, struct statvfs *st)
+{
+    unsigned long start = stats_now();
+    fs_enter();
+    int res = cs1550_statfs(path, st);
+    trace_record(OP_STATFS, start, path, 0, 0, NULL);
+    res = fs_leave(res);
+    stats_record(OP_STATFS, start, res);
+    return res;
 }
 
-
 //register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-    .rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-    .mknod	= cs1550_mknod,
-    .unlink = cs1550_unlink,
-    .truncate = cs1550_truncate,
-    .flush = cs1550_flush,
-    .open	= cs1550_open,
+CS1550_API struct fuse_operations hello_oper = {
+    .getattr	= timed_getattr,
+    .opendir	= timed_opendir,
+    .readdir	= timed_readdir,
+    .releasedir = timed_releasedir,
+    .mkdir	= timed_mkdir,
+    .rmdir = timed_rmdir,
+    .read	= timed_read,
+    .write	= timed_write,
+    .mknod	= timed_mknod,
+    .unlink = timed_unlink,
+    .truncate = timed_truncate,
+    .flush = timed_flush,
+    .release = timed_release,
+    .fsync = timed_fsync,
+    .statfs = timed_statfs,
+    .open	= timed_open,
+    .init = cs1550_init,
+    .destroy = cs1550_destroy,
+};
+
+/*
+ * Everything below is the FUSE entry point, which the tools don't have.
+ * cs1550_test.c keeps the low-level interface by defining CS1550_LL.
+ */
+#if !defined(CS1550_NO_MAIN) || defined(CS1550_LL)
+
+// ============================================================================
+// ============================ low-level interface ===========================
+// ============================================================================
+/*
+ * The mount runs on the low-level API: the kernel names the files of a call
+ * by the inode numbers our lookups gave it instead of by a path, so a call
+ * finds its file without parsing the path and looking each part of it up
+ * again. The numbers are
+ *
+ *   - FUSE_ROOT_ID for the root, LL_STATS_INO for /.stats and LL_SNAP_INO
+ *     for /.snapshot, the root of the snapshot
+ *   - LL_DIR_INO() of its index in the root for a directory, which never
+ *     changes since directories are never removed. The position of its
+ *     block is kept in ll_dirs once it is known.
+ *   - LL_FILE_INO() of its handle's entry in inodes for a file (see "open
+ *     files"), with the entry's generation. The lookup that finds the file
+ *     makes or shares the handle and it keeps its number until the kernel
+ *     forgets every lookup it was given, following the entry when unlink
+ *     moves it to another slot and the blocks when the defragmenter moves
+ *     them, which a number made from either couldn't. Entries don't hold
+ *     anything that lasts past the mount: the image has no room for one.
+ *     Opening the file takes another reference to the same handle.
+ *
+ * The kernel caches names, attributes and missing names for cache_timeout
+ * seconds (-o cache), and the pages of a file from one open to the next
+ * unless it is 0. Every change to a file or name reaches us as a call the
+ * kernel makes, which drops what it cached for it, so there is nothing to
+ * invalidate on top of that, except for /.stats: it changes with every
+ * call, so its attributes are never cached (see ll_timeout()) and it is
+ * opened with direct_io.
+ *
+ * Each ll_* function does the work of one call and returns 0 (or a count)
+ * or -errno, and the timed_ll_* callbacks run it between fs_enter() and
+ * ll_leave(), record it in the statistics and reply once the lock is
+ * dropped. The calls that don't need their inode (flush, release, fsync,
+ * statfs, init and destroy) go to hello_oper, which cs1550_bench and the
+ * tools keep calling.
+ */
+#define LL_STATS_INO 2
+#define LL_SNAP_INO  3
+#define LL_DIR_INO(slot, snapshot) (4 + (snapshot) * MAX_DIRS_IN_ROOT + (slot))
+#define LL_FILE_INO(index) (LL_DIR_INO(0, 2) + (index))
+
+//inode of the readdir entries other than ., which aren't known before they
+//are looked up, like the high-level API gives them without -o use_ino
+#define LL_UNKNOWN_INO 0xffffffff
+
+//seconds the kernel may cache what it was told, -o cache
+#define CACHE_TIMEOUT_SEC 60
+static double cache_timeout = CACHE_TIMEOUT_SEC;
+
+//what an inode number names
+struct ll_node
+{
+    enum { LL_ROOT, LL_STATS, LL_DIR, LL_FILE } kind;
+    int snapshot;                   //it is in the snapshot
+    int slot;                       //LL_DIR: its index in the root
+    struct cs1550_handle *h;        //LL_FILE: its handle
+};
+
+//block of each directory of the root and of the snapshot's root, 0 until known
+static long ll_dirs[2][MAX_DIRS_IN_ROOT];
+
+//what ino names, -ENOENT if it is in a snapshot that is gone and -ESTALE if
+//it isn't one we gave out, or names a file the kernel has forgotten
+static int ll_node(fuse_ino_t ino, struct ll_node *n)
+{
+    memset(n, 0, sizeof(*n));
+    if (ino == FUSE_ROOT_ID || ino == LL_SNAP_INO) {
+        n->kind = LL_ROOT;
+        n->snapshot = ino == LL_SNAP_INO;
+    } else if (ino == LL_STATS_INO) {
+        n->kind = LL_STATS;
+    } else if (ino < LL_DIR_INO(0, 0)) {
+        return -ESTALE;
+    } else if (ino < LL_DIR_INO(0, 2)) {
+        n->kind = LL_DIR;
+        n->snapshot = ino >= LL_DIR_INO(0, 1);
+        n->slot = ino - LL_DIR_INO(0, n->snapshot);
+    } else if (ino - LL_FILE_INO(0) < inodes_len && inodes[ino - LL_FILE_INO(0)].h != NULL) {
+        n->kind = LL_FILE;
+        n->h = inodes[ino - LL_FILE_INO(0)].h;
+        n->snapshot = n->h->snapshot;
+    } else {
+        return -ESTALE;
+    }
+    return n->snapshot && snap.root == 0 ? -ENOENT : 0;
+}
+
+//the block of the directory in slot of the root in view, 0 if there is none
+static long ll_dir_pos(int slot)
+{
+    long *pos = &ll_dirs[snap.view][slot];
+    if (*pos == 0) {
+        cs1550_root_directory root;
+        block_read(0, &root);
+        if (slot < root.nDirectories) {
+            *pos = root.directories[slot].nStartBlock;
+        }
+        //what a failed operation read is undone with it
+        if (fs_failed) {
+            long found = *pos;
+            *pos = 0;
+            return found;
+        }
+    }
+    return *pos;
+}
+
+//the attributes of inode ino, which n describes
+static void ll_stat(fuse_ino_t ino, const struct ll_node *n, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (n->kind == LL_STATS) {
+        stats_getattr(st);
+    } else if (n->kind == LL_FILE) {
+        st->st_mode = S_IFREG | 0666;
+        st->st_nlink = !n->h->unlinked;
+        st->st_size = n->h->size;
+    } else {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    }
+    //the snapshot is the image as it was, read-only
+    if (n->snapshot) {
+        st->st_mode &= ~0222;
+    }
+    st->st_ino = ino;
+}
+
+//seconds the kernel may keep what it is told about inode ino
+static double ll_timeout(fuse_ino_t ino)
+{
+    //its size changes with every call, a cached one would always be stale
+    return ino == LL_STATS_INO ? 0 : cache_timeout;
+}
+
+//fill in e for inode ino, which n describes
+static void ll_entry(struct fuse_entry_param *e, fuse_ino_t ino, const struct ll_node *n)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = ino;
+    if (n->kind == LL_FILE) {
+        e->generation = inodes[n->h->inode - 1].generation;
+    }
+    ll_stat(ino, n, &e->attr);
+    e->attr_timeout = ll_timeout(ino);
+    e->entry_timeout = ll_timeout(ino);
+}
+
+//put name into p, as the name of a directory if depth is 1 and of a file
+//if it is 2. Returns 0 or -ENAMETOOLONG.
+static int ll_name(const char *name, int depth, struct cs1550_path *p)
+{
+    int len;
+
+    p->depth = depth;
+    p->dir[0] = p->name[0] = '\0';
+    p->dir_len = p->name_len = 0;
+    if (depth == 1) {
+        len = path_take(&name, p->dir, &p->dir_hash);
+        p->dir_len = len;
+    } else {
+        len = path_take(&name, p->name, &p->name_hash);
+        p->name_len = len;
+    }
+    return len < 0 ? len : 0;
+}
+
+//the file in slot of dir, the directory block at dir_pos, as an inode for
+//the kernel: its handle, with a lookup taken on it
+static int ll_file(struct fuse_entry_param *e, const cs1550_directory_entry *dir, long dir_pos,
+                   int slot)
+{
+    struct cs1550_handle tmp;
+    struct ll_node n;
+
+    //the kernel won't see this lookup to forget it
+    if (fs_failed) {
+        return -EIO;
+    }
+    handle_load(&tmp, dir, dir_pos, slot);
+    memset(&n, 0, sizeof(n));
+    n.kind = LL_FILE;
+    n.snapshot = snap.view;
+    n.h = handle_share(&tmp);
+    n.h->lookups++;
+    inode_take(n.h);
+    ll_entry(e, LL_FILE_INO(n.h->inode - 1), &n);
+    return 0;
+}
+
+//the end of a call, see fs_leave()
+static int ll_leave(int res)
+{
+    snap.view = 0;
+    return fs_leave(res);
+}
+
+//the path of ino, or of name in it if name isn't NULL, into path, which
+//holds TRACE_PATH_MAX bytes, for the trace. Empty when there is no trace or
+//ino has no path any more, like a file that was unlinked.
+static void ll_path(fuse_ino_t ino, const char *name, char *path)
+{
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+    struct ll_node n;
+    char dname[MAX_NAME + 1] = "", fname[MAX_NAME + 1] = "";
+    int d = 0;
+
+    path[0] = '\0';
+    if (trace.out == NULL || ll_node(ino, &n) != 0
+        || (n.kind == LL_FILE && n.h->unlinked)) {
+        return;
+    }
+    int view = snap.view;
+    snap.view = n.snapshot;
+    if (n.kind == LL_DIR || n.kind == LL_FILE) {
+        block_read(0, &root);
+        if (n.kind == LL_DIR) {
+            d = n.slot;
+        } else {
+            while (d < root.nDirectories && root.directories[d].nStartBlock != n.h->dir_pos) {
+                d++;
+            }
+        }
+        if (d < root.nDirectories) {
+            names_read(root.nNames, root.directories[d].name.nOffset, dname,
+                       root.directories[d].name.nLength);
+            dname[root.directories[d].name.nLength] = '\0';
+        }
+        if (n.kind == LL_FILE) {
+            block_read(n.h->dir_pos, &dir);
+            names_read(dir.nNames, dir.files[n.h->slot].name.nOffset, fname,
+                       dir.files[n.h->slot].name.nLength);
+            fname[dir.files[n.h->slot].name.nLength] = '\0';
+        }
+    }
+    snap.view = view;
+
+    int len = snprintf(path, TRACE_PATH_MAX, "%s%s%s%s%s%s", n.snapshot ? SNAP_PATH : "",
+                       n.kind == LL_STATS ? STATS_PATH : "", dname[0] ? "/" : "", dname,
+                       fname[0] ? "/" : "", fname);
+    if (name != NULL) {
+        snprintf(path + len, TRACE_PATH_MAX - len, "/%s", name);
+    } else if (len == 0) {
+        strcpy(path, "/");
+    }
+}
+
+//reply to a call that finds or makes an entry
+static void ll_reply_entry(fuse_req_t req, int res, const struct fuse_entry_param *e)
+{
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_entry(req, e);
+    }
+}
+
+/*
+ * Find name in the directory parent.
+ */
+static int ll_lookup(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    struct ll_node dir, n;
+    struct cs1550_path p;
+    int res = ll_node(parent, &dir);
+    if (res != 0) {
+        return res;
+    }
+    snap.view = dir.snapshot;
+    memset(&n, 0, sizeof(n));
+    n.snapshot = dir.snapshot;
+
+    if (dir.kind == LL_ROOT) {
+        if (!dir.snapshot && strcmp(name, STATS_PATH + 1) == 0) {
+            n.kind = LL_STATS;
+            ll_entry(e, LL_STATS_INO, &n);
+            return 0;
+        } else if (!dir.snapshot && strcmp(name, SNAP_PATH + 1) == 0) {
+            n.kind = LL_ROOT;
+            n.snapshot = 1;
+            ll_entry(e, LL_SNAP_INO, &n);
+            return snap.root != 0 ? 0 : -ENOENT;
+        }
+        if ((res = ll_name(name, 1, &p)) != 0) {
+            return res;
+        }
+        cs1550_root_directory root;
+        block_read(0, &root);
+        int i = lookup_dir(&root, &p);
+        if (i == -1) {
+            return -ENOENT;
+        }
+        if (!fs_failed) {
+            ll_dirs[snap.view][i] = root.directories[i].nStartBlock;
+        }
+        n.kind = LL_DIR;
+        n.slot = i;
+        ll_entry(e, LL_DIR_INO(i, dir.snapshot), &n);
+        return 0;
+    } else if (dir.kind != LL_DIR) {
+        return -ENOTDIR;
+    }
+
+    if ((res = ll_name(name, 2, &p)) != 0) {
+        return res;
+    }
+    long dir_pos = ll_dir_pos(dir.slot);
+    if (dir_pos == 0) {
+        return -ENOENT;
+    }
+    cs1550_directory_entry dir_entry;
+    block_read(dir_pos, &dir_entry);
+    int j = lookup_file(&dir_entry, dir_pos, &p);
+    if (j == -1) {
+        return -ENOENT;
+    }
+    return ll_file(e, &dir_entry, dir_pos, j);
+}
+
+/*
+ * The kernel dropped nlookup of the lookups of ino. A file's handle goes
+ * with the last one, unless the file is open.
+ */
+static int ll_forget(fuse_ino_t ino, unsigned long nlookup)
+{
+    struct ll_node n;
+    //-ENOENT still names the file of a snapshot that is gone
+    ll_node(ino, &n);
+    if (n.kind == LL_FILE) {
+        n.h->lookups -= nlookup < n.h->lookups ? nlookup : n.h->lookups;
+        handle_drop(n.h);
+    }
+    return 0;
+}
+
+static int ll_getattr(fuse_ino_t ino, struct stat *st)
+{
+    struct ll_node n;
+    int res = ll_node(ino, &n);
+    if (res == 0) {
+        ll_stat(ino, &n, st);
+    }
+    return res;
+}
+
+/*
+ * Change the attributes of ino. Like truncate() there is nothing to do, the
+ * kernel gets them back as they are.
+ */
+static int ll_setattr(fuse_ino_t ino, struct stat *st)
+{
+    return ll_getattr(ino, st);
+}
+
+/*
+ * Make the file name in the directory parent.
+ */
+static int ll_mknod(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    struct ll_node dir;
+    struct cs1550_path p;
+    int res = ll_node(parent, &dir);
+    if (res != 0) {
+        return res;
+    } else if (dir.snapshot) {
+        return -EROFS;
+    } else if (dir.kind == LL_ROOT) {
+        //files can only be made in a subdirectory
+        return -EPERM;
+    } else if (dir.kind != LL_DIR) {
+        return -ENOTDIR;
+    } else if ((res = ll_name(name, 2, &p)) != 0) {
+        return res;
+    }
+
+    long dir_pos = ll_dir_pos(dir.slot);
+    if (dir_pos == 0) {
+        return -ENOENT;
+    }
+    if ((res = file_create(dir_pos, &p)) < 0) {
+        return res;
+    }
+    cs1550_directory_entry dir_entry;
+    block_read(dir_pos, &dir_entry);
+    return ll_file(e, &dir_entry, dir_pos, res);
+}
+
+/*
+ * Make the directory name in the root, or take a snapshot if it is
+ * .snapshot.
+ */
+static int ll_mkdir(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
+{
+    struct ll_node dir, n;
+    struct cs1550_path p;
+    int res = ll_node(parent, &dir);
+    if (res != 0) {
+        return res;
+    } else if (dir.snapshot) {
+        return -EROFS;
+    } else if (dir.kind == LL_DIR) {
+        //directories can only be made in the root
+        return -EPERM;
+    } else if (dir.kind != LL_ROOT) {
+        return -ENOTDIR;
+    }
+    memset(&n, 0, sizeof(n));
+
+    if (strcmp(name, SNAP_PATH + 1) == 0) {
+        handles_sync();
+        if ((res = snap_create()) != 0) {
+            return res;
+        }
+        memset(ll_dirs[1], 0, sizeof(ll_dirs[1]));
+        n.kind = LL_ROOT;
+        n.snapshot = 1;
+        ll_entry(e, LL_SNAP_INO, &n);
+        return 0;
+    } else if (strcmp(name, STATS_PATH + 1) == 0) {
+        return -EEXIST;
+    } else if ((res = ll_name(name, 1, &p)) != 0) {
+        return res;
+    } else if ((res = dir_create(&p)) < 0) {
+        return res;
+    }
+    n.kind = LL_DIR;
+    n.slot = res;
+    ll_entry(e, LL_DIR_INO(res, 0), &n);
+    return 0;
+}
+
+/*
+ * Remove the file name from the directory parent.
+ */
+static int ll_unlink(fuse_ino_t parent, const char *name)
+{
+    struct ll_node dir;
+    struct cs1550_path p;
+    int res = ll_node(parent, &dir);
+    if (res != 0) {
+        return res;
+    } else if (dir.snapshot) {
+        return -EROFS;
+    } else if (dir.kind == LL_ROOT) {
+        return strcmp(name, STATS_PATH + 1) == 0 ? -EACCES : -EISDIR;
+    } else if (dir.kind != LL_DIR) {
+        return -ENOTDIR;
+    } else if ((res = ll_name(name, 2, &p)) != 0) {
+        return res;
+    }
+
+    long dir_pos = ll_dir_pos(dir.slot);
+    if (dir_pos == 0) {
+        return -ENOENT;
+    }
+    cs1550_directory_entry dir_entry;
+    block_read(dir_pos, &dir_entry);
+    int j = lookup_file(&dir_entry, dir_pos, &p);
+    if (j == -1) {
+        return -ENOENT;
+    }
+    struct cs1550_handle file;
+    handle_load(&file, &dir_entry, dir_pos, j);
+    file_remove(&file);
+    return 0;
+}
+
+/*
+ * Remove the directory name from parent. Only .snapshot goes, which drops
+ * the snapshot; like cs1550_rmdir() the others are left as they are.
+ */
+static int ll_rmdir(fuse_ino_t parent, const char *name)
+{
+    struct ll_node dir;
+    int res = ll_node(parent, &dir);
+    if (res != 0) {
+        return res;
+    } else if (dir.snapshot) {
+        return -EROFS;
+    } else if (dir.kind == LL_ROOT && strcmp(name, SNAP_PATH + 1) == 0) {
+        if ((res = snap_remove()) == 0) {
+            memset(ll_dirs[1], 0, sizeof(ll_dirs[1]));
+        }
+        return res;
+    }
+    return 0;
+}
+
+/*
+ * Take a snapshot of the directory ino into a new cursor.
+ */
+static int ll_list(fuse_ino_t ino, struct cs1550_dir_cursor **c)
+{
+    struct ll_node n;
+    int res = ll_node(ino, &n);
+    if (res != 0) {
+        return res;
+    } else if (n.kind == LL_FILE || n.kind == LL_STATS) {
+        return -ENOTDIR;
+    }
+    snap.view = n.snapshot;
+
+    if (n.kind == LL_ROOT) {
+        *c = root_list();
+    } else {
+        long dir_pos = ll_dir_pos(n.slot);
+        if (dir_pos == 0) {
+            return -ENOENT;
+        }
+        *c = dir_list(dir_pos);
+    }
+    //a block that failed its checksum fails the whole call, see fs_leave()
+    if (fs_failed) {
+        free(*c);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int ll_opendir(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct cs1550_dir_cursor *c;
+    int res = ll_list(ino, &c);
+    fi->fh = res == 0 ? (unsigned long) c : 0;
+    return res;
+}
+
+/*
+ * Put the entries of the cursor in fi from offset into buf, which holds size
+ * bytes, as cs1550_readdir() does. Returns how many bytes they took.
+ */
+static int ll_readdir(fuse_req_t req, fuse_ino_t ino, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    struct cs1550_dir_cursor *c = (struct cs1550_dir_cursor *) (unsigned long) fi->fh;
+    int res;
+
+    //rewinddir, start again from what is there now
+    if (offset == 0 && c->read) {
+        struct cs1550_dir_cursor *fresh;
+        if ((res = ll_list(ino, &fresh)) != 0) {
+            return res;
+        }
+        free(c);
+        c = fresh;
+        fi->fh = (unsigned long) c;
+    }
+    c->read = 1;
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    size_t used = 0;
+    off_t i;
+    for (i = offset; i >= 0 && i < c->count; i++) {
+        st.st_ino = i == 0 ? ino : LL_UNKNOWN_INO;
+        st.st_mode = c->entries[i].mode;
+        size_t len = fuse_add_direntry(req, buf + used, size - used, c->entries[i].name, &st, i + 1);
+        if (len > size - used) {
+            break;
+        }
+        used += len;
+    }
+    return used;
+}
+
+static int ll_releasedir(struct fuse_file_info *fi)
+{
+    free((struct cs1550_dir_cursor *) (unsigned long) fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+/*
+ * Open ino: its handle goes into fi->fh, as with cs1550_open().
+ */
+static int ll_open(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct ll_node n;
+    int res = ll_node(ino, &n);
+
+    fi->fh = 0;
+    if (res != 0) {
+        return res;
+    } else if (n.kind == LL_STATS) {
+        //it changes on its own, so it must bypass the page cache
+        fi->direct_io = 1;
+        return 0;
+    } else if (n.kind != LL_FILE) {
+        return -EISDIR;
+    } else if (n.h->unlinked) {
+        return -ENOENT;
+    } else if (n.snapshot && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+    n.h->refs++;
+    fi->fh = handle_fh(n.h);
+    fi->keep_cache = cache_timeout > 0;
+    return 0;
+}
+
+//the handle of the open of ino in fi, NULL if fi->fh isn't one of ino's
+static struct cs1550_handle * ll_handle(fuse_ino_t ino, const struct fuse_file_info *fi)
+{
+    struct cs1550_handle *h = handle_open(fi);
+    return h != NULL && LL_FILE_INO(h->inode - 1) == ino ? h : NULL;
+}
+
+static int ll_read(fuse_ino_t ino, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct cs1550_handle *h = ll_handle(ino, fi);
+    if (ino == LL_STATS_INO) {
+        return stats_read(buf, size, offset);
+    } else if (h == NULL) {
+        return -EBADF;
+    } else if (h->unlinked) {
+        //unlinked while open, its blocks are gone
+        return -ENOENT;
+    }
+    snap.view = h->snapshot;
+    return file_read(h, buf, size, offset);
+}
+
+static int ll_write(fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    struct cs1550_handle *h = ll_handle(ino, fi);
+    if (ino == LL_STATS_INO) {
+        return -EACCES;
+    } else if (h == NULL) {
+        return -EBADF;
+    } else if (h->unlinked) {
+        return -ENOENT;
+    }
+    return file_write(h, buf, size, offset);
+}
+
+static void timed_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[TRACE_PATH_MAX];
+    struct fuse_entry_param e;
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(parent, name, path);
+    int res = ll_lookup(parent, name, &e);
+    trace_record(OP_LOOKUP, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_LOOKUP, start, res);
+    //a missing name is cached too
+    if (res == -ENOENT && cache_timeout > 0) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = cache_timeout;
+        res = 0;
+    }
+    ll_reply_entry(req, res, &e);
+}
+
+static void timed_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    char path[TRACE_PATH_MAX];
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_forget(ino, nlookup);
+    trace_record(OP_FORGET, start, path, nlookup, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_FORGET, start, res);
+    fuse_reply_none(req);
+}
+
+static void timed_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    struct stat st;
+    (void) fi;
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_getattr(ino, &st);
+    trace_record(OP_GETATTR, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_GETATTR, start, res);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_attr(req, &st, ll_timeout(ino));
+    }
+}
+
+static void timed_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                             struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    struct stat st;
+    (void) attr;
+    (void) to_set;
+    (void) fi;
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_setattr(ino, &st);
+    trace_record(OP_SETATTR, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_SETATTR, start, res);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_attr(req, &st, ll_timeout(ino));
+    }
+}
+
+static void timed_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                           dev_t rdev)
+{
+    char path[TRACE_PATH_MAX];
+    struct fuse_entry_param e;
+    (void) mode;
+    (void) rdev;
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(parent, name, path);
+    int res = ll_mknod(parent, name, &e);
+    trace_record(OP_MKNOD, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_MKNOD, start, res);
+    ll_reply_entry(req, res, &e);
+}
+
+static void timed_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    char path[TRACE_PATH_MAX];
+    struct fuse_entry_param e;
+    (void) mode;
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(parent, name, path);
+    int res = ll_mkdir(parent, name, &e);
+    trace_record(OP_MKDIR, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_MKDIR, start, res);
+    ll_reply_entry(req, res, &e);
+}
+
+static void timed_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[TRACE_PATH_MAX];
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(parent, name, path);
+    int res = ll_unlink(parent, name);
+    trace_record(OP_UNLINK, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_UNLINK, start, res);
+    fuse_reply_err(req, -res);
+}
+
+static void timed_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[TRACE_PATH_MAX];
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(parent, name, path);
+    int res = ll_rmdir(parent, name);
+    trace_record(OP_RMDIR, start, path, 0, 0, NULL);
+    res = ll_leave(res);
+    stats_record(OP_RMDIR, start, res);
+    fuse_reply_err(req, -res);
+}
+
+static void timed_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_opendir(ino, fi);
+    trace_record(OP_OPENDIR, start, path, 0, 0, fi);
+    res = ll_leave(res);
+    stats_record(OP_OPENDIR, start, res);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void timed_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                             struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    char *buf = malloc(size);
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_readdir(req, ino, buf, size, offset, fi);
+    trace_record(OP_READDIR, start, path, 0, offset, fi);
+    res = ll_leave(res);
+    stats_record(OP_READDIR, start, res);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_buf(req, buf, res);
+    }
+    free(buf);
+}
+
+static void timed_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    struct fuse_file_info was = *fi;    //for the trace, fh is gone after
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_releasedir(fi);
+    trace_record(OP_RELEASEDIR, start, path, 0, 0, &was);
+    res = ll_leave(res);
+    stats_record(OP_RELEASEDIR, start, res);
+    fuse_reply_err(req, -res);
+}
+
+static void timed_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_open(ino, fi);
+    trace_record(OP_OPEN, start, path, 0, 0, fi);
+    res = ll_leave(res);
+    stats_record(OP_OPEN, start, res);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void timed_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                          struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    char *buf = malloc(size);
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_read(ino, buf, size, offset, fi);
+    trace_record(OP_READ, start, path, size, offset, fi);
+    res = ll_leave(res);
+    stats_record(OP_READ, start, res);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_buf(req, buf, res);
+    }
+    free(buf);
+}
+
+static void timed_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                           off_t offset, struct fuse_file_info *fi)
+{
+    char path[TRACE_PATH_MAX];
+    unsigned long start = stats_now();
+    fs_enter();
+    ll_path(ino, NULL, path);
+    int res = ll_write(ino, buf, size, offset, fi);
+    trace_record(OP_WRITE, start, path, size, offset, fi);
+    res = ll_leave(res);
+    stats_record(OP_WRITE, start, res);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_write(req, res);
+    }
+}
+
+static void timed_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    fuse_reply_err(req, -hello_oper.flush(NULL, fi));
+}
+
+static void timed_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void) ino;
+    fuse_reply_err(req, -hello_oper.release(NULL, fi));
+}
+
+static void timed_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    (void) ino;
+    fuse_reply_err(req, -hello_oper.fsync(NULL, datasync, fi));
+}
+
+static void timed_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+    (void) ino;
+    int res = hello_oper.statfs(NULL, &st);
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+    } else {
+        fuse_reply_statfs(req, &st);
+    }
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+    hello_oper.init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+    hello_oper.destroy(userdata);
+}
+
+CS1550_API struct fuse_lowlevel_ops ll_oper = {
+    .init       = ll_init,
+    .destroy    = ll_destroy,
+    .lookup     = timed_ll_lookup,
+    .forget     = timed_ll_forget,
+    .getattr    = timed_ll_getattr,
+    .setattr    = timed_ll_setattr,
+    .mknod      = timed_ll_mknod,
+    .mkdir      = timed_ll_mkdir,
+    .unlink     = timed_ll_unlink,
+    .rmdir      = timed_ll_rmdir,
+    .opendir    = timed_ll_opendir,
+    .readdir    = timed_ll_readdir,
+    .releasedir = timed_ll_releasedir,
+    .open       = timed_ll_open,
+    .read       = timed_ll_read,
+    .write      = timed_ll_write,
+    .flush      = timed_ll_flush,
+    .release    = timed_ll_release,
+    .fsync      = timed_ll_fsync,
+    .statfs     = timed_ll_statfs,
+};
+#endif
+
+#ifndef CS1550_NO_MAIN
+/*
+ * Mount options understood by this filesystem, on top of the usual FUSE ones:
+ *
+ *   -o loglevel=N      0 = error, 1 = warn (default), 2 = info, 3 = debug, 4 = trace
+ *   -o disk=PATH       image to mount (default .disk in the current directory)
+ *   -o fsck=MODE       off, check (default: refuse to mount a damaged image)
+ *                      or repair
+ *   -o commit=SEC      commit metadata to the journal at least every SEC
+ *                      seconds (default 5, 0 = after every operation)
+ *   -o compress        compress the files made while mounted; files keep
+ *                      the format they were made with
+ *   -o dedup           share identical chunks between the files made while
+ *                      mounted
+ *   -o cache=SEC       let the kernel keep names and attributes for SEC
+ *                      seconds and file pages from one open to the next
+ *                      (default 60, 0 = ask on every access)
+ *   -o defrag=N        move fragmented files into contiguous blocks in the
+ *                      background, at most N blocks a second (default 0 =
+ *                      don't)
+ *   -o dirty=N         keep at most N written blocks in memory before they
+ *                      go to disk (default 4096, 0 = write them right away)
+ *   -o writeback=SEC   write cached blocks back once they are SEC seconds
+ *                      old (default 1)
+ *   -o trace=FILE      record every call in FILE, for cs1550_replay
+ *
+ * The image is only ever changed through the mount, and the kernel drops
+ * what it has cached for a name or file when it sends us the mknod, unlink,
+ * write or truncate that changes it, so long timeouts don't make it stale.
+ * The one thing that changes on its own is /.stats, whose attributes are
+ * never cached and which is opened with direct_io.
+ */
+struct cs1550_options
+{
+    int loglevel;
+    char *disk;
+    char *fsck;
+    int commit;
+    int compress;
+    int dedup;
+    int cache;
+    int defrag;
+    int dirty;
+    int writeback;
+    char *trace;
+};
+
+#define CS1550_OPT(t, p) { t, offsetof(struct cs1550_options, p), 1 }
+
+static struct fuse_opt cs1550_opts[] = {
+    CS1550_OPT("loglevel=%d", loglevel),
+    CS1550_OPT("disk=%s", disk),
+    CS1550_OPT("fsck=%s", fsck),
+    CS1550_OPT("commit=%d", commit),
+    CS1550_OPT("compress", compress),
+    CS1550_OPT("dedup", dedup),
+    CS1550_OPT("cache=%d", cache),
+    CS1550_OPT("defrag=%d", defrag),
+    CS1550_OPT("dirty=%d", dirty),
+    CS1550_OPT("writeback=%d", writeback),
+    CS1550_OPT("trace=%s", trace),
+    FUSE_OPT_END
 };
 
-//Don't change this.
 int main(int argc, char *argv[])
 {
-    return fuse_main(argc, argv, &hello_oper, NULL);
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct cs1550_options options;
+
+    memset(&options, 0, sizeof(options));
+    options.loglevel = log_level;
+    options.commit = JOURNAL_COMMIT_SEC;
+    options.cache = CACHE_TIMEOUT_SEC;
+    options.dirty = WB_DIRTY_BLOCKS;
+    options.writeback = WRITEBACK_SEC;
+    if (fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1) {
+        return 1;
+    }
+    if (options.loglevel < LOG_LEVEL_ERROR || options.loglevel > LOG_LEVEL_TRACE) {
+        fprintf(stderr, "cs1550: loglevel must be between %d and %d\n",
+                LOG_LEVEL_ERROR, LOG_LEVEL_TRACE);
+        return 1;
+    }
+    if (options.loglevel > CS1550_LOG_MAX) {
+        fprintf(stderr, "cs1550: loglevel %d is not compiled in, using %d\n",
+                options.loglevel, CS1550_LOG_MAX);
+        options.loglevel = CS1550_LOG_MAX;
+    }
+    log_level = options.loglevel;
+    if (options.commit < 0) {
+        fprintf(stderr, "cs1550: commit must be 0 or more seconds\n");
+        return 1;
+    }
+    journal_commit_ns = options.commit * 1000000000UL;
+    compress_files = options.compress;
+    dedup_files = options.dedup;
+    if (options.defrag < 0) {
+        fprintf(stderr, "cs1550: defrag must be 0 or more blocks a second\n");
+        return 1;
+    }
+    defrag.rate = options.defrag;
+    if (options.dirty < 0) {
+        fprintf(stderr, "cs1550: dirty must be 0 or more blocks\n");
+        return 1;
+    }
+    wb.max = options.dirty;
+    if (options.writeback < 1) {
+        fprintf(stderr, "cs1550: writeback must be 1 or more seconds\n");
+        return 1;
+    }
+    wb.age_ns = options.writeback * 1000000000UL;
+    if (options.cache < 0) {
+        fprintf(stderr, "cs1550: cache must be 0 or more seconds\n");
+        return 1;
+    }
+
+    cache_timeout = options.cache;
+
+    int fsck_mode = FSCK_CHECK;
+    if (options.fsck == NULL || strcmp(options.fsck, "check") == 0) {
+        fsck_mode = FSCK_CHECK;
+    } else if (strcmp(options.fsck, "off") == 0) {
+        fsck_mode = FSCK_OFF;
+    } else if (strcmp(options.fsck, "repair") == 0) {
+        fsck_mode = FSCK_FIX;
+    } else {
+        fprintf(stderr, "cs1550: fsck must be off, check or repair\n");
+        return 1;
+    }
+
+    //fuse_daemonize changes to / when it goes to the background, so hold on to
+    //the image by its absolute path
+    char *disk = realpath(options.disk != NULL ? options.disk : disk_path, NULL);
+    if (disk == NULL) {
+        fprintf(stderr, "cs1550: %s: %s\n", options.disk != NULL ? options.disk : disk_path,
+                strerror(errno));
+        return 1;
+    }
+    disk_path = disk;
+
+    //what fuse_main would do, with ll_oper
+    char *mountpoint;
+    int multithreaded, foreground;
+    int res;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+    if (mountpoint == NULL) {
+        fprintf(stderr, "cs1550: no mountpoint given\n");
+        return 1;
+    }
+    if (cs1550_mount(fsck_mode, NULL) != 0) {
+        return 1;
+    }
+    //opened here, fuse_daemonize changes to / after
+    if (options.trace != NULL && (res = trace_open(options.trace)) != 0) {
+        fprintf(stderr, "cs1550: %s: %s\n", options.trace, strerror(-res));
+        cs1550_unmount();
+        return 1;
+    }
+
+    res = 1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL) {
+        cs1550_unmount();
+        trace_close();
+        return 1;
+    }
+    struct fuse_session *se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            fuse_session_add_chan(se, ch);
+            if (fuse_daemonize(foreground) != -1) {
+                res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+            }
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        //calls ll_destroy, if the kernel got as far as ll_init
+        fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return res != 0;
 }
+#endif
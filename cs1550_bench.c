@@ -0,0 +1,384 @@
+/*
+ * Benchmarks for the cs1550 filesystem operations.
+ *
+ * Formats a fresh .disk in a scratch directory and calls the handlers in
+ * hello_oper directly, in-process, so no FUSE mount is needed. Files are
+ * opened before they are read or written, as the kernel would. Each
+ * benchmark prints one JSON object per line:
+ *
+ *   {"bench":"seq_read","ops":2560,"bytes":10485760,"seconds":0.0123,
+ *    "mb_per_s":812.3,"ops_per_s":208000,"p50_us":4.1,"p99_us":9.8,"max_us":31.0}
+ *
+ * Build it next to cs1550.c with the same flags, e.g.
+ *
+ *   gcc -Wall -O2 -DNDEBUG `pkg-config fuse --cflags` cs1550_bench.c -o cs1550_bench `pkg-config fuse --libs`
+ *
+ * Usage: cs1550_bench [-c] [-D] [-d scratch_dir] [-n iterations] [-s file_kb] [-o output_file]
+ *
+ * -c makes the files compressed and -D deduplicated, as mounting with
+ * -o compress and -o dedup does.
+ */
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+//size of one read/write call, what the kernel usually sends
+#define BENCH_IO_SIZE 4096
+
+//blocks in the formatted image, the size of the standard 5MB .disk
+#define BENCH_DISK_BLOCKS 10240
+
+struct bench_result
+{
+    const char *name;
+    unsigned long *lat_ns;      //latency of each op
+    unsigned long ops;
+    unsigned long bytes;
+    unsigned long elapsed_ns;
+};
+
+static FILE *bench_out;
+static unsigned long bench_rand_state = 88172645463325252UL;
+
+//xorshift64, so every run reads the same offsets
+static unsigned long bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+static void bench_die(const char *what, int res)
+{
+    fprintf(stderr, "cs1550_bench: %s failed: %s\n", what, strerror(res < 0 ? -res : res));
+    exit(1);
+}
+
+//fill buf with bytes that depend on their position in the file
+static void bench_pattern(char *buf, size_t size, off_t offset)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = (char) ((offset + i) * 31 + 7);
+    }
+}
+
+static void bench_check(const char *buf, size_t size, off_t offset)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        if (buf[i] != (char) ((offset + i) * 31 + 7)) {
+            fprintf(stderr, "cs1550_bench: bad data at offset %ld\n", (long) (offset + i));
+            exit(1);
+        }
+    }
+}
+
+static void bench_begin(struct bench_result *r, const char *name, unsigned long max_ops)
+{
+    r->name = name;
+    r->lat_ns = malloc(max_ops * sizeof(unsigned long));
+    r->ops = 0;
+    r->bytes = 0;
+    r->elapsed_ns = 0;
+}
+
+//time one op, started at start
+static void bench_op(struct bench_result *r, unsigned long start, unsigned long bytes)
+{
+    unsigned long ns = stats_now() - start;
+    r->lat_ns[r->ops++] = ns;
+    r->elapsed_ns += ns;
+    r->bytes += bytes;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double bench_pct_us(struct bench_result *r, int pct)
+{
+    unsigned long i = (r->ops * pct + 99) / 100;
+    if (i > 0) {
+        i--;
+    }
+    return r->lat_ns[i] / 1000.0;
+}
+
+static void bench_end(struct bench_result *r)
+{
+    double secs = r->elapsed_ns / 1e9;
+
+    qsort(r->lat_ns, r->ops, sizeof(unsigned long), bench_cmp);
+    fprintf(bench_out, "{\"bench\":\"%s\",\"ops\":%lu,\"bytes\":%lu,\"seconds\":%.6f,"
+            "\"mb_per_s\":%.2f,\"ops_per_s\":%.0f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+            r->name, r->ops, r->bytes, secs,
+            secs > 0 ? r->bytes / secs / 1e6 : 0.0, secs > 0 ? r->ops / secs : 0.0,
+            bench_pct_us(r, 50), bench_pct_us(r, 99),
+            r->ops ? r->lat_ns[r->ops - 1] / 1000.0 : 0.0);
+    fflush(bench_out);
+    free(r->lat_ns);
+}
+
+//open path like the kernel does before reading or writing it
+static void bench_open(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+    memset(fi, 0, sizeof(*fi));
+    if ((res = hello_oper.open(path, fi)) < 0) {
+        bench_die("open", res);
+    }
+}
+
+//create path and fill it with size bytes of the test pattern, untimed
+static void bench_make_file(const char *path, size_t size)
+{
+    char buf[BENCH_IO_SIZE];
+    size_t done;
+    int res;
+
+    if ((res = hello_oper.mknod(path, S_IFREG | 0644, 0)) < 0) {
+        bench_die("mknod", res);
+    }
+    for (done = 0; done < size; done += BENCH_IO_SIZE) {
+        size_t n = size - done < BENCH_IO_SIZE ? size - done : BENCH_IO_SIZE;
+        bench_pattern(buf, n, done);
+        if ((res = hello_oper.write(path, buf, n, done, NULL)) < 0) {
+            bench_die("write", res);
+        }
+    }
+}
+
+static void bench_seq_write(int iters, size_t file_size)
+{
+    struct bench_result r;
+    char buf[BENCH_IO_SIZE];
+
+    struct fuse_file_info fi;
+    int it;
+
+    bench_begin(&r, "seq_write", iters * (file_size / BENCH_IO_SIZE + 1));
+    for (it = 0; it < iters; it++) {
+        size_t done;
+        hello_oper.mknod("/bench/seq.dat", S_IFREG | 0644, 0);
+        bench_open("/bench/seq.dat", &fi);
+        for (done = 0; done < file_size; done += BENCH_IO_SIZE) {
+            size_t n = file_size - done < BENCH_IO_SIZE ? file_size - done : BENCH_IO_SIZE;
+            bench_pattern(buf, n, done);
+            unsigned long start = stats_now();
+            int res = hello_oper.write("/bench/seq.dat", buf, n, done, &fi);
+            bench_op(&r, start, n);
+            if (res != (int) n) {
+                bench_die("write", res);
+            }
+        }
+        hello_oper.release("/bench/seq.dat", &fi);
+        if (it != iters - 1) {
+            hello_oper.unlink("/bench/seq.dat");
+        }
+    }
+    bench_end(&r);
+}
+
+static void bench_seq_read(int iters, size_t file_size)
+{
+    struct bench_result r;
+    char buf[BENCH_IO_SIZE];
+    struct fuse_file_info fi;
+    int it;
+
+    bench_begin(&r, "seq_read", iters * (file_size / BENCH_IO_SIZE + 1));
+    for (it = 0; it < iters; it++) {
+        size_t done;
+        bench_open("/bench/seq.dat", &fi);
+        for (done = 0; done < file_size; done += BENCH_IO_SIZE) {
+            unsigned long start = stats_now();
+            int res = hello_oper.read("/bench/seq.dat", buf, BENCH_IO_SIZE, done, &fi);
+            bench_op(&r, start, res > 0 ? res : 0);
+            if (res < 0) {
+                bench_die("read", res);
+            }
+            bench_check(buf, res, done);
+        }
+        hello_oper.release("/bench/seq.dat", &fi);
+    }
+    bench_end(&r);
+}
+
+static void bench_rand_read(int iters, size_t file_size)
+{
+    struct bench_result r;
+    char buf[BENCH_IO_SIZE];
+    unsigned long ops = iters * (file_size / BENCH_IO_SIZE + 1);
+    unsigned long i;
+    struct fuse_file_info fi;
+
+    bench_begin(&r, "rand_read", ops);
+    bench_open("/bench/seq.dat", &fi);
+    for (i = 0; i < ops; i++) {
+        off_t offset = bench_rand() % (file_size - BENCH_IO_SIZE + 1);
+        unsigned long start = stats_now();
+        int res = hello_oper.read("/bench/seq.dat", buf, BENCH_IO_SIZE, offset, &fi);
+        bench_op(&r, start, res > 0 ? res : 0);
+        if (res != BENCH_IO_SIZE) {
+            bench_die("read", res);
+        }
+        bench_check(buf, res, offset);
+    }
+    hello_oper.release("/bench/seq.dat", &fi);
+    bench_end(&r);
+}
+
+//grow a file one small write at a time, like a log
+static void bench_append(int iters, size_t file_size)
+{
+    struct bench_result r;
+    char buf[BENCH_IO_SIZE];
+    size_t chunk = 512;
+    struct fuse_file_info fi;
+    int it;
+
+    bench_begin(&r, "append", iters * (file_size / chunk + 1));
+    for (it = 0; it < iters; it++) {
+        size_t done;
+        hello_oper.mknod("/bench/log.txt", S_IFREG | 0644, 0);
+        bench_open("/bench/log.txt", &fi);
+        for (done = 0; done < file_size; done += chunk) {
+            bench_pattern(buf, chunk, done);
+            unsigned long start = stats_now();
+            int res = hello_oper.write("/bench/log.txt", buf, chunk, done, &fi);
+            bench_op(&r, start, chunk);
+            if (res != (int) chunk) {
+                bench_die("write", res);
+            }
+        }
+        hello_oper.release("/bench/log.txt", &fi);
+        hello_oper.unlink("/bench/log.txt");
+    }
+    bench_end(&r);
+}
+
+//create and delete small files over and over
+static void bench_churn(int iters)
+{
+    struct bench_result r;
+    char path[32];
+    int ops = iters * 200;
+    int i, res;
+
+    bench_begin(&r, "create_unlink", ops);
+    for (i = 0; i < ops; i += 2) {
+        snprintf(path, sizeof(path), "/churn/f%d.tmp", (i / 2) % 8);
+        unsigned long start = stats_now();
+        res = hello_oper.mknod(path, S_IFREG | 0644, 0);
+        bench_op(&r, start, 0);
+        if (res < 0) {
+            bench_die("mknod", res);
+        }
+        start = stats_now();
+        res = hello_oper.unlink(path);
+        bench_op(&r, start, 0);
+        if (res < 0) {
+            bench_die("unlink", res);
+        }
+    }
+    bench_end(&r);
+}
+
+//getattr on a mix of directories, files and missing names
+static void bench_stat(int iters)
+{
+    static const char *paths[] = {
+        "/", "/bench", "/bench/seq.dat", "/stat/s0.txt", "/stat/s7.txt", "/stat/none.txt", "/none"
+    };
+    struct bench_result r;
+    struct stat st;
+    int npaths = sizeof(paths) / sizeof(paths[0]);
+    int ops = iters * 2000;
+    char path[32];
+    int i;
+
+    hello_oper.mkdir("/stat", 0755);
+    for (i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path), "/stat/s%d.txt", i);
+        bench_make_file(path, 100);
+    }
+
+    bench_begin(&r, "stat", ops);
+    for (i = 0; i < ops; i++) {
+        unsigned long start = stats_now();
+        hello_oper.getattr(paths[i % npaths], &st);
+        bench_op(&r, start, 0);
+    }
+    bench_end(&r);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: cs1550_bench [-c] [-D] [-d scratch_dir] [-n iterations] [-s file_kb] [-o output_file]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char scratch[] = "/tmp/cs1550_bench.XXXXXX";
+    const char *dir = NULL;
+    const char *out = NULL;
+    int iters = 5;
+    size_t file_size = 1024 * 1024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cDd:n:s:o:")) != -1) {
+        switch (opt) {
+        case 'c': compress_files = 1; break;
+        case 'D': dedup_files = 1; break;
+        case 'd': dir = optarg; break;
+        case 'n': iters = atoi(optarg); break;
+        case 's': file_size = (size_t) atol(optarg) * 1024; break;
+        case 'o': out = optarg; break;
+        default: usage();
+        }
+    }
+    if (iters <= 0 || file_size < BENCH_IO_SIZE) {
+        usage();
+    }
+
+    bench_out = stdout;
+    if (out != NULL && (bench_out = fopen(out, "w")) == NULL) {
+        bench_die(out, errno);
+    }
+    if (dir == NULL && (dir = mkdtemp(scratch)) == NULL) {
+        bench_die("mkdtemp", errno);
+    }
+    if (chdir(dir) != 0) {
+        bench_die(dir, errno);
+    }
+
+    log_level = LOG_LEVEL_ERROR;
+    int res = cs1550_format(disk_path, BENCH_DISK_BLOCKS, -1);
+    if (res != 0 || (res = cs1550_mount(FSCK_OFF, NULL)) != 0) {
+        bench_die("formatting .disk", res);
+    }
+    hello_oper.mkdir("/bench", 0755);
+    hello_oper.mkdir("/churn", 0755);
+
+    bench_seq_write(iters, file_size);
+    bench_seq_read(iters, file_size);
+    bench_rand_read(iters, file_size);
+    bench_append(iters, file_size / 4);
+    bench_churn(iters);
+    bench_stat(iters);
+
+    hello_oper.destroy(NULL);
+    if (bench_out != stdout) {
+        fclose(bench_out);
+    }
+    return 0;
+}
@@ -0,0 +1,484 @@
+/*
+ * Crash test for the cs1550 journal and write-back cache.
+ *
+ * Formats a fresh .disk in a scratch directory and runs a workload against
+ * it in-process through hello_oper, like cs1550_bench: files are created,
+ * written, grown out of their inline data, appended to and unlinked, and
+ * now and then one is written, fsync'd and then left alone. Next to those
+ * long named files come and go, so the inline data of fsync'd files moves
+ * in its directory's name area, which grows and shrinks. (Nothing turns a
+ * file back into an inline one: truncate does nothing, so a file only ever
+ * leaves its inline data.) Every write to
+ * the image goes through crash_pwrite(), which first copies the image as
+ * it is at that point: what the disk holds if the machine goes down right
+ * before the write, with every earlier one landed. Each copy is checked by
+ * running this program again on it, which mounts it (replaying its journal)
+ * with fsck and then
+ *
+ *   - requires fsck to find nothing but leaked blocks, which an operation
+ *     split across two batches may leave
+ *   - reads every file there is, which must all be readable
+ *   - reads every file fsync'd before the crash, which must hold exactly
+ *     what was written to it
+ *
+ * With -w the flusher runs as it does when mounted, with a small cache and
+ * a short delay, and batches stay open for a while, so data blocks are
+ * written back between commits behind the handlers' backs and crash points
+ * fall between the writes of its runs. Which writes it makes then depends
+ * on timing, so the points differ from run to run.
+ *
+ * The first copy that fails is kept as crash-N.disk in the scratch
+ * directory.
+ *
+ * Build it next to cs1550.c with the same flags, e.g.
+ *
+ *   gcc -Wall -O2 `pkg-config fuse --cflags` cs1550_crash_test.c -o cs1550_crash_test `pkg-config fuse --libs`
+ *
+ * Usage: cs1550_crash_test [-c] [-D] [-w] [-d scratch_dir] [-n ops] [-e every]
+ *
+ * -c makes the files compressed and -D deduplicated, as mounting with
+ * -o compress and -o dedup does. -n is how many operations the workload
+ * runs and -e how many writes apart the crashes are, 1 for every write.
+ * Exits with 0 if every copy passed.
+ */
+
+#include <unistd.h>
+
+//every write to the image is a point to crash at
+static ssize_t crash_pwrite(int fd, const void *buf, size_t size, off_t pos);
+#define pwrite crash_pwrite
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#undef pwrite
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+//blocks in the formatted image. Small, so the journal wraps often.
+#define CRASH_DISK_BLOCKS 4096
+
+//directories of scratch files, and files in each
+#define CRASH_DIRS 3
+#define CRASH_FILES 12
+
+//directories of fsync'd files, which fill up one after the other, with
+//room left in each for the neighbours: long named files that come and go
+//among them, so unlinking one moves the fsync'd files' names and inline
+//data up in the name area, and shrinks it
+#define CRASH_SYNC_DIRS 4
+#define CRASH_NEIGHBOURS 4
+#define CRASH_SYNC_FILES ((int) MAX_FILES_IN_DIR - CRASH_NEIGHBOURS)
+#define CRASH_NEIGHBOUR_NAME 200
+
+//largest scratch file
+#define CRASH_FILE_MAX (16 * 1024)
+
+static struct
+{
+    int armed;                  //the workload is running
+    long every;                 //crash every this many writes
+    long writes;                //writes to the image so far
+    long points;                //copies checked
+    long failed;                //copies that didn't pass
+    int synced;                 //files fsync'd so far
+    pthread_mutex_t lock;       //one write at a time, the flusher's too
+} crash = { 0, 1, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+//with -w: dirty blocks in the cache, how long they may stay dirty, and
+//how long a batch may stay open, so the flusher has something to write
+#define CRASH_WB_BLOCKS 64
+#define CRASH_WB_AGE_NS 1000000UL
+#define CRASH_WB_COMMIT_NS 10000000UL
+
+static unsigned long crash_rand_state = 88172645463325252UL;
+
+//xorshift64, so every run does the same
+static unsigned long crash_rand(void)
+{
+    crash_rand_state ^= crash_rand_state << 13;
+    crash_rand_state ^= crash_rand_state >> 7;
+    crash_rand_state ^= crash_rand_state << 17;
+    return crash_rand_state;
+}
+
+static void crash_die(const char *what, int res)
+{
+    fprintf(stderr, "cs1550_crash_test: %s failed: %s\n", what, strerror(res < 0 ? -res : res));
+    exit(2);
+}
+
+//the path and size of fsync'd file n, and the byte at offset i of it
+static void synced_path(int n, char *path, size_t size)
+{
+    snprintf(path, size, "/sync%d/f%d", n / CRASH_SYNC_FILES, n % CRASH_SYNC_FILES);
+}
+
+//the path of neighbour k in the directory of fsync'd files d
+static void neighbour_path(int k, int d, char *path, size_t size)
+{
+    int len = snprintf(path, size, "/sync%d/n%d-", d, k);
+    while (len < CRASH_NEIGHBOUR_NAME + 7 && (size_t) len + 1 < size) {
+        path[len++] = 'a' + k;
+    }
+    path[len] = '\0';
+}
+
+static size_t synced_size(int n)
+{
+    static const size_t sizes[] = { 40, 128, 300, 1500, 5000 };
+    return sizes[n % (sizeof(sizes) / sizeof(sizes[0]))];
+}
+
+static char synced_byte(int n, size_t i)
+{
+    return (char) (i * 31 + n * 7 + 3);
+}
+
+/*
+ * Check the image at path as a crash left it, with the first synced
+ * fsync'd files expected to be there. Returns 0 if it passed.
+ */
+static int crash_verify(const char *path, int synced)
+{
+    struct cs1550_fsck_report report;
+    cs1550_root_directory root;
+    cs1550_directory_entry dir;
+    struct fuse_file_info fi;
+    char file[2 * MAX_NAME + 3];
+    char name[MAX_NAME + 1];
+    char buf[BLOCK_SIZE];
+    int d, i, n, res;
+
+    disk_path = path;
+    log_level = -1;
+    memset(&report, 0, sizeof(report));
+    res = cs1550_mount(FSCK_CHECK, &report);
+    if (res == -EUCLEAN && fsck_problems(&report) == report.leaked) {
+        res = cs1550_mount(FSCK_FIX, NULL);
+    }
+    if (res != 0) {
+        printf("%s: mount failed: %s\n", path, strerror(-res));
+        fsck_print(stdout, &report);
+        return 1;
+    }
+
+    //everything there is can be read
+    block_read(0, &root);
+    for (d = 0; d < root.nDirectories; d++) {
+        struct cs1550_directory *de = &root.directories[d];
+        names_read(root.nNames, de->name.nOffset, name, de->name.nLength);
+        name[de->name.nLength] = '\0';
+        block_read(de->nStartBlock, &dir);
+        for (i = 0; i < dir.nFiles; i++) {
+            struct cs1550_file_directory *fe = &dir.files[i];
+            int len = snprintf(file, sizeof(file), "/%s/", name);
+            names_read(dir.nNames, fe->name.nOffset, file + len, fe->name.nLength);
+            file[len + fe->name.nLength] = '\0';
+
+            size_t done = 0;
+            memset(&fi, 0, sizeof(fi));
+            if ((res = hello_oper.open(file, &fi)) == 0) {
+                while ((res = hello_oper.read(file, buf, sizeof(buf), done, &fi)) > 0) {
+                    done += res;
+                }
+                hello_oper.release(file, &fi);
+            }
+            if (res < 0 || done != fe->fsize) {
+                printf("%s: %s: read %zu of %zu bytes: %s\n", path, file, done, fe->fsize,
+                       strerror(res < 0 ? -res : 0));
+                return 1;
+            }
+        }
+    }
+
+    //and what was fsync'd is as it was written
+    for (n = 0; n < synced; n++) {
+        size_t size = synced_size(n);
+        size_t done = 0;
+        synced_path(n, file, sizeof(file));
+        memset(&fi, 0, sizeof(fi));
+        if ((res = hello_oper.open(file, &fi)) != 0) {
+            printf("%s: fsync'd %s is gone: %s\n", path, file, strerror(-res));
+            return 1;
+        }
+        while ((res = hello_oper.read(file, buf, sizeof(buf), done, &fi)) > 0) {
+            for (i = 0; i < res; i++) {
+                if (buf[i] != synced_byte(n, done + i)) {
+                    printf("%s: fsync'd %s is wrong at offset %zu\n", path, file, done + i);
+                    return 1;
+                }
+            }
+            done += res;
+        }
+        hello_oper.release(file, &fi);
+        if (done != size) {
+            printf("%s: fsync'd %s has %zu of its %zu bytes\n", path, file, done, size);
+            return 1;
+        }
+    }
+    cs1550_unmount();
+    return 0;
+}
+
+//copy the image as it is now and have a child check the copy
+static void crash_point(void)
+{
+    char *buf = malloc(CRASH_DISK_BLOCKS * BLOCK_SIZE);
+    char synced[16];
+    int status;
+
+    if (pread(disk_fd, buf, CRASH_DISK_BLOCKS * BLOCK_SIZE, 0) != CRASH_DISK_BLOCKS * BLOCK_SIZE) {
+        crash_die("reading .disk", errno);
+    }
+    FILE *copy = fopen("crash.disk", "wb");
+    if (copy == NULL || fwrite(buf, BLOCK_SIZE, CRASH_DISK_BLOCKS, copy) != CRASH_DISK_BLOCKS
+        || fclose(copy) != 0) {
+        crash_die("writing crash.disk", errno);
+    }
+    free(buf);
+
+    snprintf(synced, sizeof(synced), "%d", crash.synced);
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/proc/self/exe", "cs1550_crash_test", "-k", "crash.disk", "-s", synced,
+              (char *) NULL);
+        _exit(2);
+    }
+    if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+        crash_die("running the check", errno);
+    }
+    crash.points++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (crash.failed++ == 0) {
+            char kept[32];
+            snprintf(kept, sizeof(kept), "crash-%ld.disk", crash.writes);
+            rename("crash.disk", kept);
+            printf("crash before write %ld failed, the image is kept as %s\n", crash.writes, kept);
+        }
+    }
+}
+
+static ssize_t crash_pwrite(int fd, const void *buf, size_t size, off_t pos)
+{
+    if (fd != disk_fd) {
+        return pwrite(fd, buf, size, pos);
+    }
+    pthread_mutex_lock(&crash.lock);
+    if (crash.armed && ++crash.writes % crash.every == 0) {
+        crash_point();
+    }
+    ssize_t n = pwrite(fd, buf, size, pos);
+    pthread_mutex_unlock(&crash.lock);
+    return n;
+}
+
+//write size bytes of the scratch pattern at offset of path. The pattern only
+//depends on the offset, so with -D the files share chunks.
+static void crash_write(const char *path, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    char *buf = malloc(size);
+    size_t i;
+    int res;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = (char) ((offset + i) * 31 + 7);
+    }
+    if ((res = hello_oper.write(path, buf, size, offset, fi)) != (int) size) {
+        crash_die("write", res);
+    }
+    free(buf);
+}
+
+//make fsync'd file n, which nothing touches again
+static void crash_sync_file(int n)
+{
+    struct fuse_file_info fi;
+    char path[64];
+    size_t size = synced_size(n);
+    char *buf = malloc(size);
+    size_t i;
+    int res;
+
+    if (n % CRASH_SYNC_FILES == 0) {
+        snprintf(path, sizeof(path), "/sync%d", n / CRASH_SYNC_FILES);
+        if ((res = hello_oper.mkdir(path, 0755)) != 0) {
+            crash_die("mkdir", res);
+        }
+    }
+    synced_path(n, path, sizeof(path));
+    for (i = 0; i < size; i++) {
+        buf[i] = synced_byte(n, i);
+    }
+    memset(&fi, 0, sizeof(fi));
+    if ((res = hello_oper.mknod(path, S_IFREG | 0644, 0)) != 0
+        || (res = hello_oper.open(path, &fi)) != 0) {
+        crash_die("creating a file to fsync", res);
+    }
+    //in two writes, so a small one is written inline first
+    if ((res = hello_oper.write(path, buf, size / 2, 0, &fi)) != (int) (size / 2)
+        || (res = hello_oper.write(path, buf + size / 2, size - size / 2, size / 2, &fi))
+           != (int) (size - size / 2)) {
+        crash_die("write", res);
+    }
+    if ((res = hello_oper.fsync(path, 0, &fi)) != 0) {
+        crash_die("fsync", res);
+    }
+    crash.synced++;
+    hello_oper.release(path, &fi);
+    free(buf);
+}
+
+/*
+ * Run ops operations against the mounted image: mostly writes to the
+ * scratch files, some of which start out inline and are grown out of it,
+ * unlinks, which free blocks the journal still has images of for later
+ * writes to take, and every so often a file that is fsync'd.
+ */
+static void crash_workload(int ops)
+{
+    static size_t sizes[CRASH_DIRS][CRASH_FILES];
+    static int exists[CRASH_DIRS][CRASH_FILES];
+    static int neighbours[CRASH_NEIGHBOURS];    //1 + the directory of each, 0 if none
+    char path[2 * MAX_NAME + 3];
+    int i, res;
+
+    for (i = 0; i < CRASH_DIRS; i++) {
+        snprintf(path, sizeof(path), "/scratch%d", i);
+        if ((res = hello_oper.mkdir(path, 0755)) != 0) {
+            crash_die("mkdir", res);
+        }
+    }
+
+    for (i = 0; i < ops; i++) {
+        int d = crash_rand() % CRASH_DIRS;
+        int f = crash_rand() % CRASH_FILES;
+        int what = crash_rand() % 10;
+        snprintf(path, sizeof(path), "/scratch%d/f%d", d, f);
+
+        if (what == 0 && crash.synced < CRASH_SYNC_DIRS * CRASH_SYNC_FILES) {
+            crash_sync_file(crash.synced);
+            continue;
+        }
+        //a neighbour goes, or comes to the newest fsync'd files, inline
+        //or not
+        if (what == 9 && crash.synced > 0) {
+            int k = f % CRASH_NEIGHBOURS;
+            if (neighbours[k]) {
+                neighbour_path(k, neighbours[k] - 1, path, sizeof(path));
+                if ((res = hello_oper.unlink(path)) != 0) {
+                    crash_die("unlink", res);
+                }
+                neighbours[k] = 0;
+                continue;
+            }
+            neighbours[k] = 1 + (crash.synced - 1) / CRASH_SYNC_FILES;
+            neighbour_path(k, neighbours[k] - 1, path, sizeof(path));
+            if ((res = hello_oper.mknod(path, S_IFREG | 0644, 0)) != 0) {
+                crash_die("mknod", res);
+            }
+            crash_write(path, 1 + crash_rand() % (f < CRASH_FILES / 2 ? INLINE_MAX : 1000), 0, NULL);
+            continue;
+        }
+        if (what <= 2 && exists[d][f]) {
+            if ((res = hello_oper.unlink(path)) != 0) {
+                crash_die("unlink", res);
+            }
+            exists[d][f] = 0;
+            continue;
+        }
+        if (!exists[d][f]) {
+            if ((res = hello_oper.mknod(path, S_IFREG | 0644, 0)) != 0) {
+                crash_die("mknod", res);
+            }
+            exists[d][f] = 1;
+            sizes[d][f] = 0;
+        }
+
+        //a small write, often inline, or a bigger one that may grow the
+        //file out of its inline data, at the end or over what is there
+        size_t size = what <= 5 ? 1 + crash_rand() % 100 : 1 + crash_rand() % 3000;
+        off_t offset = what % 2 == 0 ? (off_t) sizes[d][f]
+                     : (off_t) (crash_rand() % (sizes[d][f] + 1));
+        if (offset + size > CRASH_FILE_MAX) {
+            continue;
+        }
+        crash_write(path, size, offset, NULL);
+        if ((size_t) offset + size > sizes[d][f]) {
+            sizes[d][f] = offset + size;
+        }
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: cs1550_crash_test [-c] [-D] [-w] [-d scratch_dir] [-n ops] [-e every]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char scratch[] = "/tmp/cs1550_crash.XXXXXX";
+    const char *dir = NULL;
+    const char *check = NULL;
+    int synced = 0;
+    int ops = 400;
+    int flusher = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cDwd:n:e:k:s:")) != -1) {
+        switch (opt) {
+        case 'c': compress_files = 1; break;
+        case 'D': dedup_files = 1; break;
+        case 'w': flusher = 1; break;
+        case 'd': dir = optarg; break;
+        case 'n': ops = atoi(optarg); break;
+        case 'e': crash.every = atol(optarg); break;
+        case 'k': check = optarg; break;
+        case 's': synced = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (ops <= 0 || crash.every <= 0) {
+        usage();
+    }
+
+    //a copy to check, given by crash_point()
+    if (check != NULL) {
+        return crash_verify(check, synced);
+    }
+
+    if (dir == NULL && (dir = mkdtemp(scratch)) == NULL) {
+        crash_die("mkdtemp", errno);
+    }
+    if (chdir(dir) != 0) {
+        crash_die(dir, errno);
+    }
+
+    //every operation commits, so there are many transactions to replay,
+    //unless the flusher writes back between commits
+    log_level = LOG_LEVEL_ERROR;
+    journal_commit_ns = 0;
+    if (flusher) {
+        wb.max = CRASH_WB_BLOCKS;
+        wb.age_ns = CRASH_WB_AGE_NS;
+        journal_commit_ns = CRASH_WB_COMMIT_NS;
+    }
+    int res = cs1550_format(disk_path, CRASH_DISK_BLOCKS, -1);
+    if (res != 0 || (res = cs1550_mount(FSCK_OFF, NULL)) != 0) {
+        crash_die("formatting .disk", res);
+    }
+    if (flusher) {
+        wb_start();
+    }
+    crash.armed = 1;
+    crash_workload(ops);
+    hello_oper.destroy(NULL);
+    crash.armed = 0;
+    unlink("crash.disk");
+
+    printf("cs1550_crash_test: %ld crash points, %ld failed, %d files fsync'd\n",
+           crash.points, crash.failed, crash.synced);
+    return crash.failed != 0;
+}
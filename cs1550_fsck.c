@@ -0,0 +1,75 @@
+/*
+ * Check, and optionally repair, a cs1550 filesystem image that is not
+ * mounted.
+ *
+ * Build it next to cs1550.c with the same flags, e.g.
+ *
+ *   gcc -Wall -O2 `pkg-config fuse --cflags` cs1550_fsck.c -o cs1550_fsck `pkg-config fuse --libs`
+ *
+ * Usage: cs1550_fsck [-r] [-d] [-v] image
+ *
+ *   -r   repair what is found (images without a superblock are always
+ *        upgraded and journals are always replayed, which writes to them)
+ *   -d   then move fragmented files into contiguous blocks, if the image
+ *        is clean, and report how fragmented it was before and after
+ *   -v   report progress
+ *
+ * Exits with 0 if the image is clean, 1 if problems were found (and
+ * repaired with -r) and 2 if it couldn't be checked.
+ */
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: cs1550_fsck [-r] [-d] [-v] image\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct cs1550_fsck_report report;
+    struct cs1550_frag before, after;
+    int mode = FSCK_CHECK;
+    int defragment = 0;
+    int opt, res;
+
+    log_level = LOG_LEVEL_WARN;
+    while ((opt = getopt(argc, argv, "rdv")) != -1) {
+        switch (opt) {
+        case 'r': mode = FSCK_FIX; break;
+        case 'd': defragment = 1; break;
+        case 'v': log_level = LOG_LEVEL_INFO; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    disk_path = argv[optind];
+
+    memset(&report, 0, sizeof(report));
+    unsigned long start = stats_now();
+    res = cs1550_mount(mode, &report);
+    if (res != 0 && res != -EUCLEAN) {
+        fprintf(stderr, "cs1550_fsck: %s: %s\n", disk_path, strerror(-res));
+        return 2;
+    }
+
+    if (defragment && res == 0) {
+        frag_measure(&before);
+        defrag_all();
+        frag_measure(&after);
+    }
+    cs1550_unmount();
+
+    printf("%s: ", disk_path);
+    fsck_print(stdout, &report);
+    printf("checked in %.3f seconds\n", (stats_now() - start) / 1e9);
+    if (defragment && res == 0) {
+        frag_print(stdout, "before", &before);
+        frag_print(stdout, "after", &after);
+    }
+    return fsck_problems(&report) != 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Create an empty cs1550 filesystem image.
+ *
+ * Build it next to cs1550.c with the same flags, e.g.
+ *
+ *   gcc -Wall -O2 `pkg-config fuse --cflags` cs1550_mkfs.c -o cs1550_mkfs `pkg-config fuse --libs`
+ *
+ * Usage: cs1550_mkfs [-s size[K|M|G] | -b blocks] [-j journal_blocks] [-f] image
+ *
+ * The default is the classic 5MB (10240 block) image with a journal of 1/16
+ * of it, at most 1024 blocks. -j 0 makes an image without a journal. An
+ * existing file is only replaced when -f is given.
+ */
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#include <sys/stat.h>
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: cs1550_mkfs [-s size[K|M|G] | -b blocks] [-j journal_blocks] [-f] image\n");
+    exit(2);
+}
+
+//parse a size like 5M into bytes, -1 if it isn't one
+static long parse_size(const char *arg)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (end == arg || n <= 0) {
+        return -1;
+    }
+    switch (*end) {
+    case 'g': case 'G': n *= 1024;  /* fall through */
+    case 'm': case 'M': n *= 1024;  /* fall through */
+    case 'k': case 'K': n *= 1024; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    long nblocks = 10240;
+    long njournal = -1;
+    int force = 0;
+    struct stat st;
+    int opt, res;
+
+    while ((opt = getopt(argc, argv, "s:b:j:f")) != -1) {
+        switch (opt) {
+        case 's': {
+            long bytes = parse_size(optarg);
+            if (bytes < 0) {
+                usage();
+            }
+            nblocks = bytes / BLOCK_SIZE;
+            break;
+        }
+        case 'b': nblocks = atol(optarg); break;
+        case 'j': njournal = atol(optarg); break;
+        case 'f': force = 1; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+    const char *path = argv[optind];
+
+    if (!force && stat(path, &st) == 0) {
+        fprintf(stderr, "cs1550_mkfs: %s exists, use -f to replace it\n", path);
+        return 1;
+    }
+    if ((res = cs1550_format(path, nblocks, njournal)) != 0) {
+        fprintf(stderr, "cs1550_mkfs: %s: %s\n", path,
+                res == -EINVAL ? "image or journal too small" : strerror(-res));
+        return 1;
+    }
+
+    layout_init(&sb, nblocks, njournal < 0 ? journal_default_blocks(nblocks) : njournal, 1);
+    printf("%s: %ld blocks of %d bytes, %ld for data, %ld for the journal, %ld for checksums, "
+           "bitmap at block %ld\n",
+           path, sb.nBlocks, BLOCK_SIZE, sb.nDataEnd - sb.nDataStart, sb.nJournalBlocks,
+           sb.nSumBlocks, sb.nBitmapBlock);
+    return 0;
+}
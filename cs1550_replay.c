@@ -0,0 +1,423 @@
+/*
+ * Replay a trace recorded by mounting with -o trace=FILE against a copy of
+ * the image it was recorded on, and report how long each kind of call took.
+ *
+ * Copy the image before mounting it with the trace, since the trace starts
+ * from the image as it was then. The copy given here is copied again to a
+ * scratch file, so it can be replayed as often as needed, and the calls go
+ * to the handlers in hello_oper directly, in-process, as in cs1550_bench.
+ * They are replayed one at a time in the order they ran, which is the
+ * order the trace has them in, as fast as they can be or, with -r, as far
+ * apart as they were recorded. Writes write a pattern of the recorded
+ * size; the data isn't in the trace.
+ *
+ * Each kind of call that was recorded prints one JSON object per line, with
+ * the latency it had in the replay and as recorded:
+ *
+ *   {"op":"read","calls":2560,"skipped":0,"differ":0,"p50_us":4.1,"p99_us":9.8,
+ *    "max_us":31.0,"traced_p50_us":6.3,"traced_p99_us":15.2,"traced_max_us":40.1}
+ *
+ * then a "total" line. Calls are skipped when the replay can't make them,
+ * like a read through an open that started before the trace did. "differ"
+ * counts calls that returned something else than they did when they were
+ * recorded, which should only happen if the image wasn't the right one.
+ *
+ * Build it next to cs1550.c with the same flags, e.g.
+ *
+ *   gcc -Wall -O2 -DNDEBUG `pkg-config fuse --cflags` cs1550_replay.c -o cs1550_replay `pkg-config fuse --libs`
+ *
+ * Usage: cs1550_replay [-r] [-c] [-D] [-k] [-o output_file] trace image
+ *
+ *   -r   keep the time between calls that the trace has
+ *   -c   compress the files made, as mounting with -o compress does
+ *   -D   deduplicate them, as -o dedup does
+ *   -k   keep the scratch copy of the image and the statistics of the
+ *        replay, and say where they are
+ */
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+//an open of the trace still open in the replay, by the fh it was recorded
+//with. Opens of one file share a handle, and so the fh, in which case the
+//last one made is the one a call finds.
+struct replay_open
+{
+    long handle;                    //nHandle in the trace
+    struct fuse_file_info fi;       //the same open in the replay
+    char path[TRACE_PATH_MAX];      //what it was opened as
+    struct replay_open *next;
+};
+
+struct replay_result
+{
+    unsigned long *lat_ns;          //latency of each call in the replay
+    unsigned long *traced_ns;       //and as it was recorded
+    unsigned long calls;
+    unsigned long max;              //room in lat_ns and traced_ns
+    unsigned long skipped;
+    unsigned long differ;
+};
+
+static struct replay_open *opens;
+static struct replay_result results[NUM_OPS];
+static FILE *replay_out;
+static char *replay_buf;
+static size_t replay_buf_size;
+
+static void replay_die(const char *what, int res)
+{
+    fprintf(stderr, "cs1550_replay: %s: %s\n", what, strerror(res < 0 ? -res : res));
+    exit(1);
+}
+
+//copy the file at from to the new file at to
+static void replay_copy(const char *from, int to)
+{
+    char *buf = malloc(1 << 20);
+    int in = open(from, O_RDONLY);
+    ssize_t n;
+
+    if (in == -1) {
+        replay_die(from, errno);
+    }
+    while ((n = read(in, buf, 1 << 20)) > 0) {
+        if (write(to, buf, n) != n) {
+            replay_die("copying the image", errno);
+        }
+    }
+    if (n < 0) {
+        replay_die(from, errno);
+    }
+    close(in);
+    free(buf);
+}
+
+static struct replay_open * replay_find(long handle)
+{
+    struct replay_open *o;
+    for (o = opens; o != NULL && o->handle != handle; o = o->next) {
+    }
+    return o;
+}
+
+static void replay_forget(struct replay_open *o)
+{
+    struct replay_open **p = &opens;
+    while (*p != o) {
+        p = &(*p)->next;
+    }
+    *p = o->next;
+    free(o);
+}
+
+//a buffer of at least size bytes for reads and writes
+static char * replay_buffer(size_t size)
+{
+    if (size > replay_buf_size) {
+        replay_buf = realloc(replay_buf, size);
+        replay_buf_size = size;
+    }
+    return replay_buf;
+}
+
+static int replay_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+    (void) buf;
+    (void) name;
+    (void) st;
+    (void) off;
+    return 0;
+}
+
+/*
+ * Make the call rec records, on path, through the open o if it has one.
+ * Returns what it returned, or sets *skipped if it can't be made.
+ */
+static int replay_call(const struct cs1550_trace_record *rec, const char *path,
+                       struct replay_open *o, int *skipped)
+{
+    struct fuse_file_info *fi = o != NULL ? &o->fi : NULL;
+    struct statvfs sv;
+    struct stat st;
+    size_t i;
+    int res;
+
+    *skipped = 0;
+    switch (rec->nOp) {
+    case OP_OPEN:
+    case OP_OPENDIR:
+        o = calloc(1, sizeof(*o));
+        res = rec->nOp == OP_OPEN ? hello_oper.open(path, &o->fi) : hello_oper.opendir(path, &o->fi);
+        if (res != 0) {
+            free(o);
+            return res;
+        }
+        o->handle = rec->nHandle;
+        strcpy(o->path, path);
+        o->next = opens;
+        opens = o;
+        return res;
+    case OP_RELEASE:
+    case OP_RELEASEDIR:
+        if (o == NULL) {
+            break;
+        }
+        res = rec->nOp == OP_RELEASE ? hello_oper.release(path, fi) : hello_oper.releasedir(path, fi);
+        replay_forget(o);
+        return res;
+    case OP_FLUSH:
+        if (o == NULL) {
+            break;
+        }
+        return hello_oper.flush(path, fi);
+    case OP_FSYNC:
+        return hello_oper.fsync(path, rec->nSize, fi);
+    case OP_STATFS:
+        return hello_oper.statfs("/", &sv);
+    case OP_FORGET:
+        //nothing holds on to a lookup here
+        break;
+    default:
+        //the rest need a path, which a call on an open file may not have
+        if (path[0] == '\0') {
+            break;
+        }
+        switch (rec->nOp) {
+        case OP_GETATTR:
+        case OP_LOOKUP:
+        case OP_SETATTR:
+            return hello_oper.getattr(path, &st);
+        case OP_READDIR:
+            return hello_oper.readdir(path, NULL, replay_filler, rec->nOffset, fi);
+        case OP_MKDIR:
+            return hello_oper.mkdir(path, 0755);
+        case OP_RMDIR:
+            return hello_oper.rmdir(path);
+        case OP_MKNOD:
+            return hello_oper.mknod(path, S_IFREG | 0644, 0);
+        case OP_UNLINK:
+            return hello_oper.unlink(path);
+        case OP_TRUNCATE:
+            return hello_oper.truncate(path, rec->nOffset);
+        case OP_READ:
+            return hello_oper.read(path, replay_buffer(rec->nSize), rec->nSize, rec->nOffset, fi);
+        case OP_WRITE: {
+            char *buf = replay_buffer(rec->nSize);
+            for (i = 0; i < (size_t) rec->nSize; i++) {
+                buf[i] = (char) ((rec->nOffset + i) * 31 + 7);
+            }
+            return hello_oper.write(path, buf, rec->nSize, rec->nOffset, fi);
+        }
+        }
+    }
+    *skipped = 1;
+    return 0;
+}
+
+//did the replay of rec return what it did when it was recorded? readdir
+//returns a count of bytes through the low-level API and 0 here.
+static int replay_same(const struct cs1550_trace_record *rec, int res)
+{
+    if (rec->nOp == OP_READDIR) {
+        return (res < 0 ? res : 0) == (rec->nResult < 0 ? rec->nResult : 0);
+    }
+    return res == rec->nResult;
+}
+
+static void replay_add(struct replay_result *r, unsigned long ns, unsigned long traced_ns)
+{
+    if (r->calls == r->max) {
+        r->max = r->max ? 2 * r->max : 1024;
+        r->lat_ns = realloc(r->lat_ns, r->max * sizeof(unsigned long));
+        r->traced_ns = realloc(r->traced_ns, r->max * sizeof(unsigned long));
+    }
+    r->lat_ns[r->calls] = ns;
+    r->traced_ns[r->calls] = traced_ns;
+    r->calls++;
+}
+
+static int replay_cmp(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *) a;
+    unsigned long y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double replay_pct_us(const unsigned long *ns, unsigned long n, int pct)
+{
+    unsigned long i = (n * pct + 99) / 100;
+    if (i > 0) {
+        i--;
+    }
+    return n ? ns[i] / 1000.0 : 0.0;
+}
+
+static void replay_print(const char *name, struct replay_result *r)
+{
+    qsort(r->lat_ns, r->calls, sizeof(unsigned long), replay_cmp);
+    qsort(r->traced_ns, r->calls, sizeof(unsigned long), replay_cmp);
+    fprintf(replay_out, "{\"op\":\"%s\",\"calls\":%lu,\"skipped\":%lu,\"differ\":%lu,"
+            "\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+            "\"traced_p50_us\":%.2f,\"traced_p99_us\":%.2f,\"traced_max_us\":%.2f}\n",
+            name, r->calls, r->skipped, r->differ,
+            replay_pct_us(r->lat_ns, r->calls, 50), replay_pct_us(r->lat_ns, r->calls, 99),
+            replay_pct_us(r->lat_ns, r->calls, 100),
+            replay_pct_us(r->traced_ns, r->calls, 50), replay_pct_us(r->traced_ns, r->calls, 99),
+            replay_pct_us(r->traced_ns, r->calls, 100));
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: cs1550_replay [-r] [-c] [-D] [-k] [-o output_file] trace image\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char scratch[] = "/tmp/cs1550_replay.XXXXXX";
+    struct cs1550_trace_header header;
+    struct cs1550_trace_record rec;
+    char path[TRACE_PATH_MAX];
+    const char *out = NULL;
+    int realtime = 0, keep = 0;
+    int opt, res, i;
+
+    while ((opt = getopt(argc, argv, "rcDko:")) != -1) {
+        switch (opt) {
+        case 'r': realtime = 1; break;
+        case 'c': compress_files = 1; break;
+        case 'D': dedup_files = 1; break;
+        case 'k': keep = 1; break;
+        case 'o': out = optarg; break;
+        default: usage();
+        }
+    }
+    if (optind != argc - 2) {
+        usage();
+    }
+    const char *trace_path = argv[optind];
+    const char *image = argv[optind + 1];
+
+    replay_out = stdout;
+    if (out != NULL && (replay_out = fopen(out, "w")) == NULL) {
+        replay_die(out, errno);
+    }
+    FILE *in = fopen(trace_path, "r");
+    if (in == NULL) {
+        replay_die(trace_path, errno);
+    }
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.nMagic != TRACE_MAGIC
+        || header.nVersion != TRACE_VERSION) {
+        fprintf(stderr, "cs1550_replay: %s is not a trace\n", trace_path);
+        return 1;
+    }
+
+    int fd = mkstemp(scratch);
+    if (fd == -1) {
+        replay_die("mkstemp", errno);
+    }
+    replay_copy(image, fd);
+    close(fd);
+    disk_path = scratch;
+
+    log_level = LOG_LEVEL_ERROR;
+    if ((res = cs1550_mount(FSCK_OFF, NULL)) != 0) {
+        replay_die(image, res);
+    }
+    //start the flusher and the rest as a mount would
+    hello_oper.init(NULL);
+
+    unsigned long calls = 0, skipped = 0, differ = 0;
+    unsigned long begin = stats_now();
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        if (rec.nOp < 0 || rec.nOp >= NUM_OPS || rec.nPathLen < 0
+            || rec.nPathLen >= (short) TRACE_PATH_MAX
+            || fread(path, 1, rec.nPathLen, in) != (size_t) rec.nPathLen) {
+            fprintf(stderr, "cs1550_replay: %s: bad record after %lu calls\n", trace_path,
+                    calls + skipped);
+            break;
+        }
+        path[rec.nPathLen] = '\0';
+
+        if (realtime) {
+            unsigned long now = stats_now() - begin;
+            if ((unsigned long) rec.nTime > now) {
+                struct timespec ts = { (rec.nTime - now) / 1000000000UL,
+                                       (rec.nTime - now) % 1000000000UL };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        struct replay_open *o = rec.nHandle != 0 ? replay_find(rec.nHandle) : NULL;
+        if (path[0] == '\0' && o != NULL) {
+            strcpy(path, o->path);
+        }
+        int skip;
+        unsigned long start = stats_now();
+        res = replay_call(&rec, path, o, &skip);
+        unsigned long ns = stats_now() - start;
+
+        struct replay_result *r = &results[rec.nOp];
+        if (skip) {
+            r->skipped++;
+            skipped++;
+            continue;
+        }
+        calls++;
+        replay_add(r, ns, rec.nLatency);
+        if (!replay_same(&rec, res)) {
+            r->differ++;
+            differ++;
+        }
+    }
+    unsigned long elapsed = stats_now() - begin;
+    fclose(in);
+
+    //what the trace left open
+    while (opens != NULL) {
+        if (opens->fi.fh != 0) {
+            hello_oper.release(opens->path, &opens->fi);
+        }
+        replay_forget(opens);
+    }
+    hello_oper.destroy(NULL);
+
+    unsigned long lat = 0, traced = 0;
+    for (i = 0; i < NUM_OPS; i++) {
+        struct replay_result *r = &results[i];
+        unsigned long j;
+        if (r->calls == 0 && r->skipped == 0) {
+            continue;
+        }
+        for (j = 0; j < r->calls; j++) {
+            lat += r->lat_ns[j];
+            traced += r->traced_ns[j];
+        }
+        replay_print(op_names[i], r);
+        free(r->lat_ns);
+        free(r->traced_ns);
+    }
+    fprintf(replay_out, "{\"op\":\"total\",\"calls\":%lu,\"skipped\":%lu,\"differ\":%lu,"
+            "\"seconds\":%.6f,\"call_seconds\":%.6f,\"traced_call_seconds\":%.6f}\n",
+            calls, skipped, differ, elapsed / 1e9, lat / 1e9, traced / 1e9);
+    if (replay_out != stdout) {
+        fclose(replay_out);
+    }
+
+    //the statistics of the replay are next to it, see stats_dump()
+    char stats_path[sizeof(scratch) + 8];
+    snprintf(stats_path, sizeof(stats_path), "%s.stats", scratch);
+    if (keep) {
+        fprintf(stderr, "cs1550_replay: the image is in %s, its statistics in %s\n",
+                scratch, stats_path);
+    } else {
+        unlink(scratch);
+        unlink(stats_path);
+    }
+    free(replay_buf);
+    return 0;
+}
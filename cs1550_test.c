@@ -0,0 +1,682 @@
+/*
+ * Tests for cs1550: each one formats a fresh .disk in a scratch directory,
+ * runs operations against it in-process through hello_oper, like
+ * cs1550_bench, and checks what they return and what they leave behind,
+ * down to a remount with fsck that must find nothing wrong. It keeps the
+ * low-level interface (CS1550_LL), so the inode numbers it gives out can be
+ * tested too.
+ *
+ * Build it next to cs1550.c with the same flags, e.g.
+ *
+ *   gcc -Wall -O2 `pkg-config fuse --cflags` cs1550_test.c -o cs1550_test `pkg-config fuse --libs`
+ *
+ * Usage: cs1550_test [-d scratch_dir] [test...]
+ *
+ * Runs the tests named, or all of them. Exits with 0 if every check passed.
+ */
+
+#include <unistd.h>
+
+#define CS1550_NO_MAIN
+#define CS1550_LL
+#include "cs1550.c"
+
+#include <sys/stat.h>
+
+//blocks in the formatted image
+#define TEST_DISK_BLOCKS 2048
+
+static struct
+{
+    const char *name;           //the running test
+    long checks;                //checks so far
+    long failed;                //checks that didn't pass
+} test = { "cs1550_test", 0, 0 };
+
+#define CHECK(cond, ...) test_check((cond), __LINE__, __VA_ARGS__)
+
+static void test_check(int ok, int line, const char *fmt, ...)
+{
+    va_list ap;
+
+    test.checks++;
+    if (ok) {
+        return;
+    }
+    test.failed++;
+    printf("%s, line %d: ", test.name, line);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+}
+
+static void test_die(const char *what, int res)
+{
+    fprintf(stderr, "cs1550_test: %s: %s failed: %s\n", test.name, what,
+            strerror(res < 0 ? -res : res));
+    exit(2);
+}
+
+//size bytes of pattern seed, the same for the same offset
+static void test_pattern(char *buf, size_t size, off_t offset, int seed)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = (char) ((offset + i) * 31 + seed * 7 + 3);
+    }
+}
+
+//bytes that compress well, the same for the same offset
+static void test_text(char *buf, size_t size, off_t offset, int seed)
+{
+    size_t i;
+    for (i = 0; i < size; i++) {
+        buf[i] = "abcdefgh"[((offset + i) / 16 + seed) % 8];
+    }
+}
+
+//size bytes that don't compress
+static void test_random(char *buf, size_t size, unsigned long seed)
+{
+    size_t i;
+    seed = seed * 2654435761UL + 88172645463325252UL;
+    for (i = 0; i < size; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        buf[i] = (char) seed;
+    }
+}
+
+//format .disk and mount it
+static void test_format(void)
+{
+    log_level = LOG_LEVEL_ERROR;
+    int res = cs1550_format(disk_path, TEST_DISK_BLOCKS, -1);
+    if (res != 0 || (res = cs1550_mount(FSCK_OFF, NULL)) != 0) {
+        test_die("formatting .disk", res);
+    }
+}
+
+//unmount and mount again with fsck, which must find the image sound
+static void test_remount(void)
+{
+    struct cs1550_fsck_report report;
+
+    hello_oper.destroy(NULL);
+    memset(&report, 0, sizeof(report));
+    int res = cs1550_mount(FSCK_CHECK, &report);
+    CHECK(res == 0, "remount found problems: %s", strerror(-res));
+    if (res != 0) {
+        fsck_print(stdout, &report);
+        if ((res = cs1550_mount(FSCK_FIX, NULL)) != 0) {
+            test_die("remount", res);
+        }
+    }
+}
+
+static void test_mknod(const char *path)
+{
+    int res = hello_oper.mknod(path, S_IFREG | 0644, 0);
+    if (res != 0) {
+        test_die(path, res);
+    }
+}
+
+//write size bytes of buf at offset of path, through an open of it
+static int test_write(const char *path, const char *buf, size_t size, off_t offset)
+{
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    int res = hello_oper.open(path, &fi);
+    if (res != 0) {
+        return res;
+    }
+    res = hello_oper.write(path, buf, size, offset, &fi);
+    hello_oper.release(path, &fi);
+    return res;
+}
+
+//read all of path into buf, of room for size bytes. Returns how many it
+//read, or the error.
+static long test_read(const char *path, char *buf, size_t size)
+{
+    struct fuse_file_info fi;
+    long done = 0;
+    int res;
+
+    memset(&fi, 0, sizeof(fi));
+    if ((res = hello_oper.open(path, &fi)) != 0) {
+        return res;
+    }
+    while ((size_t) done < size
+           && (res = hello_oper.read(path, buf + done, size - done, done, &fi)) > 0) {
+        done += res;
+    }
+    hello_oper.release(path, &fi);
+    return res < 0 ? res : done;
+}
+
+//path holds exactly the size bytes of want
+static void test_expect(const char *path, const char *want, size_t size)
+{
+    char *buf = malloc(size + 1);
+    struct stat st;
+
+    long res = test_read(path, buf, size + 1);
+    CHECK(res == (long) size, "%s: read %ld of %zu bytes", path, res, size);
+    CHECK(res != (long) size || memcmp(buf, want, size) == 0, "%s: wrong data", path);
+    res = hello_oper.getattr(path, &st);
+    CHECK(res == 0 && (size_t) st.st_size == size, "%s: getattr says %ld bytes, not %zu",
+          path, res == 0 ? (long) st.st_size : res, size);
+    free(buf);
+}
+
+static long test_free_blocks(void)
+{
+    struct statvfs st;
+    hello_oper.statfs("/", &st);
+    return st.f_bfree;
+}
+
+static long test_free_entries(void)
+{
+    struct statvfs st;
+    hello_oper.statfs("/", &st);
+    return st.f_ffree;
+}
+
+/*
+ * With a snapshot taken, writing a block it holds copies the block first.
+ * Once there is no room for the copy, the operation fails with ENOSPC, and
+ * must leave nothing of itself behind: not the blocks it wrote before the
+ * one it couldn't copy, not a size, an entry or counts changed in memory,
+ * and nothing in the batch for the next commit.
+ */
+static void test_snapshot_enospc(void)
+{
+    char a[3 * MAX_DATA_IN_BLOCK], b[600], c[3000];
+    char buf[3000];
+    struct fuse_file_info fi;
+    long res;
+
+    test_format();
+    if ((res = hello_oper.mkdir("/t", 0755)) != 0
+        || (res = hello_oper.mkdir("/f", 0755)) != 0) {
+        test_die("mkdir", res);
+    }
+    test_pattern(a, sizeof(a), 0, 1);
+    test_pattern(b, sizeof(b), 0, 2);
+    test_text(c, sizeof(c), 0, 3);
+    test_mknod("/t/a");
+    test_mknod("/t/b");
+    compress_files = 1;
+    test_mknod("/t/c");
+    compress_files = 0;
+    CHECK(test_write("/t/a", a, sizeof(a), 0) == sizeof(a), "writing /t/a");
+    CHECK(test_write("/t/b", b, sizeof(b), 0) == sizeof(b), "writing /t/b");
+    CHECK(test_write("/t/c", c, sizeof(c), 0) == sizeof(c), "writing /t/c");
+    CHECK(hello_oper.mkdir(SNAP_PATH, 0755) == 0, "taking the snapshot");
+
+    //the first copy makes the remap table, so a later one takes one block
+    a[0] = 'x';
+    CHECK(test_write("/t/a", a, 1, 0) == 1, "writing the first block of /t/a");
+
+    //fill the image up to one free block
+    test_mknod("/f/fill");
+    off_t size = 0;
+    test_pattern(buf, MAX_DATA_IN_BLOCK, 0, 4);
+    while (test_free_blocks() > 1) {
+        if (test_write("/f/fill", buf, MAX_DATA_IN_BLOCK, size) != MAX_DATA_IN_BLOCK) {
+            test_die("filling the image", -ENOSPC);
+        }
+        size += MAX_DATA_IN_BLOCK;
+    }
+    CHECK(test_free_blocks() == 1, "%ld free blocks, not 1", test_free_blocks());
+    unsigned long undone = stats.ops_undone;
+    long entries = test_free_entries();
+
+    //the second and third block: the copy of the third has no room
+    test_pattern(buf, sizeof(buf), 0, 5);
+    res = test_write("/t/a", buf, 2 * MAX_DATA_IN_BLOCK, MAX_DATA_IN_BLOCK);
+    CHECK(res == -ENOSPC, "overwriting /t/a returned %ld", res);
+    test_expect("/t/a", a, sizeof(a));
+    CHECK(test_free_blocks() == 1, "%ld free blocks after it, not 1", test_free_blocks());
+
+    //a block is added, but the last one can't link it in
+    res = test_write("/t/a", buf, 100, sizeof(a));
+    CHECK(res == -ENOSPC, "appending to /t/a returned %ld", res);
+    test_expect("/t/a", a, sizeof(a));
+
+    //the chunk's blocks get copied one by one
+    test_text(buf, sizeof(c), 0, 6);
+    res = test_write("/t/c", buf, sizeof(c), 0);
+    CHECK(res == -ENOSPC, "overwriting /t/c returned %ld", res);
+    test_expect("/t/c", c, sizeof(c));
+
+    //with no room at all, unlinking an open file fails, which it only
+    //finds out after it took the file out of the counts and its handle
+    test_pattern(buf, MAX_DATA_IN_BLOCK, size, 4);
+    CHECK(test_write("/f/fill", buf, MAX_DATA_IN_BLOCK, size) == MAX_DATA_IN_BLOCK,
+          "filling the last block");
+    memset(&fi, 0, sizeof(fi));
+    if ((res = hello_oper.open("/t/b", &fi)) != 0) {
+        test_die("open", res);
+    }
+    res = hello_oper.unlink("/t/b");
+    CHECK(res == -ENOSPC, "unlinking /t/b returned %ld", res);
+    res = hello_oper.read("/t/b", buf, sizeof(buf), 0, &fi);
+    CHECK(res == sizeof(b) && memcmp(buf, b, sizeof(b)) == 0, "reading the open /t/b");
+    hello_oper.release("/t/b", &fi);
+    test_expect("/t/b", b, sizeof(b));
+    CHECK(test_free_entries() == entries, "%ld free entries, not %ld",
+          test_free_entries(), entries);
+    CHECK(stats.ops_undone > undone, "nothing was undone");
+    CHECK(test_free_blocks() == 0, "%ld free blocks, not 0", test_free_blocks());
+
+    test_remount();
+    test_expect("/t/a", a, sizeof(a));
+    test_expect("/t/b", b, sizeof(b));
+    test_expect("/t/c", c, sizeof(c));
+    test_pattern(a, 1, 0, 1);
+    test_expect(SNAP_PATH "/t/a", a, sizeof(a));
+    hello_oper.destroy(NULL);
+}
+
+/*
+ * A block that doesn't match its checksum fails the operation that reads
+ * it with EIO, which may have written the blocks before it already: a
+ * write over the blocks on both sides of the bad one, or an append that
+ * walks past it, must leave the file as it was.
+ */
+static void test_checksum_eio(void)
+{
+    char a[4 * MAX_DATA_IN_BLOCK], buf[4 * MAX_DATA_IN_BLOCK];
+    cs1550_disk_block block, good, bad;
+    struct fuse_file_info fi;
+    long res;
+
+    test_format();
+    if ((res = hello_oper.mkdir("/t", 0755)) != 0) {
+        test_die("mkdir", res);
+    }
+    test_mknod("/t/a");
+    test_pattern(a, sizeof(a), 0, 1);
+    CHECK(test_write("/t/a", a, sizeof(a), 0) == sizeof(a), "writing /t/a");
+
+    //without fsck, which would read every block once and be done with it
+    hello_oper.destroy(NULL);
+    if ((res = cs1550_mount(FSCK_OFF, NULL)) != 0) {
+        test_die("mount", res);
+    }
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    if ((res = hello_oper.open("/t/a", &fi)) != 0) {
+        test_die("open", res);
+    }
+    struct cs1550_handle *h = handle_open(&fi);
+    disk_read(&block, BLOCK_SIZE, h->start);
+    long pos = block.nNextBlock;
+    disk_read(&good, BLOCK_SIZE, pos);
+    bad = good;
+    bad.data[0] ^= 1;
+    if (pwrite(disk_fd, &bad, BLOCK_SIZE, pos) != BLOCK_SIZE) {
+        test_die("corrupting a block", errno);
+    }
+    unsigned long undone = stats.ops_undone;
+    log_level = -1;
+
+    test_pattern(buf, sizeof(buf), 0, 2);
+    res = hello_oper.write("/t/a", buf, sizeof(buf), 0, &fi);
+    CHECK(res == -EIO, "overwriting /t/a returned %ld", res);
+    res = hello_oper.write("/t/a", buf, 100, sizeof(a), &fi);
+    CHECK(res == -EIO, "appending to /t/a returned %ld", res);
+    CHECK(stats.ops_undone == undone + 2, "%lu operations undone, not 2",
+          stats.ops_undone - undone);
+
+    //with the block as it was, so is the file
+    if (pwrite(disk_fd, &good, BLOCK_SIZE, pos) != BLOCK_SIZE) {
+        test_die("repairing the block", errno);
+    }
+    test_expect("/t/a", a, sizeof(a));
+    hello_oper.release("/t/a", &fi);
+    test_remount();
+    test_expect("/t/a", a, sizeof(a));
+    hello_oper.destroy(NULL);
+}
+
+//blocks the files take
+static long test_used_blocks(long free_before)
+{
+    return free_before - test_free_blocks();
+}
+
+/*
+ * A compressed file keeps its data in chunks, found through its chunk
+ * index. Overwrites that turn a chunk from compressed into stored as it is
+ * and back, or straddle two chunks, and appends that take the index past
+ * its first block must all read back as written, through the same handle
+ * and after a remount, and unlinking the file gives back every block.
+ */
+static void test_compress(void)
+{
+    size_t max = (CHUNK_REFS + 8) * CHUNK_SIZE;
+    char *want = malloc(max);
+    size_t size = 5 * CHUNK_SIZE + 1000;
+    long res;
+
+    test_format();
+    if ((res = hello_oper.mkdir("/t", 0755)) != 0) {
+        test_die("mkdir", res);
+    }
+    long before = test_free_blocks();
+    compress_files = 1;
+    test_mknod("/t/c");
+    compress_files = 0;
+
+    test_text(want, size, 0, 1);
+    CHECK(test_write("/t/c", want, size, 0) == (int) size, "writing /t/c");
+    test_expect("/t/c", want, size);
+    CHECK(test_used_blocks(before) * (long) MAX_DATA_IN_BLOCK < (long) size / 4,
+          "%ld blocks for %zu bytes of text", test_used_blocks(before), size);
+
+    //the second chunk doesn't compress anymore, then only part of it,
+    //then it does again
+    test_random(want + CHUNK_SIZE, CHUNK_SIZE, 2);
+    CHECK(test_write("/t/c", want + CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE) == CHUNK_SIZE,
+          "overwriting the second chunk");
+    test_expect("/t/c", want, size);
+    test_text(want + CHUNK_SIZE + 100, 200, CHUNK_SIZE + 100, 3);
+    CHECK(test_write("/t/c", want + CHUNK_SIZE + 100, 200, CHUNK_SIZE + 100) == 200,
+          "overwriting part of the second chunk");
+    test_expect("/t/c", want, size);
+    test_text(want + CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE, 4);
+    CHECK(test_write("/t/c", want + CHUNK_SIZE, CHUNK_SIZE, CHUNK_SIZE) == CHUNK_SIZE,
+          "overwriting the second chunk again");
+    test_expect("/t/c", want, size);
+
+    //across the third and fourth
+    test_random(want + 3 * CHUNK_SIZE - 300, 600, 5);
+    CHECK(test_write("/t/c", want + 3 * CHUNK_SIZE - 300, 600, 3 * CHUNK_SIZE - 300) == 600,
+          "overwriting across two chunks");
+    test_expect("/t/c", want, size);
+
+    //more chunks than the first index block has refs
+    while (size < max) {
+        size_t n = max - size < 3 * CHUNK_SIZE + 7 ? max - size : 3 * CHUNK_SIZE + 7;
+        test_text(want + size, n, size, 6);
+        CHECK(test_write("/t/c", want + size, n, size) == (int) n, "appending at %zu", size);
+        size += n;
+    }
+    test_expect("/t/c", want, size);
+    CHECK(stats.chunk_bytes_out < stats.chunk_bytes_in / 4, "%lu bytes stored for %lu",
+          stats.chunk_bytes_out, stats.chunk_bytes_in);
+
+    test_remount();
+    test_expect("/t/c", want, size);
+    CHECK(hello_oper.unlink("/t/c") == 0, "unlinking /t/c");
+    CHECK(test_free_blocks() == before, "%ld blocks left after unlinking",
+          test_used_blocks(before));
+    test_remount();
+    hello_oper.destroy(NULL);
+    free(want);
+}
+
+//refs to the chunk holding the CHUNK_SIZE bytes at data, 0 if there is none
+static unsigned int test_chunk_refs(const char *data)
+{
+    unsigned char tmp[CHUNK_SIZE];
+    int i = chunk_find(chunk_hash((const unsigned char *) data, CHUNK_SIZE),
+                       (const unsigned char *) data, CHUNK_SIZE, tmp);
+    return i == -1 ? 0 : chunk_entry(i)->nRefs;
+}
+
+//chunks in the chunk table
+static int test_chunks(void)
+{
+    int i, n = 0;
+    for (i = 0; i < (int) (chunk_table.nblocks * CHUNK_ENTRIES); i++) {
+        n += chunk_entry(i)->nStart != 0;
+    }
+    return n;
+}
+
+/*
+ * Deduplicated files share chunks with the same contents, each counting the
+ * refs it has. Storing the same data twice takes no more blocks for it;
+ * writing a shared chunk copies it and moves one ref; the last ref going,
+ * by an overwrite or an unlink, frees the chunk.
+ */
+static void test_dedup(void)
+{
+    char x[3 * CHUNK_SIZE], y[CHUNK_SIZE], c[3 * CHUNK_SIZE];
+    long res;
+    int i;
+
+    test_format();
+    if ((res = hello_oper.mkdir("/t", 0755)) != 0) {
+        test_die("mkdir", res);
+    }
+    long before = test_free_blocks();
+    dedup_files = 1;
+    test_mknod("/t/a");
+    test_mknod("/t/b");
+    test_mknod("/t/c");
+    dedup_files = 0;
+    test_random(x, sizeof(x), 1);
+    test_random(y, sizeof(y), 2);
+    for (i = 0; i < 3; i++) {
+        memcpy(c + i * CHUNK_SIZE, x, CHUNK_SIZE);
+    }
+
+    CHECK(test_write("/t/a", x, sizeof(x), 0) == sizeof(x), "writing /t/a");
+    long used = test_used_blocks(before);
+    CHECK(test_write("/t/b", x, sizeof(x), 0) == sizeof(x), "writing /t/b");
+    CHECK(test_used_blocks(before) - used <= 1, "the copy took %ld blocks",
+          test_used_blocks(before) - used);
+    CHECK(test_write("/t/c", c, sizeof(c), 0) == sizeof(c), "writing /t/c");
+    CHECK(test_chunks() == 3, "%d chunks, not 3", test_chunks());
+    CHECK(test_chunk_refs(x) == 5, "%u refs to the first chunk, not 5", test_chunk_refs(x));
+    CHECK(test_chunk_refs(x + CHUNK_SIZE) == 2, "%u refs to the second chunk, not 2",
+          test_chunk_refs(x + CHUNK_SIZE));
+
+    //a shared chunk is copied, the old one keeps its other ref
+    CHECK(test_write("/t/a", y, sizeof(y), CHUNK_SIZE) == sizeof(y), "overwriting /t/a");
+    CHECK(test_chunk_refs(x + CHUNK_SIZE) == 1, "%u refs to the second chunk, not 1",
+          test_chunk_refs(x + CHUNK_SIZE));
+    CHECK(test_chunk_refs(y) == 1, "%u refs to the new chunk, not 1", test_chunk_refs(y));
+    CHECK(test_chunks() == 4, "%d chunks, not 4", test_chunks());
+
+    //then shared again, and the old one goes with its last ref
+    CHECK(test_write("/t/b", y, sizeof(y), CHUNK_SIZE) == sizeof(y), "overwriting /t/b");
+    CHECK(test_chunk_refs(x + CHUNK_SIZE) == 0, "%u refs to the second chunk, not 0",
+          test_chunk_refs(x + CHUNK_SIZE));
+    CHECK(test_chunk_refs(y) == 2, "%u refs to the new chunk, not 2", test_chunk_refs(y));
+    CHECK(test_chunks() == 3, "%d chunks, not 3", test_chunks());
+    memcpy(x + CHUNK_SIZE, y, CHUNK_SIZE);
+    test_expect("/t/a", x, sizeof(x));
+    test_expect("/t/b", x, sizeof(x));
+    test_expect("/t/c", c, sizeof(c));
+
+    test_remount();
+    CHECK(test_chunk_refs(x) == 5, "%u refs to the first chunk after remounting, not 5",
+          test_chunk_refs(x));
+    test_expect("/t/a", x, sizeof(x));
+    test_expect("/t/c", c, sizeof(c));
+
+    CHECK(hello_oper.unlink("/t/c") == 0, "unlinking /t/c");
+    CHECK(test_chunk_refs(x) == 2, "%u refs to the first chunk, not 2", test_chunk_refs(x));
+    test_expect("/t/a", x, sizeof(x));
+    CHECK(hello_oper.unlink("/t/a") == 0 && hello_oper.unlink("/t/b") == 0, "unlinking the rest");
+    CHECK(test_chunks() == 0, "%d chunks left", test_chunks());
+    CHECK(test_used_blocks(before) == chunk_table.nblocks, "%ld blocks left, not the table's %ld",
+          test_used_blocks(before), chunk_table.nblocks);
+    test_remount();
+    hello_oper.destroy(NULL);
+}
+
+//run call, an ll_* function, as the low-level callbacks do
+#define LL(call) (fs_enter(), ll_leave(call))
+
+/*
+ * A file's inode number is its handle's entry in inodes, which the kernel
+ * forgetting the file gives back with its generation raised: the number
+ * then names nothing (ESTALE) until a new file takes it, under another
+ * generation. fi->fh is checked the same way, so an open of a file that is
+ * gone, or of another file, or a number never given out, gets EBADF.
+ */
+static void test_inodes(void)
+{
+    struct fuse_entry_param dir, e, other;
+    struct fuse_file_info fi, fi_other, stale;
+    char a[300], b[300], buf[300];
+    struct stat st;
+    long res;
+
+    test_format();
+    if ((res = hello_oper.mkdir("/t", 0755)) != 0) {
+        test_die("mkdir", res);
+    }
+    test_mknod("/t/a");
+    test_mknod("/t/b");
+    test_pattern(a, sizeof(a), 0, 1);
+    test_pattern(b, sizeof(b), 0, 2);
+    CHECK(test_write("/t/a", a, sizeof(a), 0) == sizeof(a), "writing /t/a");
+    CHECK(test_write("/t/b", b, sizeof(b), 0) == sizeof(b), "writing /t/b");
+
+    if ((res = LL(ll_lookup(FUSE_ROOT_ID, "t", &dir))) != 0
+        || (res = LL(ll_lookup(dir.ino, "a", &e))) != 0
+        || (res = LL(ll_lookup(dir.ino, "b", &other))) != 0) {
+        test_die("lookup", res);
+    }
+    CHECK(e.ino != other.ino, "/t/a and /t/b are both inode %lu", (unsigned long) e.ino);
+    memset(&fi, 0, sizeof(fi));
+    memset(&fi_other, 0, sizeof(fi_other));
+    fi.flags = fi_other.flags = O_RDWR;
+    if ((res = LL(ll_open(e.ino, &fi))) != 0 || (res = LL(ll_open(other.ino, &fi_other))) != 0) {
+        test_die("open", res);
+    }
+    res = LL(ll_read(e.ino, buf, sizeof(buf), 0, &fi));
+    CHECK(res == sizeof(a) && memcmp(buf, a, sizeof(a)) == 0, "reading /t/a returned %ld", res);
+
+    //an open of another file, or with another generation, or never made
+    res = LL(ll_read(e.ino, buf, sizeof(buf), 0, &fi_other));
+    CHECK(res == -EBADF, "reading /t/a through /t/b's open returned %ld", res);
+    res = LL(ll_write(e.ino, b, sizeof(b), 0, &fi_other));
+    CHECK(res == -EBADF, "writing /t/a through /t/b's open returned %ld", res);
+    stale = fi;
+    stale.fh ^= (uint64_t) 1 << 32;
+    res = LL(ll_read(e.ino, buf, sizeof(buf), 0, &stale));
+    CHECK(res == -EBADF, "reading with another generation returned %ld", res);
+    res = hello_oper.write("/t/a", b, sizeof(b), 0, &stale);
+    CHECK(res == -EBADF, "writing by path with another generation returned %ld", res);
+    stale.fh = 12345;
+    res = LL(ll_write(e.ino, b, sizeof(b), 0, &stale));
+    CHECK(res == -EBADF, "writing with a made up fh returned %ld", res);
+    CHECK(hello_oper.release("/t/a", &stale) == -EBADF, "releasing a made up fh");
+    test_expect("/t/a", a, sizeof(a));
+
+    //gone and forgotten, its number and open name nothing
+    stale = fi;
+    CHECK(hello_oper.release("/t/a", &fi) == 0, "releasing /t/a");
+    CHECK(LL(ll_unlink(dir.ino, "a")) == 0, "unlinking /t/a");
+    CHECK(LL(ll_getattr(e.ino, &st)) == 0 && st.st_nlink == 0,
+          "/t/a is still there until it is forgotten");
+    CHECK(LL(ll_forget(e.ino, 1)) == 0, "forgetting /t/a");
+    res = LL(ll_getattr(e.ino, &st));
+    CHECK(res == -ESTALE, "getattr of forgotten /t/a returned %ld", res);
+    res = LL(ll_open(e.ino, &fi));
+    CHECK(res == -ESTALE, "opening forgotten /t/a returned %ld", res);
+    res = LL(ll_read(e.ino, buf, sizeof(buf), 0, &stale));
+    CHECK(res == -EBADF, "reading through the released open returned %ld", res);
+
+    //the next file takes the number, under a new generation, and the old
+    //open still doesn't reach it
+    struct fuse_entry_param c;
+    if ((res = LL(ll_mknod(dir.ino, "c", &c))) != 0) {
+        test_die("mknod", res);
+    }
+    CHECK(c.ino == e.ino, "/t/c is inode %lu, not /t/a's %lu", (unsigned long) c.ino,
+          (unsigned long) e.ino);
+    CHECK(c.generation != e.generation, "/t/c has /t/a's generation %lu",
+          (unsigned long) c.generation);
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+    if ((res = LL(ll_open(c.ino, &fi))) != 0) {
+        test_die("open", res);
+    }
+    CHECK(fi.fh != stale.fh, "/t/c's open has the number /t/a's had");
+    res = LL(ll_write(c.ino, b, sizeof(b), 0, &stale));
+    CHECK(res == -EBADF, "writing /t/c through /t/a's old open returned %ld", res);
+    res = LL(ll_read(c.ino, buf, sizeof(buf), 0, &fi));
+    CHECK(res == 0, "reading empty /t/c returned %ld", res);
+
+    CHECK(hello_oper.release("/t/c", &fi) == 0 && hello_oper.release("/t/b", &fi_other) == 0,
+          "releasing the rest");
+    CHECK(LL(ll_forget(c.ino, 1)) == 0 && LL(ll_forget(other.ino, 1)) == 0
+          && LL(ll_forget(dir.ino, 1)) == 0, "forgetting the rest");
+    test_expect("/t/b", b, sizeof(b));
+    test_remount();
+    hello_oper.destroy(NULL);
+}
+
+static const struct
+{
+    const char *name;
+    void (*run)(void);
+} tests[] = {
+    { "snapshot_enospc", test_snapshot_enospc },
+    { "checksum_eio", test_checksum_eio },
+    { "compress", test_compress },
+    { "dedup", test_dedup },
+    { "inodes", test_inodes },
+};
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: cs1550_test [-d scratch_dir] [test...]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    char scratch[] = "/tmp/cs1550_test.XXXXXX";
+    const char *dir = NULL;
+    size_t i;
+    int opt, j;
+
+    while ((opt = getopt(argc, argv, "d:")) != -1) {
+        switch (opt) {
+        case 'd': dir = optarg; break;
+        default: usage();
+        }
+    }
+    if (dir == NULL && (dir = mkdtemp(scratch)) == NULL) {
+        test_die("mkdtemp", errno);
+    }
+    if (chdir(dir) != 0) {
+        test_die(dir, errno);
+    }
+
+    long ran = 0;
+    for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        int wanted = optind == argc;
+        for (j = optind; j < argc; j++) {
+            wanted |= strcmp(argv[j], tests[i].name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        long failed = test.failed;
+        test.name = tests[i].name;
+        tests[i].run();
+        printf("%s: %s\n", tests[i].name, test.failed == failed ? "ok" : "FAILED");
+        ran++;
+    }
+    unlink(disk_path);
+
+    printf("cs1550_test: %ld tests, %ld checks, %ld failed\n", ran, test.checks, test.failed);
+    return test.failed != 0;
+}